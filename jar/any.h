@@ -12,8 +12,11 @@
 #ifndef _JAR_ANY_H
 #define _JAR_ANY_H
 
-#include <functional>
-#include <memory>
+#include <cstddef>
+#include <new>
+#include <type_traits>
+#include <typeinfo>
+#include <utility>
 
 
 namespace jar {
@@ -21,7 +24,41 @@ namespace jar {
 
 
 /**
- * @brief 任意对象的包装器。针对左引用采用地址引用的策略，针对右引用采用值拷贝的策略。
+ * @brief 类型标识。每个类型对应一个静态对象的地址，比较只需一次指针比较，不依赖RTTI。
+ * 
+ * 标识只在同一个进程内有效，不能持久化或跨进程传递。cv限定和引用会被去掉，type_of<const int &>() == type_of<int>()。
+ * 
+ * @author fomjar
+ * @date 2022/05/10
+ */
+using type_id = const void *;
+
+namespace detail {
+
+template <typename _Tp>
+struct type_tag {
+    static const char id;
+};
+
+template <typename _Tp>
+const char type_tag<_Tp>::id = 0;
+
+} // namespace detail
+
+template <typename _Tp>
+inline type_id type_of() {
+    return &detail::type_tag<typename std::remove_cv<typename std::remove_reference<_Tp>::type>::type>::id;
+}
+
+
+
+/**
+ * @brief 任意对象的包装器。按值保存：左值被复制，右值被移动。
+ * 
+ * 不超过4个指针大小、移动不抛异常的类型（整数、小结构体、std::function等）直接存放在对象内部，不分配内存；更大的类型存放在堆上。
+ * 复制、移动和析构通过每个类型一份的静态函数表完成，对象本身只多一个指针。
+ * 
+ * cast会检查类型，不匹配时抛出std::bad_cast；get在不匹配时返回nullptr。类型检查只比较type_id，不依赖RTTI。
  * 
  * 用法如下：
  * 
@@ -32,61 +69,175 @@ namespace jar {
  * a.cast<int>(); // 3
  * b.cast<float>(); // 3.3
  * c.cast<std::string>(); // "3.3.3"
+ * a.get<float>(); // nullptr
  * 
  * @author fomjar
  * @date 2022/04/30
  */
 class any {
 
-    using func_vv = std::function<void()>;
+    static const size_t INLINE_SIZE = 4 * sizeof(void *);
+
+    union storage {
+        void * ptr;
+        typename std::aligned_storage<INLINE_SIZE, alignof(std::max_align_t)>::type buf;
+    };
 
-public:
-    any()               { this->set_val(0); }
-    any(const any  & a) { this->set_any(std::forward<const any>(a)); }
-    any(      any  & a) { this->set_any(std::forward<      any>(a)); }
-    any(      any && a) { this->set_any(std::forward<      any>(a)); }
-    template <typename _Tp>
-    any(const _Tp  & v) { this->set_val(std::forward<const _Tp>(v)); }
     template <typename _Tp>
-    any(      _Tp && v) { this->set_val(std::forward<      _Tp>(v)); }
-    ~any()              { this->d(); }
-    
-    any & operator=(const any  & a) { this->set_any(std::forward<const any>(a)); return *this; }
+    struct is_inline : std::integral_constant<bool,
+            sizeof(_Tp) <= INLINE_SIZE
+            && alignof(std::max_align_t) % alignof(_Tp) == 0
+            && std::is_nothrow_move_constructible<_Tp>::value> { };
+
+    struct vtable {
+        type_id         type;
+        void          (* destroy)   (storage &);
+        void          (* copy)      (const storage & from, storage & to);
+        void          (* move)      (storage & from, storage & to);
+        bool            local;
+    };
+
+    template <typename _Tp, bool = is_inline<_Tp>::value>
+    struct handler {
+        static _Tp * get(const storage & s) { return (_Tp *) &s.buf; }
+        template <typename ... _Ap>
+        static void create(storage & s, _Ap && ... args) { new (&s.buf) _Tp(std::forward<_Ap>(args)...); }
+        static void destroy(storage & s) { get(s)->~_Tp(); }
+        static void copy(const storage & from, storage & to) { create(to, *get(from)); }
+        static void move(storage & from, storage & to) {
+            create(to, std::move(*get(from)));
+            destroy(from);
+        }
+    };
+
     template <typename _Tp>
-    any & operator=(const _Tp  & v) { this->set_val(std::forward<const _Tp>(v)); return *this; }
+    struct handler<_Tp, false> {
+        static _Tp * get(const storage & s) { return (_Tp *) s.ptr; }
+        template <typename ... _Ap>
+        static void create(storage & s, _Ap && ... args) { s.ptr = new _Tp(std::forward<_Ap>(args)...); }
+        static void destroy(storage & s) { delete get(s); }
+        static void copy(const storage & from, storage & to) { create(to, *get(from)); }
+        static void move(storage & from, storage & to) { to.ptr = from.ptr; }
+    };
+
     template <typename _Tp>
-    any & operator=(      _Tp && v) { this->set_val(std::forward<      _Tp>(v)); return *this; }
+    static const vtable * table() {
+        static const vtable t = {
+            type_of<_Tp>(),
+            &handler<_Tp>::destroy,
+            &handler<_Tp>::copy,
+            &handler<_Tp>::move,
+            is_inline<_Tp>::value,
+        };
+        return &t;
+    }
 
     template <typename _Tp>
-           _Tp & cast() const { return * (_Tp *) this->v; }
-    const char * type() const { return this->t; }
+    using enable_if_value = typename std::enable_if<!std::is_same<typename std::decay<_Tp>::type, any>::value>::type;
 
-private:
-    void set_any(const any & a) {
-        this->t = a.t;
-        this->v = a.v;
-        this->d = a.d;
+public:
+    any() : vt(nullptr) { }
+    any(const any & a) : vt(a.vt) { if (this->vt) this->vt->copy(a.s, this->s); }
+    any(any && a) noexcept : vt(a.vt) {
+        if (this->vt) this->vt->move(a.s, this->s);
+        a.vt = nullptr;
+    }
+    template <typename _Tp, typename = enable_if_value<_Tp>>
+    any(_Tp && v) : vt(nullptr) { this->emplace<typename std::decay<_Tp>::type>(std::forward<_Tp>(v)); }
+    ~any() { this->reset(); }
 
-        auto a0 = const_cast<any *>(&a);
-        a0->d = [] { };
+    any & operator=(const any & a) {
+        if (this != &a) any(a).swap(*this);
+        return *this;
     }
-    template <typename _Tp>
-    void set_val(const _Tp & v) {
-        this->t = typeid(v).name();
-        this->v = (void *) std::addressof(v);
-        this->d = [] { };
+    any & operator=(any && a) noexcept {
+        if (this != &a) {
+            this->reset();
+            if (a.vt) a.vt->move(a.s, this->s);
+            this->vt = a.vt;
+            a.vt = nullptr;
+        }
+        return *this;
+    }
+    template <typename _Tp, typename = enable_if_value<_Tp>>
+    any & operator=(_Tp && v) {
+        this->emplace<typename std::decay<_Tp>::type>(std::forward<_Tp>(v));
+        return *this;
+    }
+
+    /**
+     * @brief 就地构造新值，替换原有的值。
+     * 
+     * @tparam _Tp 
+     * @tparam _Ap 
+     * @param args 
+     * @return _Tp&  
+     */
+    template <typename _Tp, typename ... _Ap>
+    _Tp & emplace(_Ap && ... args) {
+        static_assert(std::is_copy_constructible<_Tp>::value, "jar::any requires copy constructible types");
+
+        this->reset();
+        handler<_Tp>::create(this->s, std::forward<_Ap>(args)...);
+        this->vt = table<_Tp>();
+        return *handler<_Tp>::get(this->s);
+    }
+
+    void reset() {
+        if (!this->vt) return;
+        this->vt->destroy(this->s);
+        this->vt = nullptr;
+    }
+
+    void swap(any & a) noexcept {
+        if (this == &a) return;
+        storage t;
+        if (a.vt)    a.vt->move(a.s, t);
+        if (this->vt) this->vt->move(this->s, a.s);
+        if (a.vt)    a.vt->move(t, this->s);
+        std::swap(this->vt, a.vt);
     }
+
+    bool empty() const { return nullptr == this->vt; }
+
+    /**
+     * @brief 是否保存着_Tp类型的值。
+     */
     template <typename _Tp>
-    void set_val(_Tp && v) {
-        this->t = typeid(v).name();
-        auto p = new _Tp(v);
-        this->v = (void *) p;
-        this->d = [p] { delete p; };
+    bool is() const { return this->vt && this->vt->type == type_of<_Tp>(); }
+
+    /**
+     * @brief 取值。
+     * 
+     * @tparam _Tp 
+     * @return _Tp* 类型不匹配或为空时为nullptr
+     */
+    template <typename _Tp>
+    _Tp * get() const { return this->is<_Tp>() ? (_Tp *) this->address() : nullptr; }
+
+    /**
+     * @brief 取值。
+     * 
+     * @tparam _Tp 
+     * @return _Tp&  
+     * @throw std::bad_cast 类型不匹配或为空
+     */
+    template <typename _Tp>
+    _Tp & cast() const {
+        if (!this->is<_Tp>()) throw std::bad_cast();
+        return * (_Tp *) this->address();
     }
 
-    const char * t; // type
-          void * v; // value
-       func_vv   d; // delete
+    /**
+     * @brief 所保存值的类型标识，为空时为type_of<void>()。
+     */
+    type_id type() const { return this->vt ? this->vt->type : type_of<void>(); }
+
+private:
+    void * address() const { return this->vt->local ? (void *) &this->s.buf : this->s.ptr; }
+
+    const vtable  * vt;
+    mutable storage s;
 };
 
 
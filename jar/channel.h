@@ -0,0 +1,498 @@
+/**
+ * @file channel.h
+ * @author fomjar (fomjar@gmail.com)
+ * @brief 
+ * @version 0.1
+ * @date 2022-05-13
+ * 
+ * @copyright Copyright (c) 2022
+ * 
+ */
+
+#ifndef _JAR_CHANNEL_H
+#define _JAR_CHANNEL_H
+
+#include "clock.h"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <thread>
+#include <type_traits>
+#include <utility>
+
+namespace jar {
+
+
+
+namespace detail {
+
+/**
+ * @brief 缓存行大小。热点字段之间用整行的填充隔开而不是alignas，对象用普通的new分配时也不会共享缓存行。
+ */
+const size_t CACHE_LINE = 64;
+
+inline size_t ring_capacity(size_t capacity) {
+    size_t c = 2;
+    while (c < capacity) c <<= 1;
+    return c;
+}
+
+template <typename _Tp>
+struct ring_cell {
+    typename std::aligned_storage<sizeof(_Tp), alignof(_Tp)>::type buf;
+
+    _Tp * get() { return (_Tp *) &this->buf; }
+};
+
+} // namespace detail
+
+
+
+/**
+ * @brief 单生产者单消费者的无锁环形队列。容量向上取整为2的幂，元素原地构造在环内，不为单个元素分配内存。
+ * 
+ * 生产者和消费者各自缓存对方的位置，只在看起来满或空时才重新读取，减少缓存行的来回传递。
+ * 同一时刻只能有一个线程push、一个线程pop。
+ * 
+ * @tparam _Tp 可以是只能移动的类型
+ * 
+ * @author fomjar
+ * @date 2022/05/13
+ */
+template <typename _Tp>
+class spsc_ring {
+
+public:
+    explicit spsc_ring(size_t capacity) :
+        mask(detail::ring_capacity(capacity) - 1),
+        cells(new detail::ring_cell<_Tp>[this->mask + 1]),
+        head(0), tail_cache(0), tail(0), head_cache(0) { }
+    ~spsc_ring() {
+        _Tp v;
+        while (this->try_pop(v)) { }
+    }
+    spsc_ring(const spsc_ring &) = delete;
+    spsc_ring & operator=(const spsc_ring &) = delete;
+
+    size_t capacity() const { return this->mask + 1; }
+    size_t size() const { return this->tail.load(std::memory_order_acquire) - this->head.load(std::memory_order_acquire); }
+
+    /**
+     * @brief 入队。队满时返回false，v保持不变。
+     */
+    template <typename _Up>
+    bool try_push(_Up && v) {
+        auto t = this->tail.load(std::memory_order_relaxed);
+        if (t - this->head_cache > this->mask) {
+            this->head_cache = this->head.load(std::memory_order_acquire);
+            if (t - this->head_cache > this->mask) return false;
+        }
+        new (this->cells[t & this->mask].get()) _Tp(std::forward<_Up>(v));
+        this->tail.store(t + 1, std::memory_order_release);
+        return true;
+    }
+
+    /**
+     * @brief 出队。队空时返回false。
+     */
+    bool try_pop(_Tp & v) {
+        auto h = this->head.load(std::memory_order_relaxed);
+        if (h == this->tail_cache) {
+            this->tail_cache = this->tail.load(std::memory_order_acquire);
+            if (h == this->tail_cache) return false;
+        }
+        auto p = this->cells[h & this->mask].get();
+        v = std::move(*p);
+        p->~_Tp();
+        this->head.store(h + 1, std::memory_order_release);
+        return true;
+    }
+
+private:
+    const size_t                                    mask;
+    std::unique_ptr<detail::ring_cell<_Tp>[]>       cells;
+
+    char                                            pad0[detail::CACHE_LINE];
+    std::atomic<size_t>                             head;       // 消费者写
+    size_t                                          tail_cache; // 消费者缓存的tail
+    char                                            pad1[detail::CACHE_LINE];
+    std::atomic<size_t>                             tail;       // 生产者写
+    size_t                                          head_cache; // 生产者缓存的head
+    char                                            pad2[detail::CACHE_LINE];
+};
+
+
+
+/**
+ * @brief 多生产者多消费者的无锁环形队列。每个槽位带一个序号，生产者和消费者各自通过CAS抢占位置，
+ * 序号表明槽位处于可写还是可读状态。容量向上取整为2的幂，元素原地构造在环内，不为单个元素分配内存。
+ * 
+ * @tparam _Tp 可以是只能移动的类型
+ * 
+ * @author fomjar
+ * @date 2022/05/13
+ */
+template <typename _Tp>
+class mpmc_ring {
+
+    struct cell : detail::ring_cell<_Tp> {
+        std::atomic<size_t> seq;
+    };
+
+public:
+    explicit mpmc_ring(size_t capacity) :
+        mask(detail::ring_capacity(capacity) - 1),
+        cells(new cell[this->mask + 1]),
+        head(0), tail(0) {
+        for (size_t i = 0; i <= this->mask; i++) this->cells[i].seq.store(i, std::memory_order_relaxed);
+    }
+    ~mpmc_ring() {
+        _Tp v;
+        while (this->try_pop(v)) { }
+    }
+    mpmc_ring(const mpmc_ring &) = delete;
+    mpmc_ring & operator=(const mpmc_ring &) = delete;
+
+    size_t capacity() const { return this->mask + 1; }
+    size_t size() const {
+        auto t = this->tail.load(std::memory_order_acquire);
+        auto h = this->head.load(std::memory_order_acquire);
+        return t > h ? t - h : 0;
+    }
+
+    /**
+     * @brief 入队。队满时返回false，v保持不变。
+     */
+    template <typename _Up>
+    bool try_push(_Up && v) {
+        auto t = this->tail.load(std::memory_order_relaxed);
+        while (true) {
+            auto & c = this->cells[t & this->mask];
+            auto seq = c.seq.load(std::memory_order_acquire);
+            auto diff = (intptr_t) seq - (intptr_t) t;
+            if (0 == diff) {
+                if (this->tail.compare_exchange_weak(t, t + 1, std::memory_order_relaxed)) {
+                    new (c.get()) _Tp(std::forward<_Up>(v));
+                    c.seq.store(t + 1, std::memory_order_release);
+                    return true;
+                }
+            } else if (diff < 0) {
+                return false;
+            } else {
+                t = this->tail.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    /**
+     * @brief 出队。队空时返回false。
+     */
+    bool try_pop(_Tp & v) {
+        auto h = this->head.load(std::memory_order_relaxed);
+        while (true) {
+            auto & c = this->cells[h & this->mask];
+            auto seq = c.seq.load(std::memory_order_acquire);
+            auto diff = (intptr_t) seq - (intptr_t) (h + 1);
+            if (0 == diff) {
+                if (this->head.compare_exchange_weak(h, h + 1, std::memory_order_relaxed)) {
+                    auto p = c.get();
+                    v = std::move(*p);
+                    p->~_Tp();
+                    c.seq.store(h + this->mask + 1, std::memory_order_release);
+                    return true;
+                }
+            } else if (diff < 0) {
+                return false;
+            } else {
+                h = this->head.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+private:
+    const size_t                    mask;
+    std::unique_ptr<cell[]>         cells;
+
+    char                            pad0[detail::CACHE_LINE];
+    std::atomic<size_t>             head;
+    char                            pad1[detail::CACHE_LINE];
+    std::atomic<size_t>             tail;
+    char                            pad2[detail::CACHE_LINE];
+};
+
+
+
+/**
+ * @brief 有界通道。在执行器之间传递数据，不需要把每个元素包装成任务。
+ * 
+ * 收发的快路径只访问无锁环形队列；队满或队空时先让出几次CPU，仍不满足才在条件变量上阻塞。
+ * 只有存在阻塞中的对端时，收发才会加锁通知，因此稳定流动时没有锁和系统调用。
+ * 
+ * 关闭后不能再发送，接收方取完剩余元素后接收返回false，所有阻塞中的收发都会被唤醒。
+ * 
+ * jar::mpmc_channel<std::string> ch(1024);
+ * jar::async((jar::func_vv) [&ch] {
+ *     std::string s;
+ *     while (ch.recv(s)) handle(s);
+ * });
+ * ch.send("hello");
+ * ch.close();
+ * 
+ * @tparam _Tp 元素类型，需要能默认构造和移动赋值，可以是只能移动的类型
+ * @tparam _Rg 环形队列实现，spsc_ring或mpmc_ring
+ * 
+ * @see spsc_channel
+ * @see mpmc_channel
+ * 
+ * @author fomjar
+ * @date 2022/05/13
+ */
+template <typename _Tp, typename _Rg = mpmc_ring<_Tp>>
+class channel {
+
+public:
+    explicit channel(size_t capacity = 1024) :
+        ring(capacity), closed(false), pushing(0), mutex(), readable(), writable(), senders(0), receivers(0) { }
+    channel(const channel &) = delete;
+    channel & operator=(const channel &) = delete;
+
+    size_t  capacity()  const { return this->ring.capacity(); }
+    size_t  size()      const { return this->ring.size(); }
+    bool    is_closed() const { return this->closed.load(std::memory_order_acquire); }
+
+    /**
+     * @brief 关闭通道，唤醒所有阻塞中的收发。
+     */
+    void close() {
+        std::lock_guard<std::mutex> guard(this->mutex);
+        this->closed.store(true, std::memory_order_seq_cst);
+        this->readable.notify_all();
+        this->writable.notify_all();
+    }
+
+    /**
+     * @brief 尝试发送，不阻塞。
+     * 
+     * @return true 
+     * @return false 队满或已关闭，v保持不变
+     */
+    template <typename _Up>
+    bool try_send(_Up && v) {
+        if (!this->push(std::forward<_Up>(v))) return false;
+        this->wake(this->receivers, this->readable);
+        return true;
+    }
+
+    /**
+     * @brief 发送，队满时阻塞。
+     * 
+     * @return true 
+     * @return false 已关闭
+     */
+    template <typename _Up>
+    bool send(_Up && v) {
+        return this->send_until(std::forward<_Up>(v), INT64_MAX);
+    }
+
+    /**
+     * @brief 发送，队满时最多阻塞给定时长。
+     * 
+     * @return true 
+     * @return false 超时或已关闭，v保持不变
+     */
+    template <typename _Up, class _Rep, class _Period>
+    bool send_for(_Up && v, const std::chrono::duration<_Rep, _Period> & timeout) {
+        return this->send_until(std::forward<_Up>(v), channel::deadline(timeout));
+    }
+
+    /**
+     * @brief 尝试接收，不阻塞。
+     * 
+     * @return true 
+     * @return false 队空
+     */
+    bool try_recv(_Tp & v) {
+        if (!this->ring.try_pop(v)) return false;
+        this->wake(this->senders, this->writable);
+        return true;
+    }
+
+    /**
+     * @brief 接收，队空时阻塞。
+     * 
+     * @return true 
+     * @return false 已关闭且已取完
+     */
+    bool recv(_Tp & v) {
+        return this->recv_until(v, INT64_MAX);
+    }
+
+    /**
+     * @brief 接收，队空时最多阻塞给定时长。
+     * 
+     * @return true 
+     * @return false 超时，或已关闭且已取完
+     */
+    template <class _Rep, class _Period>
+    bool recv_for(_Tp & v, const std::chrono::duration<_Rep, _Period> & timeout) {
+        return this->recv_until(v, channel::deadline(timeout));
+    }
+
+    /**
+     * @brief 批量发送，依次移动[first, last)中的元素，队满时阻塞。
+     * 
+     * @return size_t 发送的数量，小于给定数量说明通道已关闭
+     */
+    template <typename _It>
+    size_t send_batch(_It first, _It last) {
+        size_t n = 0;
+        for (; first != last; first++, n++) {
+            if (this->is_closed()) break;
+            if (this->push(std::move(*first))) continue;
+            this->wake(this->receivers, this->readable);
+            if (!this->send_until(std::move(*first), INT64_MAX)) break;
+        }
+        if (n > 0) this->wake(this->receivers, this->readable);
+        return n;
+    }
+
+    /**
+     * @brief 批量接收，至少等到一个元素，之后取出已就绪的元素直到max个。
+     * 
+     * @param out 输出迭代器，如std::back_inserter(vec)
+     * @param max 
+     * @return size_t 接收的数量，为0说明已关闭且已取完
+     */
+    template <typename _Out>
+    size_t recv_batch(_Out out, size_t max) {
+        _Tp v;
+        if (0 == max || !this->recv(v)) return 0;
+        *out++ = std::move(v);
+        size_t n = 1;
+        while (n < max && this->ring.try_pop(v)) {
+            *out++ = std::move(v);
+            n++;
+        }
+        if (n > 1) this->wake(this->senders, this->writable);
+        return n;
+    }
+
+private:
+    /**
+     * @brief 超时换算成截止时间。超出int64范围的时长视为不限，先用浮点比较，避免换算成纳秒时溢出。
+     */
+    template <class _Rep, class _Period>
+    static int64_t deadline(const std::chrono::duration<_Rep, _Period> & timeout) {
+        auto now = steady_now_ns();
+        auto ns  = std::chrono::duration<double, std::nano>(timeout).count();
+        if (ns <= 0) return now;
+        if (ns >= (double) (INT64_MAX - now)) return INT64_MAX;
+        return now + std::chrono::duration_cast<std::chrono::nanoseconds>(timeout).count();
+    }
+
+    /**
+     * @brief 未关闭时入队。入队期间计入pushing，接收方在关闭后等它归零再判断是否已取完，与close竞争成功的发送不会留在队列里。
+     */
+    template <typename _Up>
+    bool push(_Up && v) {
+        this->pushing.fetch_add(1, std::memory_order_seq_cst);
+        bool done = !this->closed.load(std::memory_order_seq_cst) && this->ring.try_push(std::forward<_Up>(v));
+        this->pushing.fetch_sub(1, std::memory_order_release);
+        return done;
+    }
+
+    /**
+     * @brief 等待结束后最后取一次。已关闭时先等进行中的发送完成。
+     */
+    bool last(_Tp & v) {
+        if (this->closed.load(std::memory_order_seq_cst)) {
+            while (this->pushing.load(std::memory_order_seq_cst)) std::this_thread::yield();
+        }
+        return this->ring.try_pop(v);
+    }
+
+    /**
+     * @brief 唤醒阻塞中的对端。与阻塞方的登记配对的全屏障保证：要么这里看到登记，要么阻塞方在登记后看到新状态。
+     */
+    void wake(std::atomic<uint32_t> & waiters, std::condition_variable & cv) {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (0 == waiters.load(std::memory_order_relaxed)) return;
+        std::lock_guard<std::mutex> guard(this->mutex);
+        cv.notify_all();
+    }
+
+    /**
+     * @brief 先让出几次CPU再阻塞，阻塞前登记，条件在锁内重新检查。
+     * 
+     * @param attempt 尝试一次，成功返回true
+     */
+    template <typename _Fp>
+    bool wait(_Fp attempt, std::atomic<uint32_t> & waiters, std::condition_variable & cv, int64_t deadline) {
+        const int YIELDS = 16;
+        for (int i = 0; i < YIELDS; i++) {
+            if (attempt()) return true;
+            if (this->is_closed()) return false;
+            std::this_thread::yield();
+        }
+
+        std::unique_lock<std::mutex> lock(this->mutex);
+        waiters.fetch_add(1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        bool done = false;
+        while (!(done = attempt()) && !this->is_closed()) {
+            if (INT64_MAX == deadline) {
+                cv.wait(lock);
+            } else {
+                auto d = deadline - steady_now_ns();
+                if (d <= 0) break;
+                cv.wait_for(lock, std::chrono::nanoseconds(d));
+            }
+        }
+        waiters.fetch_sub(1, std::memory_order_relaxed);
+        return done;
+    }
+
+    template <typename _Up>
+    bool send_until(_Up && v, int64_t deadline) {
+        if (this->is_closed()) return false;
+        bool done = this->wait([this, &v] { return this->push(std::forward<_Up>(v)); },
+                this->senders, this->writable, deadline);
+        if (done) this->wake(this->receivers, this->readable);
+        return done;
+    }
+
+    bool recv_until(_Tp & v, int64_t deadline) {
+        // 关闭后仍要取完剩余元素
+        bool done = this->wait([this, &v] { return this->ring.try_pop(v); }, this->receivers, this->readable, deadline)
+            || this->last(v);
+        if (done) this->wake(this->senders, this->writable);
+        return done;
+    }
+
+    _Rg                         ring;
+    std::atomic<bool>           closed;
+    std::atomic<uint32_t>       pushing;    // 正在入队的发送方
+    std::mutex                  mutex;
+    std::condition_variable     readable;
+    std::condition_variable     writable;
+    std::atomic<uint32_t>       senders;    // 阻塞中的发送方
+    std::atomic<uint32_t>       receivers;  // 阻塞中的接收方
+};
+
+template <typename _Tp>
+using spsc_channel = channel<_Tp, spsc_ring<_Tp>>;
+
+template <typename _Tp>
+using mpmc_channel = channel<_Tp, mpmc_ring<_Tp>>;
+
+
+} // namespace jar
+
+
+#endif // _JAR_CHANNEL_H
@@ -0,0 +1,399 @@
+/**
+ * @file clock.h
+ * @author fomjar (fomjar@gmail.com)
+ * @brief 
+ * @version 0.1
+ * @date 2022-05-11
+ * 
+ * @copyright Copyright (c) 2022
+ * 
+ */
+
+#ifndef _JAR_CLOCK_H
+#define _JAR_CLOCK_H
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <time.h>
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <x86intrin.h>
+#endif
+
+namespace jar {
+
+
+
+/**
+ * @brief 单调时钟，单位：纳秒。不受系统时间调整影响，适合计算时间间隔。起点不确定，只能用于相减。
+ * 
+ * @return int64_t  
+ * 
+ * @author fomjar
+ * @date 2022/05/11
+ */
+inline int64_t steady_now_ns() {
+#if defined(CLOCK_MONOTONIC)
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000000000LL + ts.tv_nsec;
+#else
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+}
+
+/**
+ * @brief 粗粒度单调时钟，单位：纳秒。精度为内核时钟节拍（通常1~4毫秒），只读取内核已更新的时间，开销只有几纳秒。与steady_now_ns同一起点。
+ * 
+ * @return int64_t  
+ * 
+ * @author fomjar
+ * @date 2022/05/11
+ */
+inline int64_t coarse_now_ns() {
+#if defined(CLOCK_MONOTONIC_COARSE)
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return (int64_t) ts.tv_sec * 1000000000LL + ts.tv_nsec;
+#else
+    return steady_now_ns();
+#endif
+}
+
+
+
+/**
+ * @brief 基于不变TSC的时钟。读取只有一条rdtsc指令，按标定的频率换算成纳秒，与steady_now_ns同一起点。
+ * 
+ * 只在CPU声明不变TSC（频率恒定、各核同步）时启用，否则退化为steady_now_ns。标定在首次使用时进行，耗时约5毫秒，可以预先调用usable()提前完成。
+ * 与单调时钟之间会有缓慢的漂移，适合高频打点和计算短间隔，不适合长时间对齐。
+ * 
+ * auto beg = jar::tsc::now_ns();
+ * ...
+ * auto cost = jar::tsc::now_ns() - beg;
+ * 
+ * @author fomjar
+ * @date 2022/05/11
+ */
+class tsc {
+
+    struct state {
+        bool        usable;
+        uint64_t    base_ticks;
+        int64_t     base_ns;
+        uint64_t    mult;       // 每个tick的纳秒数，32位定点，小于2^32
+    };
+
+public:
+    /**
+     * @brief CPU是否提供不变TSC。
+     */
+    static bool invariant() {
+#if defined(__x86_64__) || defined(__i386__)
+        unsigned a, b, c, d;
+        return __get_cpuid(0x80000007, &a, &b, &c, &d) && (d & (1u << 8));
+#else
+        return false;
+#endif
+    }
+
+    static bool usable() { return calibration().usable; }
+
+    static uint64_t ticks() {
+#if defined(__x86_64__) || defined(__i386__)
+        return __rdtsc();
+#else
+        return (uint64_t) steady_now_ns();
+#endif
+    }
+
+    /**
+     * @brief 当前时间，单位：纳秒。
+     */
+    static int64_t now_ns() {
+        const auto & s = calibration();
+        if (!s.usable) return steady_now_ns();
+        return s.base_ns + (int64_t) scale(ticks() - s.base_ticks, s.mult);
+    }
+
+    /**
+     * @brief 标定出的TSC频率，单位：GHz。不可用时为0。
+     */
+    static double ghz() {
+        const auto & s = calibration();
+        return s.usable ? 4294967296.0 / s.mult : 0;
+    }
+
+private:
+    /**
+     * @brief (d * mult) >> 32，拆成高低两个32位分别乘，不依赖128位整数。mult小于2^32时低位乘积不会溢出。
+     */
+    static uint64_t scale(uint64_t d, uint64_t mult) {
+        return (d >> 32) * mult + (((d & 0xffffffffULL) * mult) >> 32);
+    }
+
+    static const state & calibration() {
+        static const state s = calibrate();
+        return s;
+    }
+
+    static state calibrate() {
+        state s { false, 0, 0, 0 };
+        if (!invariant()) return s;
+
+        const int64_t SPAN_NS = 5000000;
+        uint64_t t0, t1;
+        int64_t n0, n1;
+        sample(t0, n0);
+        while (steady_now_ns() - n0 < SPAN_NS) { }
+        sample(t1, n1);
+        if (t1 <= t0) return s;
+
+        // 标定区间只有几毫秒，左移32位不会溢出
+        s.mult          = ((uint64_t) (n1 - n0) << 32) / (t1 - t0);
+        s.base_ticks    = t1;
+        s.base_ns       = n1;
+        // 频率低于1GHz时每tick超过1纳秒，mult放不进32位，不启用
+        s.usable        = s.mult > 0 && s.mult < (1ULL << 32);
+        return s;
+    }
+
+    /**
+     * @brief 取一对同时刻的tick和纳秒。两次读取单调时钟夹住rdtsc，取间隔最小的一次，减少被抢占带来的误差。
+     */
+    static void sample(uint64_t & t, int64_t & n) {
+        int64_t best = INT64_MAX;
+        for (int i = 0; i < 16; i++) {
+            auto a = steady_now_ns();
+            auto x = ticks();
+            auto b = steady_now_ns();
+            if (b - a < best) {
+                best = b - a;
+                t = x;
+                n = a + (b - a) / 2;
+            }
+        }
+    }
+
+};
+
+
+
+/**
+ * @brief 定时执行器使用的时钟和等待源。执行器通过它读取当前时间、在条件变量上等待到期，替换为virtual_clock后时间只在调用advance时前进。
+ * 
+ * 等待可能被条件变量的通知提前唤醒，调用方需要重新检查条件。
+ * 
+ * @see real_clock
+ * @see virtual_clock
+ * 
+ * @author fomjar
+ * @date 2022/05/12
+ */
+class clock {
+
+public:
+    virtual ~clock() { }
+
+    /**
+     * @brief 当前时间，单位：纳秒。
+     */
+    virtual int64_t now_ns() = 0;
+
+    /**
+     * @brief 在持有lock的情况下等待cv，直到时间到达deadline或被通知。
+     * 
+     * @param lock 
+     * @param cv 
+     * @param deadline 本时钟的纳秒时间
+     */
+    virtual void wait_until(std::unique_lock<std::mutex> & lock, std::condition_variable & cv, int64_t deadline) = 0;
+
+    template <class _Rep, class _Period>
+    void wait_for(std::unique_lock<std::mutex> & lock, std::condition_variable & cv, const std::chrono::duration<_Rep, _Period> & duration) {
+        this->wait_until(lock, cv, this->now_ns() + std::chrono::duration_cast<std::chrono::nanoseconds>(duration).count());
+    }
+
+    /**
+     * @brief 唤醒在cv上等待的线程。执行器通过它而不是直接notify，时钟借此知道等待者已不再阻塞。
+     * 
+     * @param cv 
+     */
+    virtual void notify(std::condition_variable & cv) { cv.notify_all(); }
+
+    /**
+     * @brief 默认的真实时钟。
+     */
+    static clock & system();
+};
+
+
+
+/**
+ * @brief 真实时钟。时间取自steady_now_ns，等待直接使用条件变量的超时。
+ * 
+ * @author fomjar
+ * @date 2022/05/12
+ */
+class real_clock : public clock {
+
+public:
+    int64_t now_ns() override { return steady_now_ns(); }
+
+    void wait_until(std::unique_lock<std::mutex> & lock, std::condition_variable & cv, int64_t deadline) override {
+        auto d = deadline - this->now_ns();
+        if (d > 0) cv.wait_for(lock, std::chrono::nanoseconds(d));
+    }
+};
+
+inline clock & clock::system() {
+    static real_clock c;
+    return c;
+}
+
+
+
+/**
+ * @brief 虚拟时钟。时间从0开始，只在调用advance时前进，前进后唤醒所有到期的等待者，不需要真实地睡眠。
+ * 
+ * 用于测试和模拟：把执行器的时钟换成虚拟时钟后，一小时的定时任务可以在几毫秒内跑完，且每次运行的顺序一致。
+ * settle用于等待执行器处理完当前时刻的任务、重新进入等待。
+ * 
+ * jar::virtual_clock vc;
+ * jar::delayer d(std::chrono::hours(1));
+ * d.set_clock(vc);
+ * d.submit(task);
+ * d.start();
+ * vc.settle(1);
+ * vc.advance(std::chrono::hours(1)); // task立即执行
+ * 
+ * @author fomjar
+ * @date 2022/05/12
+ */
+class virtual_clock : public clock {
+
+    struct waiter {
+        std::condition_variable * cv;
+        int64_t                   deadline;
+        bool                    * fired;    // 指向等待线程栈上的标记，到期或被通知时置位并移除登记
+    };
+
+public:
+    virtual_clock() : now(0), mutex(), changed(), waiters() { }
+
+    int64_t now_ns() override {
+        std::lock_guard<std::mutex> guard(this->mutex);
+        return this->now;
+    }
+
+    /**
+     * @brief 登记后释放lock，在本时钟的mutex上等待，直到到期或通过notify(cv)被唤醒。
+     * 唤醒只在本时钟的mutex下进行，不需要访问执行器的mutex和cv，执行器析构后不会再被触及。
+     */
+    void wait_until(std::unique_lock<std::mutex> & lock, std::condition_variable & cv, int64_t deadline) override {
+        std::unique_lock<std::mutex> guard(this->mutex);
+        if (this->now >= deadline) return;
+        bool fired = false;
+        this->waiters.push_back(waiter { &cv, deadline, &fired });
+        this->changed.notify_all();
+
+        // 持有本时钟的mutex期间才释放lock，之后的唤醒都要先获得本时钟的mutex，不会丢失
+        lock.unlock();
+        this->changed.wait(guard, [&fired] { return fired; });
+        guard.unlock();
+        lock.lock();
+    }
+
+    /**
+     * @brief 唤醒在cv上等待的线程，并立即移除其登记，settle不会把正在醒来的线程当作仍在等待。
+     */
+    void notify(std::condition_variable & cv) override {
+        {
+            std::lock_guard<std::mutex> guard(this->mutex);
+            this->fire([&cv] (const waiter & w) { return w.cv == &cv; });
+        }
+        cv.notify_all();
+    }
+
+    /**
+     * @brief 时间前进，唤醒到期的等待者。
+     */
+    template <class _Rep, class _Period>
+    void advance(const std::chrono::duration<_Rep, _Period> & duration) {
+        this->set(this->now_ns() + std::chrono::duration_cast<std::chrono::nanoseconds>(duration).count());
+    }
+
+    /**
+     * @brief 设置当前时间，不能倒退。
+     */
+    void set(int64_t ns) {
+        std::lock_guard<std::mutex> guard(this->mutex);
+        this->now = std::max(this->now, ns);
+        auto now = this->now;
+        this->fire([now] (const waiter & w) { return w.deadline <= now; });
+    }
+
+    /**
+     * @brief 当前在此时钟上等待的数量。
+     */
+    size_t waiting() {
+        std::lock_guard<std::mutex> guard(this->mutex);
+        return this->waiters.size();
+    }
+
+    /**
+     * @brief 等待直到至少count个等待者处于等待状态，且没有等待者已经到期。
+     * 只统计真正阻塞在本时钟上的线程：到期或被执行器通知的等待者在重新等待之前都不计入。
+     * 
+     * @param count 
+     * @param timeout 真实时间的超时
+     * @return true  
+     * @return false 超时
+     */
+    template <class _Rep = long long, class _Period = std::milli>
+    bool settle(size_t count, const std::chrono::duration<_Rep, _Period> & timeout = std::chrono::seconds(5)) {
+        std::unique_lock<std::mutex> lock(this->mutex);
+        return this->changed.wait_for(lock, timeout, [this, count] {
+            if (this->waiters.size() < count) return false;
+            for (const auto & w : this->waiters) {
+                if (w.deadline <= this->now) return false;
+            }
+            return true;
+        });
+    }
+
+private:
+    /**
+     * @brief 置位并移除满足条件的登记，唤醒对应的等待线程。调用时已持有mutex。
+     */
+    template <typename _Pred>
+    void fire(const _Pred & pred) {
+        auto end = std::remove_if(this->waiters.begin(), this->waiters.end(), [&pred] (const waiter & w) {
+            if (!pred(w)) return false;
+            *w.fired = true;
+            return true;
+        });
+        if (end == this->waiters.end()) return;
+        this->waiters.erase(end, this->waiters.end());
+        this->changed.notify_all();
+    }
+
+private:
+    int64_t                     now;
+    std::mutex                  mutex;
+    std::condition_variable     changed;
+    std::vector<waiter>         waiters;
+};
+
+
+} // namespace jar
+
+
+#endif // _JAR_CLOCK_H
@@ -3,7 +3,7 @@
 
 namespace jar {
     
-event_queue<uint64_t> event;
+sharded_event_queue<uint64_t> event;
 
 }
 
@@ -14,16 +14,100 @@
 
 #include "any.h"
 #include "exec.h"
+#include "journal.h"
+#include "rcu.h"
+#include "registry.h"
+#include "shared.h"
 
-#include <map>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <iterator>
+#include <memory>
+#include <tuple>
 #include <type_traits>
 
 namespace jar {
 
 
+/**
+ * @brief 事件的合并策略。
+ * 
+ * none:        不合并，每次发布都分发。
+ * last_value:  尚未分发的事件只保留最新的一个。
+ * window:      在时间窗口内合并，窗口结束时分发窗口内最新的一个。
+ * 
+ * @author fomjar
+ * @date 2022/05/05
+ */
+enum class conflation {
+    none,
+    last_value,
+    window,
+};
+
+
+
+/**
+ * @brief 积压超过容量时的处理策略。
+ * 
+ * block:       阻塞发布者，直到有空位。
+ * drop_newest: 丢弃新发布的事件，发布者无感知。
+ * drop_oldest: 丢弃积压中最早的事件，接收新事件。
+ * reject:      拒绝新发布的事件，pub返回false。
+ * 
+ * @author fomjar
+ * @date 2022/05/07
+ */
+enum class overflow {
+    block,
+    drop_newest,
+    drop_oldest,
+    reject,
+};
+
+
+
+/**
+ * @brief 事件队列的积压统计。
+ * 
+ * @author fomjar
+ * @date 2022/05/07
+ */
+struct event_stats {
+    size_t      depth;      // 当前积压的事件数
+    uint64_t    dropped;    // drop_newest和drop_oldest丢弃的事件数
+    uint64_t    rejected;   // reject拒绝的事件数
+    uint64_t    blocked;    // block阻塞过的发布次数
+};
+
+
+
 /**
  * @brief 事件队列。订阅和发布自定义消息，可以带上自定义参数。事件的分发执行委托给了内部的异步队列。
  * 
+ * 订阅表是发布在rcu上的不可变哈希表，分发时只读取快照，不加锁；订阅和退订在写锁内生成新版本替换。
+ * 
+ * 以线程池构造时为并行分发模式：发布时直接把事件投递到每个订阅者各自的strand上，订阅者之间并行执行，
+ * 同一订阅者收到的事件保持发布顺序。
+ * 
+ * 同步模式下（set_sync或pub_sync）在发布线程上直接调用订阅者，不经过异步队列，适合开销很小的订阅者。
+ * 
+ * 订阅时可以指定执行器或线程池，回调直接投递到该执行器上执行，适合需要在固定线程上访问状态的订阅者；
+ * 同一目标上的订阅者每个事件只投递一个任务。这类订阅者在同步模式下也仍然异步投递到各自的执行器。
+ * 
+ * 高频事件可以按事件设置合并策略，每个事件最多只有一个待分发的副本；订阅者也可以用sub_batch批量接收积压的事件。
+ * 
+ * 可以为整个队列和单个事件设置积压容量（set_capacity），设置后异步发布的事件先进入有界积压，超过容量时按overflow策略处理，
+ * 统计数据通过stats获取。事件占用的位置在所有订阅者执行完后才释放，包括并行分发模式下订阅者的strand和指定了执行器的订阅者。
+ * 订阅者在回调里向本队列发布时不会阻塞等待：积压已满且策略为block时按reject处理，否则积压要等它返回才能排空，会死锁。
+ * 
+ * 设置日志（set_journal）后，事件和参数都可序列化且有type_tag的发布会被追加到日志，重启后用replay按日志顺序把事件同步回放给订阅者。
+ * 有界积压中的事件在分发时才写入日志，被拒绝或丢弃的事件不会出现在日志里。
+ * 
+ * 发布的参数类型与订阅的回调类型不一致时，该订阅者被跳过而不是被错误地调用。
+ * 
  * @tparam _Tp 
  * 
  * @author fomjar
@@ -32,46 +116,1058 @@ namespace jar {
 template <typename _Tp>
 class event_queue {
 
+    struct subscriber {
+        uint64_t                    id;
+        std::shared_ptr<const any>  callback;
+        std::shared_ptr<strand>     serial;     // 并行分发模式下该订阅者的执行序列
+        bool                        direct;     // 在发布线程上直接调用，只用于批量订阅者攒批
+    };
+    using subscribers = std::vector<subscriber>;
+
+    /**
+     * @brief 指定了执行器的订阅者，按目标执行器分组。每个事件对每组只投递一个任务，组内订阅者在该任务里依次执行。
+     */
+    struct affinity {
+        const void                * target;     // 目标执行器或线程池，用于分组
+        func_v<const func_vv &>     deliver;    // 把任务投递到目标上
+        subscribers                 subs;
+    };
+
+    /**
+     * @brief 合并中的事件。
+     */
+    struct pending {
+        pending() : mutex(), latest(), scheduled(false) { }
+
+        std::mutex  mutex;
+        func_vv     latest;
+        bool        scheduled;
+    };
+
+    /**
+     * @brief 积压容量和统计。depth由积压锁保护。
+     */
+    struct bound {
+        bound() : capacity(0), policy(overflow::block), depth(0), dropped(0), rejected(0), blocked(0) { }
+
+        bool full() const { return this->capacity && this->depth >= this->capacity; }
+
+        event_stats stats() const { return event_stats { this->depth, this->dropped, this->rejected, this->blocked }; }
+
+        size_t                  capacity;   // 0表示不限
+        overflow                policy;
+        size_t                  depth;
+        std::atomic<uint64_t>   dropped;
+        std::atomic<uint64_t>   rejected;
+        std::atomic<uint64_t>   blocked;
+    };
+
+    struct topic {
+        topic() : subs(), affine(), policy(conflation::none), window(0), slot(), limit() { }
+
+        bool idle() const { return this->subs.empty() && this->affine.empty() && conflation::none == this->policy && !this->limit; }
+
+        /**
+         * @brief 是否有需要经过分发线程的订阅者。
+         */
+        bool queued() const {
+            return std::any_of(this->subs.begin(), this->subs.end(), [] (const subscriber & s) { return !s.direct; });
+        }
+
+        subscribers                 subs;
+        std::vector<affinity>       affine;
+        conflation                  policy;
+        std::chrono::microseconds   window;
+        std::shared_ptr<pending>    slot;
+        std::shared_ptr<bound>      limit;
+    };
+
+    struct ticket;
+
+    /**
+     * @brief 有界积压中的事件。分发时把ticket交给订阅者的任务，最后一个任务结束时释放位置。
+     */
+    struct entry {
+        func_v<const std::shared_ptr<ticket> &> deliver;
+        std::shared_ptr<bound>                  limit;
+    };
+    using table = registry<_Tp, std::shared_ptr<const topic>>;
+
+    /**
+     * @brief 按签名解码一条日志记录并同步分发，解码失败返回false。
+     */
+    using decoder = func<bool(const char *, size_t)>;
+
+    /**
+     * @brief 队列的存活标记。线程池和定时器上的任务先进入再访问队列，析构时等待已进入的任务退出。
+     */
+    struct life {
+        life() : mutex(), condition(), active(0), alive(true) { }
+
+        /**
+         * @brief 进入队列。队列已析构时返回false。
+         */
+        bool enter() {
+            std::lock_guard<std::mutex> lock(this->mutex);
+            if (!this->alive) return false;
+            this->active++;
+            return true;
+        }
+
+        void leave() {
+            std::lock_guard<std::mutex> lock(this->mutex);
+            if (0 == --this->active) this->condition.notify_all();
+        }
+
+        /**
+         * @brief 标记析构，等待已进入的任务退出。
+         */
+        void close() {
+            std::unique_lock<std::mutex> lock(this->mutex);
+            this->alive = false;
+            this->condition.wait(lock, [this] { return 0 == this->active; });
+        }
+
+        std::mutex              mutex;
+        std::condition_variable condition;
+        size_t                  active;
+        bool                    alive;
+    };
+
+    /**
+     * @brief 有界积压中一个事件占用的位置，析构时释放。
+     */
+    struct ticket {
+        ticket(event_queue * queue, const std::shared_ptr<life> & g, const std::shared_ptr<bound> & limit) :
+            queue(queue), g(g), limit(limit) { }
+        ~ticket() {
+            if (!this->g->enter()) return;
+            this->queue->release(this->limit);
+            this->g->leave();
+        }
+
+        event_queue           * queue;
+        std::shared_ptr<life>   g;
+        std::shared_ptr<bound>  limit;
+    };
+
+    /**
+     * @brief 标记当前线程正在执行本队列的订阅者，用于识别订阅者在回调里向本队列发布。
+     */
+    struct scope {
+        scope(const event_queue * queue) : prev(scope::current()) { scope::current() = queue; }
+        ~scope() { scope::current() = this->prev; }
+
+        static const event_queue *& current() {
+            static thread_local const event_queue * queue = nullptr;
+            return queue;
+        }
+
+        const event_queue * prev;
+    };
+
+    /**
+     * @brief 批量订阅者的积压事件。
+     */
+    template <typename ... _Ap>
+    struct batch {
+        batch(size_t capacity) : mutex(), items(), scheduled(false), capacity(capacity) { }
+
+        std::mutex                          mutex;
+        std::deque<std::tuple<_Ap...>>      items;
+        bool                                scheduled;
+        size_t                              capacity;   // 0表示不限，超过时丢弃最早的事件
+    };
+
 public:
-    event_queue() : callbacks(), mutex(), quer() {
+    event_queue() : callbacks(), mutex(), next_id(0), pool(nullptr), sync(false), log(nullptr), decoders(), limit(), capped(0), bounded(false), backlog(), backlog_mutex(), backlog_condition(), draining(false),
+            guard(std::make_shared<life>()), quer() {
         this->quer.start();
     }
+    /**
+     * @brief 并行分发模式。事件分发到给定线程池，按订阅者保序。
+     * 
+     * @param pool 
+     */
+    event_queue(exec_pool & pool) : callbacks(), mutex(), next_id(0), pool(&pool), sync(false), log(nullptr), decoders(), limit(), capped(0), bounded(false), backlog(), backlog_mutex(), backlog_condition(), draining(false),
+            guard(std::make_shared<life>()), quer() { }
+    ~event_queue() {
+        this->guard->close();
+    }
 
 public:
+    /**
+     * @brief 订阅事件。
+     * 
+     * @tparam _Ap 
+     * @param event 
+     * @param callback 
+     * @return uint64_t 订阅id，用于退订
+     */
+    template <typename ... _Ap>
+    uint64_t sub(const _Tp & event, const func_v<_Ap...> & callback) {
+        JAR_EXEC_LOCK_GUARD
+
+        this->template learn<_Ap...>();
+        auto serial = this->pool ? std::make_shared<strand>(*this->pool) : nullptr;
+        return this->add(event, subscriber {
+            ++this->next_id,
+            std::make_shared<const any>(func_v<_Ap...>(callback)), // make a copy
+            serial,
+            false
+        });
+    }
+
+    /**
+     * @brief 订阅事件，回调在指定的执行器上执行。事件直接投递到执行器的队列，不在回调里再次submit；
+     * 同一执行器上的订阅者合并为一个任务，每个事件只投递一次。
+     * 
+     * 执行器需要比订阅活得久，销毁前先退订。
+     * 
+     * @tparam _Ap 
+     * @param event 
+     * @param target 执行回调的执行器
+     * @param callback 
+     * @return uint64_t 订阅id，用于退订
+     */
+    template <typename ... _Ap>
+    uint64_t sub(const _Tp & event, exec & target, const func_v<_Ap...> & callback) {
+        JAR_EXEC_LOCK_GUARD
+
+        this->template learn<_Ap...>();
+        auto e = &target;
+        return this->add(event, e, [e] (const func_vv & task) { e->submit(task); }, subscriber {
+            ++this->next_id,
+            std::make_shared<const any>(func_v<_Ap...>(callback)),
+            nullptr,
+            false
+        });
+    }
+
+    /**
+     * @brief 订阅事件，回调在指定的线程池上执行。同一线程池上的订阅者共用一个strand，按发布顺序串行执行。
+     * 
+     * @tparam _Ap 
+     * @param event 
+     * @param target 执行回调的线程池
+     * @param callback 
+     * @return uint64_t 订阅id，用于退订
+     */
+    template <typename ... _Ap>
+    uint64_t sub(const _Tp & event, exec_pool & target, const func_v<_Ap...> & callback) {
+        JAR_EXEC_LOCK_GUARD
+
+        this->template learn<_Ap...>();
+        // 该线程池已有分组时沿用组内的strand，这个只在订阅时多分配一次
+        auto serial = std::make_shared<strand>(target);
+        return this->add(event, &target, [serial] (const func_vv & task) { serial->submit(task); }, subscriber {
+            ++this->next_id,
+            std::make_shared<const any>(func_v<_Ap...>(callback)),
+            nullptr,
+            false
+        });
+    }
+
+    /**
+     * @brief 批量订阅事件。积压的事件攒成一批，一次回调全部交付，按发布顺序排列。
+     * 
+     * 事件在发布线程上直接攒进积压，不为每个事件投递分发任务，只在积压由空变为非空时安排一次排空。
+     * 设置容量后积压最多保留capacity个事件，超过时丢弃最早的，每次回调也最多交付capacity个。
+     * 
+     * @tparam _Ap 
+     * @param event 
+     * @param callback 
+     * @param capacity 0表示不限
+     * @return uint64_t 订阅id，用于退订
+     */
     template <typename ... _Ap>
-    void sub(const _Tp & event, const func_v<_Ap...> & callback) {
+    uint64_t sub_batch(const _Tp & event, const func_v<std::vector<std::tuple<_Ap...>>> & callback, size_t capacity = 0) {
+        JAR_EXEC_LOCK_GUARD
+
+        this->template learn<_Ap...>();
+        auto serial = this->pool ? std::make_shared<strand>(*this->pool) : nullptr;
+        auto b = std::make_shared<batch<_Ap...>>(capacity);
+        auto flush = (func_vv) [this, b, callback] {
+            scope sc(this);
+            std::vector<std::tuple<_Ap...>> items;
+            {
+                std::lock_guard<std::mutex> lock(b->mutex);
+                items.assign(std::make_move_iterator(b->items.begin()), std::make_move_iterator(b->items.end()));
+                b->items.clear();
+                b->scheduled = false;
+            }
+            callback(items);
+        };
+        // 第一个事件安排一次排空，排在已入队的事件之后
+        auto collect = (func_v<_Ap...>) [this, b, serial, flush] (_Ap ... args) {
+            {
+                std::lock_guard<std::mutex> lock(b->mutex);
+                if (b->capacity && b->items.size() >= b->capacity) b->items.pop_front();
+                b->items.emplace_back(args...);
+                if (b->scheduled) return;
+                b->scheduled = true;
+            }
+            if (serial) serial->submit(flush);
+            else        this->quer.submit(flush);
+        };
+        return this->add(event, subscriber { ++this->next_id, std::make_shared<const any>(std::move(collect)), serial, true });
+    }
+
+    /**
+     * @brief 退订事件。
+     * 
+     * @param event 
+     * @param id sub返回的订阅id
+     * @return true 退订成功
+     * @return false 没有找到订阅
+     */
+    bool unsub(const _Tp & event, uint64_t id) {
+        JAR_EXEC_LOCK_GUARD
+
+        auto t = this->callbacks.read();
+        auto p = t->find(event);
+        if (!p) return false;
+
+        auto o = std::make_shared<topic>(**p);
+        o->subs.clear();
+        o->affine.clear();
+        bool found = false;
+        for (const auto & s : (*p)->subs) {
+            if (s.id != id) o->subs.push_back(s);
+            else            found = true;
+        }
+        for (const auto & a : (*p)->affine) {
+            auto g = affinity { a.target, a.deliver, subscribers() };
+            for (const auto & s : a.subs) {
+                if (s.id != id) g.subs.push_back(s);
+                else            found = true;
+            }
+            if (!g.subs.empty()) o->affine.push_back(std::move(g));
+        }
+        if (!found) return false;
+
+        this->callbacks.store(o->idle() ? t->without(event) : t->with(event, o));
+        return true;
+    }
+
+    /**
+     * @brief 设置事件的合并策略。
+     * 
+     * @tparam _Rep 
+     * @tparam _Period 
+     * @param event 
+     * @param policy 
+     * @param window 合并窗口，仅对conflation::window有效
+     */
+    template <class _Rep = long long, class _Period = std::micro>
+    void set_conflation(const _Tp & event, conflation policy,
+            const std::chrono::duration<_Rep, _Period> & window = std::chrono::duration<_Rep, _Period>::zero()) {
+        JAR_EXEC_LOCK_GUARD
+
+        auto t = this->callbacks.read();
+        auto p = t->find(event);
+        auto o = p ? std::make_shared<topic>(**p) : std::make_shared<topic>();
+        o->policy = policy;
+        o->window = std::chrono::duration_cast<std::chrono::microseconds>(window);
+        o->slot   = conflation::none == policy ? nullptr : (o->slot ? o->slot : std::make_shared<pending>());
+
+        this->callbacks.store(o->idle() ? t->without(event) : t->with(event, o));
+    }
+
+    /**
+     * @brief 设置同步模式。同步模式下pub等同于pub_sync。
+     * 
+     * @param sync 
+     */
+    void set_sync(bool sync) { this->sync = sync; }
+    bool is_sync() const { return this->sync; }
+
+    /**
+     * @brief 设置整个队列的积压容量。
+     * 
+     * @param capacity 0表示不限
+     * @param policy 
+     */
+    void set_capacity(size_t capacity, overflow policy = overflow::block) {
+        {
+            std::lock_guard<std::mutex> lock(this->backlog_mutex);
+            this->limit.capacity = capacity;
+            this->limit.policy   = policy;
+            this->rebound();
+        }
+        this->backlog_condition.notify_all();
+    }
+
+    /**
+     * @brief 设置单个事件的积压容量。
+     * 
+     * @param event 
+     * @param capacity 0表示不限
+     * @param policy 
+     */
+    void set_capacity(const _Tp & event, size_t capacity, overflow policy = overflow::block) {
         JAR_EXEC_LOCK_GUARD
 
-        if (this->callbacks.find(event) == this->callbacks.end())
-            this->callbacks[event] = std::vector<any>();
+        auto t = this->callbacks.read();
+        auto p = t->find(event);
+        auto o = p ? std::make_shared<topic>(**p) : std::make_shared<topic>();
+        {
+            std::lock_guard<std::mutex> lock(this->backlog_mutex);
+            if (!o->limit) o->limit = std::make_shared<bound>();
+            if (!o->limit->capacity && capacity) this->capped++;
+            if (o->limit->capacity && !capacity) this->capped--;
+            o->limit->capacity = capacity;
+            o->limit->policy   = policy;
+            this->rebound();
+        }
+        this->callbacks.store(t->with(event, o));
+        this->backlog_condition.notify_all();
+    }
+
+    /**
+     * @brief 整个队列的积压统计。
+     */
+    event_stats stats() {
+        std::lock_guard<std::mutex> lock(this->backlog_mutex);
+        return this->limit.stats();
+    }
+
+    /**
+     * @brief 单个事件的积压统计。没有设置过该事件的容量时为全0。
+     */
+    event_stats stats(const _Tp & event) {
+        auto t = this->callbacks.read();
+        auto p = t->find(event);
+        std::lock_guard<std::mutex> lock(this->backlog_mutex);
+        return p && (*p)->limit ? (*p)->limit->stats() : event_stats { 0, 0, 0, 0 };
+    }
+
+    /**
+     * @brief 发布事件。
+     * 
+     * @tparam _Ap 
+     * @param event 
+     * @param args 
+     * @return true 
+     * @return false 积压已满且策略为reject
+     */
+    template <typename ... _Ap>
+    bool pub(const _Tp & event, const _Ap & ... args) {
+        return this->template route<func_v<_Ap...>>(event, args...);
+    }
+
+    /**
+     * @brief 发布共享载荷。载荷只包装一次，所有订阅者以func_v<const shared<_Vp> &>接收同一份载荷，不再逐个复制。
+     * 
+     * @tparam _Vp 
+     * @param event 
+     * @param payload 
+     * @return true 
+     * @return false 积压已满且策略为reject
+     */
+    template <typename _Vp>
+    bool pub(const _Tp & event, const shared<_Vp> & payload) {
+        return this->template route<func_v<const shared<_Vp> &>>(event, payload);
+    }
+
+
+    /**
+     * @brief 设置事件日志。之后事件和参数都可序列化且有type_tag的发布会先追加到日志。
+     * 
+     * @param j nullptr表示不记录
+     */
+    void set_journal(journal * j) { this->log = j; }
+
+    /**
+     * @brief 按日志顺序回放事件。在当前线程上同步分发给订阅者，不会再次写入日志。
+     * 只回放参数类型被某个订阅声明过的记录，其他记录跳过。
+     * 
+     * @param j 
+     * @return size_t 回放的事件数
+     */
+    size_t replay(journal & j) {
+        size_t skipped;
+        return this->replay(j, skipped);
+    }
 
-        any a = std::move(callback); // make a copy
-        this->callbacks[event].push_back(a);
+    /**
+     * @brief 按日志顺序回放事件，同时返回被跳过的记录数。
+     * 跳过的记录没有对应的订阅参数类型，或者无法按当前格式解码，通常是type_tag的名称或版本改变、订阅尚未建立。
+     * 
+     * @param j 
+     * @param skipped 被跳过的记录数
+     * @return size_t 回放的事件数
+     */
+    size_t replay(journal & j, size_t & skipped) {
+        auto d = this->decoders.read();
+        size_t count = 0;
+        skipped = 0;
+        j.replay([&d, &count, &skipped] (uint64_t tag, const char * data, size_t size) {
+            auto f = d->find(tag);
+            if (f && (*f)(data, size)) count++;
+            else skipped++;
+        });
+        return count;
     }
 
+    /**
+     * @brief 同步发布。在当前线程上依次调用订阅者，返回时所有订阅者都已执行完。忽略合并策略。
+     * 
+     * @tparam _Ap 
+     * @param event 
+     * @param args 
+     */
     template <typename ... _Ap>
-    void pub(const _Tp & event, const _Ap & ... args) {
+    void pub_sync(const _Tp & event, const _Ap & ... args) {
+        this->record(event, args...);
+        this->template invoke<func_v<_Ap...>>(event, args...);
+    }
+
+    /**
+     * @brief 同步发布共享载荷。
+     * 
+     * @tparam _Vp 
+     * @param event 
+     * @param payload 
+     */
+    template <typename _Vp>
+    void pub_sync(const _Tp & event, const shared<_Vp> & payload) {
+        this->record(event, payload);
+        this->template invoke<func_v<const shared<_Vp> &>>(event, payload);
+    }
+
+
+private:
+    uint64_t add(const _Tp & event, const subscriber & s) {
+        auto t = this->callbacks.read();
+        auto p = t->find(event);
+        auto o = p ? std::make_shared<topic>(**p) : std::make_shared<topic>();
+        o->subs.push_back(s);
+        this->callbacks.store(t->with(event, o));
+        return s.id;
+    }
+
+    uint64_t add(const _Tp & event, const void * target, const func_v<const func_vv &> & deliver, const subscriber & s) {
+        auto t = this->callbacks.read();
+        auto p = t->find(event);
+        auto o = p ? std::make_shared<topic>(**p) : std::make_shared<topic>();
+        auto g = std::find_if(o->affine.begin(), o->affine.end(), [target] (const affinity & a) { return a.target == target; });
+        if (g != o->affine.end()) g->subs.push_back(s);
+        else                      o->affine.push_back(affinity { target, deliver, subscribers { s } });
+        this->callbacks.store(t->with(event, o));
+        return s.id;
+    }
+
+    /**
+     * @brief 合并发布。只保留最新的事件，已经安排了分发时直接返回。
+     */
+    void conflate(const topic & o, const func_vv & deliver) {
+        auto slot = o.slot;
+        {
+            std::lock_guard<std::mutex> lock(slot->mutex);
+            slot->latest = deliver;
+            if (slot->scheduled) return;
+            slot->scheduled = true;
+        }
+
+        auto flush = (func_vv) [slot] {
+            func_vv latest;
+            {
+                std::lock_guard<std::mutex> lock(slot->mutex);
+                latest.swap(slot->latest);
+                slot->scheduled = false;
+            }
+            if (latest) latest();
+        };
+
+        if (conflation::window == o.policy && o.window.count() > 0) {
+            auto g = this->guard;
+            sched.submit_after(o.window, [this, g, flush] {
+                if (!g->enter()) return;
+                this->post(flush);
+                g->leave();
+            });
+        } else {
+            this->post(flush);
+        }
+    }
+
+    /**
+     * @brief 进入有界积压。
+     */
+    bool enqueue(const topic & o, const func_v<const std::shared_ptr<ticket> &> & deliver) {
+        std::unique_lock<std::mutex> lock(this->backlog_mutex);
+
+        auto tl = o.limit;
+        auto full = [this, &tl] { return this->limit.full() || (tl && tl->full()); };
+        if (full()) {
+            // 单个事件的容量优先
+            auto & b = tl && tl->full() ? *tl : this->limit;
+            switch (b.policy) {
+            case overflow::block:
+                // 订阅者在回调里阻塞等待，积压要等它返回才能排空
+                if (scope::current() == this) {
+                    b.rejected++;
+                    return false;
+                }
+                b.blocked++;
+                this->backlog_condition.wait(lock, [&full] { return !full(); });
+                break;
+            case overflow::drop_newest:
+                b.dropped++;
+                return true;
+            case overflow::reject:
+                b.rejected++;
+                return false;
+            case overflow::drop_oldest:
+                b.dropped++;
+                if (!this->drop_oldest(&b == &this->limit ? nullptr : tl))
+                    return true; // 积压都已在分发中，只能丢弃新事件
+                break;
+            }
+        }
+
+        this->limit.depth++;
+        if (tl) tl->depth++;
+        this->backlog.push_back(entry { deliver, tl });
+        if (this->draining) return true;
+        this->draining = true;
+        lock.unlock();
+
+        this->post([this] { this->drain(); });
+        return true;
+    }
+
+    /**
+     * @brief 丢弃最早的积压事件，调用时已持有积压锁。
+     * 
+     * @param tl 只丢弃该事件的积压，nullptr表示不限事件
+     */
+    bool drop_oldest(const std::shared_ptr<bound> & tl) {
+        for (auto i = this->backlog.begin(); i != this->backlog.end(); i++) {
+            if (tl && i->limit != tl) continue;
+            this->limit.depth--;
+            if (i->limit) i->limit->depth--;
+            this->backlog.erase(i);
+            return true;
+        }
+        return false;
+    }
+
+    /**
+     * @brief 按顺序分发积压。事件的位置在订阅者都执行完、ticket析构时释放。
+     */
+    void drain() {
+        while (true) {
+            entry e;
+            {
+                std::lock_guard<std::mutex> lock(this->backlog_mutex);
+                if (this->backlog.empty()) {
+                    this->draining = false;
+                    this->rebound();
+                    return;
+                }
+                e = std::move(this->backlog.front());
+                this->backlog.pop_front();
+            }
+            e.deliver(std::make_shared<ticket>(this, this->guard, e.limit));
+        }
+    }
+
+    /**
+     * @brief 释放一个位置。
+     */
+    void release(const std::shared_ptr<bound> & tl) {
+        {
+            std::lock_guard<std::mutex> lock(this->backlog_mutex);
+            this->limit.depth--;
+            if (tl) tl->depth--;
+        }
+        this->backlog_condition.notify_all();
+    }
+
+    /**
+     * @brief 有容量限制或者积压还没排空时，异步发布经过有界积压，保持顺序。调用时已持有积压锁。
+     */
+    void rebound() {
+        this->bounded = this->limit.capacity || this->capped || !this->backlog.empty();
+    }
+
+    /**
+     * @brief 按队列的模式和事件的策略投递。_Fn为订阅者回调的类型。
+     */
+    template <typename _Fn, typename ... _Ap>
+    bool route(const _Tp & event, const _Ap & ... args) {
+        auto t = this->callbacks.read();
+        auto p = t->find(event);
+        auto sync = this->sync.load();
+
+        // 进入有界积压的事件在分发时才写日志，被拒绝或丢弃的事件不会被回放
+        auto deferred = !sync && p && conflation::none == (*p)->policy && this->bounded;
+        if (!deferred) this->record(event, args...);
+
+        if (sync) {
+            this->template invoke<_Fn>(event, args...);
+            return true;
+        }
+
+        if (!p) return true;
+
+        if (conflation::none != (*p)->policy) {
+            this->conflate(**p, (func_vv) [this, event, args...] { this->template dispatch<_Fn>(event, nullptr, args...); });
+            return true;
+        }
+
+        if (this->bounded) {
+            return this->enqueue(**p, (func_v<const std::shared_ptr<ticket> &>) [this, event, args...] (const std::shared_ptr<ticket> & hold) {
+                this->record(event, args...);
+                this->template dispatch<_Fn>(event, hold, args...);
+            });
+        }
+
+        // 指定了执行器的订阅者和批量订阅者在发布线程上直接投递
+        this->template deliver<_Fn>(*p, nullptr, args...);
+        this->template collect<_Fn>(**p, args...);
+
+        if (this->pool) {
+            this->template dispatch<_Fn>(**p, true, nullptr, args...);
+            return true;
+        }
+
+        if (!(*p)->queued()) return true;
         this->quer.submit((func_vv) [this, event, args...] {
-            JAR_EXEC_LOCK_GUARD
-            for (auto a : this->callbacks[event]) {
-                auto callback = a.template cast<func_v<_Ap...>>();
-                callback(args...);
+            auto t = this->callbacks.read();
+            auto p = t->find(event);
+            if (p) this->template dispatch<_Fn>(**p, true, nullptr, args...);
+        });
+        return true;
+    }
+
+    template <typename ... _Ap>
+    typename std::enable_if<detail::all_recordable<_Tp, _Ap...>::value>::type
+    record(const _Tp & event, const _Ap & ... args) {
+        auto j = this->log.load();
+        if (!j) return;
+
+        std::string buf;
+        detail::write_all(buf, event, args...);
+        j->append(detail::signature<_Tp, _Ap...>(), buf.data(), buf.size());
+    }
+
+    template <typename ... _Ap>
+    typename std::enable_if<!detail::all_recordable<_Tp, _Ap...>::value>::type
+    record(const _Tp &, const _Ap & ...) { }
+
+    /**
+     * @brief 登记回调参数类型对应的日志解码，调用时持有写锁。签名与record一致，按参数的退化类型计算。
+     */
+    template <typename ... _Ap>
+    typename std::enable_if<detail::all_recordable<_Tp, typename std::decay<_Ap>::type...>::value>::type
+    learn() {
+        auto tag = detail::signature<_Tp, typename std::decay<_Ap>::type...>();
+        auto d = this->decoders.read();
+        if (d->find(tag)) return;
+
+        this->decoders.store(d->with(tag, (decoder) [this] (const char * data, size_t size) {
+            std::tuple<_Tp, typename std::decay<_Ap>::type...> a;
+            auto p = data;
+            if (!detail::read_all(p, data + size, a)) return false;
+            this->template replay_one<func_v<_Ap...>>(a, typename detail::make_index_seq<sizeof...(_Ap)>::type());
+            return true;
+        }));
+    }
+
+    template <typename ... _Ap>
+    typename std::enable_if<!detail::all_recordable<_Tp, typename std::decay<_Ap>::type...>::value>::type
+    learn() { }
+
+    template <typename _Fn, typename ... _Ap, size_t ... _Is>
+    void replay_one(const std::tuple<_Tp, _Ap...> & a, detail::index_seq<_Is...>) {
+        this->template invoke<_Fn>(std::get<0>(a), std::get<_Is + 1>(a)...);
+    }
+
+    template <typename _Fn, typename ... _Ap>
+    void invoke(const _Tp & event, const _Ap & ... args) {
+        auto t = this->callbacks.read();
+        auto p = t->find(event);
+        if (!p) return;
+
+        for (const auto & s : (*p)->subs) {
+            auto callback = s.callback->template get<_Fn>();
+            if (callback) (*callback)(args...);
+        }
+        this->template deliver<_Fn>(*p, nullptr, args...);
+    }
+
+    void post(const func_vv & task) {
+        if (!this->pool) {
+            this->quer.submit(task);
+            return;
+        }
+        auto g = this->guard;
+        this->pool->submit((func_vv) [g, task] {
+            if (!g->enter()) return;
+            try {
+                task();
+            } catch (...) {
+                g->leave();
+                throw;
             }
+            g->leave();
         });
     }
 
+    template <typename _Fn, typename ... _Ap>
+    void dispatch(const _Tp & event, const std::shared_ptr<ticket> & hold, const _Ap & ... args) {
+        auto t = this->callbacks.read();
+        auto p = t->find(event);
+        if (!p) return;
+        this->template dispatch<_Fn>(**p, false, hold, args...);
+        this->template deliver<_Fn>(*p, hold, args...);
+    }
+
+    /**
+     * @brief 分发给订阅者。
+     * 
+     * @param collected 批量订阅者是否已经在发布线程上攒过批
+     * @param hold 有界积压中事件的位置，交给strand上的任务持有
+     */
+    template <typename _Fn, typename ... _Ap>
+    void dispatch(const topic & o, bool collected, const std::shared_ptr<ticket> & hold, const _Ap & ... args) {
+        scope sc(this);
+        for (const auto & s : o.subs) {
+            // 参数类型与订阅不一致的订阅者被跳过
+            if (!s.callback->template is<_Fn>()) continue;
+            if (collected && s.direct) continue;
+            if (s.serial) {
+                auto callback = s.callback;
+                const event_queue * q = this;
+                s.serial->submit((func_vv) [callback, q, hold, args...] {
+                    scope sc(q);
+                    (*callback->template get<_Fn>())(args...);
+                });
+            } else {
+                (*s.callback->template get<_Fn>())(args...);
+            }
+        }
+    }
+
+    /**
+     * @brief 在发布线程上交给批量订阅者攒批。
+     */
+    template <typename _Fn, typename ... _Ap>
+    void collect(const topic & o, const _Ap & ... args) {
+        for (const auto & s : o.subs) {
+            if (!s.direct || !s.callback->template is<_Fn>()) continue;
+            (*s.callback->template get<_Fn>())(args...);
+        }
+    }
+
+    /**
+     * @brief 投递给指定了执行器的订阅者。每组一个任务，任务持有主题快照，不依赖队列的存活。
+     */
+    template <typename _Fn, typename ... _Ap>
+    void deliver(const std::shared_ptr<const topic> & o, const std::shared_ptr<ticket> & hold, const _Ap & ... args) {
+        for (size_t i = 0; i < o->affine.size(); i++) {
+            const auto & g = o->affine[i];
+            auto matched = std::any_of(g.subs.begin(), g.subs.end(), [] (const subscriber & s) {
+                return s.callback->template is<_Fn>();
+            });
+            if (!matched) continue;
+            const event_queue * q = this;
+            g.deliver((func_vv) [o, i, q, hold, args...] {
+                scope sc(q);
+                for (const auto & s : o->affine[i].subs) {
+                    auto callback = s.callback->template get<_Fn>();
+                    if (callback) (*callback)(args...);
+                }
+            });
+        }
+    }
+
+    rcu<table>              callbacks;
+    std::mutex              mutex;      // 写锁
+    uint64_t                next_id;
+    exec_pool             * pool;
+    std::atomic<bool>       sync;
+    std::atomic<journal *>  log;
+    rcu<registry<uint64_t, decoder>> decoders;  // 按日志记录的签名，订阅时登记
+    bound                   limit;
+    size_t                  capped;     // 设置了容量的事件数，由积压锁保护
+    std::atomic<bool>       bounded;
+    std::deque<entry>       backlog;
+    std::mutex              backlog_mutex;
+    std::condition_variable backlog_condition;
+    bool                    draining;
+    std::shared_ptr<life>   guard;
+    queuer                  quer;
+
+};
+
+
+
+
+/**
+ * @brief 分片的事件队列。按事件的哈希把事件分配到多个event_queue上，每个分片有自己的订阅表、写锁和分发线程。
+ * 
+ * 同一事件总是落在同一分片，事件内保序；不同分片的事件并行分发，吞吐随核数增长。不同事件之间不保证顺序。
+ * 分片选择用斐波那契哈希取高位，与分片内registry使用的哈希位相互独立。
+ * 
+ * jar::sharded_event_queue<uint64_t> queue(4);
+ * queue.sub(0x01, (jar::func_v<int>) [] (int v) { ... });
+ * queue.pub(0x01, 3);
+ * 
+ * @tparam _Tp 
+ * @tparam _Hp 
+ * 
+ * @author fomjar
+ * @date 2022/05/10
+ */
+template <typename _Tp, typename _Hp = std::hash<_Tp>>
+class sharded_event_queue {
+
+public:
+    /**
+     * @brief 
+     * 
+     * @param shards 分片数，0表示取硬件线程数
+     */
+    explicit sharded_event_queue(size_t shards = 0) : shards() {
+        if (0 == shards) shards = std::max(1u, std::thread::hardware_concurrency());
+        for (size_t i = 0; i < shards; i++)
+            this->shards.emplace_back(new event_queue<_Tp>());
+    }
+
+    size_t shard_count() const { return this->shards.size(); }
+
+public:
+    /**
+     * @brief 订阅事件。订阅在事件所在的分片上，返回的id只在该事件内唯一。
+     * 
+     * @see event_queue::sub
+     */
+    template <typename ... _Ap>
+    uint64_t sub(const _Tp & event, const func_v<_Ap...> & callback) {
+        return this->of(event).sub(event, callback);
+    }
+
+    /**
+     * @see event_queue::sub
+     */
+    template <typename ... _Ap>
+    uint64_t sub(const _Tp & event, exec & target, const func_v<_Ap...> & callback) {
+        return this->of(event).sub(event, target, callback);
+    }
+
+    /**
+     * @see event_queue::sub
+     */
+    template <typename ... _Ap>
+    uint64_t sub(const _Tp & event, exec_pool & target, const func_v<_Ap...> & callback) {
+        return this->of(event).sub(event, target, callback);
+    }
+
+    /**
+     * @see event_queue::sub_batch
+     */
+    template <typename ... _Ap>
+    uint64_t sub_batch(const _Tp & event, const func_v<std::vector<std::tuple<_Ap...>>> & callback, size_t capacity = 0) {
+        return this->of(event).template sub_batch<_Ap...>(event, callback, capacity);
+    }
+
+    /**
+     * @see event_queue::unsub
+     */
+    bool unsub(const _Tp & event, uint64_t id) {
+        return this->of(event).unsub(event, id);
+    }
+
+    /**
+     * @see event_queue::set_conflation
+     */
+    template <class _Rep = long long, class _Period = std::micro>
+    void set_conflation(const _Tp & event, conflation policy,
+            const std::chrono::duration<_Rep, _Period> & window = std::chrono::duration<_Rep, _Period>::zero()) {
+        this->of(event).set_conflation(event, policy, window);
+    }
+
+    /**
+     * @brief 设置所有分片的同步模式。
+     */
+    void set_sync(bool sync) {
+        for (auto & q : this->shards) q->set_sync(sync);
+    }
+    bool is_sync() const { return this->shards.front()->is_sync(); }
+
+    /**
+     * @brief 设置每个分片的积压容量。
+     * 
+     * @param capacity 0表示不限
+     * @param policy 
+     */
+    void set_capacity(size_t capacity, overflow policy = overflow::block) {
+        for (auto & q : this->shards) q->set_capacity(capacity, policy);
+    }
+
+    /**
+     * @see event_queue::set_capacity
+     */
+    void set_capacity(const _Tp & event, size_t capacity, overflow policy = overflow::block) {
+        this->of(event).set_capacity(event, capacity, policy);
+    }
+
+    /**
+     * @brief 所有分片的积压统计之和。
+     */
+    event_stats stats() {
+        event_stats sum { 0, 0, 0, 0 };
+        for (auto & q : this->shards) {
+            auto s = q->stats();
+            sum.depth    += s.depth;
+            sum.dropped  += s.dropped;
+            sum.rejected += s.rejected;
+            sum.blocked  += s.blocked;
+        }
+        return sum;
+    }
+
+    /**
+     * @see event_queue::stats
+     */
+    event_stats stats(const _Tp & event) { return this->of(event).stats(event); }
+
+    /**
+     * @brief 发布事件到事件所在的分片。
+     * 
+     * @see event_queue::pub
+     */
+    template <typename ... _Ap>
+    bool pub(const _Tp & event, const _Ap & ... args) {
+        return this->of(event).pub(event, args...);
+    }
+
+    /**
+     * @see event_queue::pub_sync
+     */
+    template <typename ... _Ap>
+    void pub_sync(const _Tp & event, const _Ap & ... args) {
+        this->of(event).pub_sync(event, args...);
+    }
 
 private:
-    std::map<_Tp, std::vector<any>> callbacks;
-    std::mutex  mutex;
-    queuer      quer;
+    event_queue<_Tp> & of(const _Tp & event) {
+        auto h = (uint64_t) _Hp()(event) * 0x9e3779b97f4a7c15ULL;
+        return *this->shards[(size_t) ((h >> 32) * this->shards.size() >> 32)];
+    }
+
+    std::vector<std::unique_ptr<event_queue<_Tp>>> shards;
 
 };
 
 
 
 
-extern event_queue<uint64_t> event;
+extern sharded_event_queue<uint64_t> event;
 
 
 /**
@@ -80,13 +1176,46 @@ extern event_queue<uint64_t> event;
  * @tparam _Ap 
  * @param e 
  * @param func 
+ * @return uint64_t 订阅id
  * 
  * @author fomjar
  * @date 2022/04/30
  */
 template <typename ... _Ap>
-inline void sub(const uint64_t & e, const func_v<_Ap...> & func) {
-    event.sub(std::forward<const uint64_t>(e), std::forward<const func_v<_Ap...>>(func));
+inline uint64_t sub(const uint64_t & e, const func_v<_Ap...> & func) {
+    return event.sub(std::forward<const uint64_t>(e), std::forward<const func_v<_Ap...>>(func));
+}
+
+/**
+ * @brief 订阅一个事件，回调在指定的执行器上执行。从主事件队列。
+ * 
+ * @tparam _Ap 
+ * @param e 
+ * @param target 
+ * @param func 
+ * @return uint64_t 订阅id
+ * 
+ * @author fomjar
+ * @date 2022/05/15
+ */
+template <typename ... _Ap>
+inline uint64_t sub(const uint64_t & e, exec & target, const func_v<_Ap...> & func) {
+    return event.sub(e, target, func);
+}
+
+/**
+ * @brief 退订一个事件。从主事件队列。
+ * 
+ * @param e 
+ * @param id 
+ * @return true 
+ * @return false 
+ * 
+ * @author fomjar
+ * @date 2022/05/03
+ */
+inline bool unsub(const uint64_t & e, uint64_t id) {
+    return event.unsub(e, id);
 }
 
 /**
@@ -95,13 +1224,15 @@ inline void sub(const uint64_t & e, const func_v<_Ap...> & func) {
  * @tparam _Ap 
  * @param e 
  * @param args 
+ * @return true 
+ * @return false 积压已满且策略为reject
  * 
  * @author fomjar
  * @date 2022/04/30
  */
 template <typename ... _Ap>
-inline void pub(const uint64_t & e, const _Ap & ... args) {
-    event.pub(std::forward<const uint64_t>(e), std::forward<const _Ap>(args)...);
+inline bool pub(const uint64_t & e, const _Ap & ... args) {
+    return event.pub(std::forward<const uint64_t>(e), std::forward<const _Ap>(args)...);
 }
 
 
@@ -4,12 +4,21 @@
 namespace jar {
 
 uint32_t exec::name_idx = 0;
+std::atomic<int> exec::watchers(0);
 uint32_t queuer::name_idx = 0;
+uint32_t poller::name_idx = 0;
 uint32_t delayer::name_idx = 0;
 uint32_t looper::name_idx = 0;
 uint32_t animator::name_idx = 0;
+uint32_t timer::name_idx = 0;
 
 cached_pool pool(0);
 
+timer sched;
+
+static struct sched_starter {
+    sched_starter() { sched.start(); }
+} sched_starter;
+
 }
 
@@ -13,15 +13,29 @@
 #define _JAR_EXEC_H
 
 
+#include "clock.h"
+#include "future.h"
 #include "time.h"
 
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <deque>
 #include <functional>
+#include <map>
+#include <memory>
 #include <vector>
 #include <mutex>
 #include <condition_variable>
 #include <thread>
 #include <future>
 
+#if defined(__linux__)
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
 
 
 namespace jar {
@@ -36,6 +50,21 @@ using func_vv   = func<void(void)>;
 
 
 
+namespace detail {
+
+template <size_t ... _Is>
+struct index_seq { };
+
+template <size_t _Np, size_t ... _Is>
+struct make_index_seq : make_index_seq<_Np - 1, _Np - 1, _Is...> { };
+
+template <size_t ... _Is>
+struct make_index_seq<0, _Is...> { using type = index_seq<_Is...>; };
+
+} // namespace detail
+
+
+
 /**
  * @brief 异步执行器。
  * 
@@ -56,14 +85,16 @@ class executor {
 #define JAR_EXEC_LOCK_WAIT_FOR(duration) \
             { \
                 std::unique_lock<std::mutex> lock(this->mutex); \
-                this->condition.wait_for(lock, duration); \
+                this->clk->wait_for(lock, this->condition, duration); \
             }
 
 #define JAR_EXEC_EXECUTE_TASKS \
             { \
                 for (auto task : this->tasks) { \
+                    this->task_begin(); \
                     task(); \
                 } \
+                this->task_end(); \
             }
 
 
@@ -72,17 +103,106 @@ public:
         tasks(),
         mutex(),
         condition(),
+        name_mutex(),
         name("jar::exec #" + std::to_string(++executor::name_idx)),
+        clk(&clock::system()),
+        working(false),
+        task_since(0),
+        tid(0),
         _is_running(false),
-        thread(nullptr) { };
-    virtual ~executor() { this->stop(); }
+        thread(nullptr) {
+        auto & r = executor::registry();
+        std::lock_guard<std::mutex> guard(r.mutex);
+        r.list.push_back(this);
+    };
+    virtual ~executor() {
+        {
+            auto & r = executor::registry();
+            std::lock_guard<std::mutex> guard(r.mutex);
+            r.list.erase(std::find(r.list.begin(), r.list.end(), this));
+        }
+        this->stop();
+    }
 
     bool    is_running()    const { return this->_is_running; }
     size_t  size()          const { return this->tasks.size(); }
     bool    is_idle()       const { return this->tasks.empty(); }
+    bool    is_working()    const { return this->working; }
+
+    /**
+     * @brief 尚未开始执行的任务数。
+     */
+    size_t backlog() const {
+        JAR_EXEC_LOCK_GUARD
+        return this->queued();
+    }
+
+    /**
+     * @brief 不阻塞地取尚未开始执行的任务数。delayer、looper、animator持有mutex执行任务，卡住时取不到，返回false。
+     * 
+     * @param n 
+     * @return true 
+     * @return false mutex被占用
+     */
+    bool try_backlog(size_t & n) const {
+        std::unique_lock<std::mutex> lock(this->mutex, std::try_to_lock);
+        if (!lock.owns_lock()) return false;
+        n = this->queued();
+        return true;
+    }
+
+    /**
+     * @brief 当前任务已经执行的时长，单位：纳秒，精度为粗粒度时钟的节拍。只在有watchdog时记录，否则为0。
+     */
+    int64_t task_ns() const {
+        auto s = this->task_since.load(std::memory_order_relaxed);
+        return s ? coarse_now_ns() - s : 0;
+    }
+
+    /**
+     * @brief 工作线程的系统线程号，未启动时为0。
+     */
+    int thread_id() const { return this->tid; }
+
+    /**
+     * @brief 在登记表的锁内遍历所有存活的执行器。回调内不能创建或销毁执行器。
+     * 
+     * @param f 
+     */
+    static void each(const func_v<executor &> & f) {
+        auto & r = executor::registry();
+        std::lock_guard<std::mutex> guard(r.mutex);
+        for (auto e : r.list) f(*e);
+    }
+
+    /**
+     * @brief 启用中的watchdog数量。为0时工作线程不记录任务的开始时间。
+     */
+    static std::atomic<int> watchers;
 
-    void set_name(const std::string & name) { this->name = name; }
-    std::string get_name() const { return this->name; }
+    void set_name(const std::string & name) {
+        std::lock_guard<std::mutex> guard(this->name_mutex);
+        this->name = name;
+    }
+    std::string get_name() const {
+        std::lock_guard<std::mutex> guard(this->name_mutex);
+        return this->name;
+    }
+
+    /**
+     * @brief 设置定时使用的时钟，默认为真实时钟。测试时可以换成virtual_clock。时钟需要比执行器活得更久。
+     * 已安排的定时任务按剩余时长换算到新时钟上。
+     * 
+     * @param c 
+     */
+    void set_clock(clock & c) {
+        JAR_EXEC_LOCK_GUARD
+        auto old = this->clk;
+        this->rebase(c.now_ns() - old->now_ns());
+        this->clk = &c;
+        old->notify(this->condition);
+    }
+    clock & get_clock() const { return *this->clk; }
 
     /**
      * @brief 启动线程。
@@ -92,8 +212,14 @@ public:
             return;
         
         this->_is_running = true;
-        this->thread = new std::thread([this] {
-            this->worker()();
+        // 在当前线程取出worker：新线程启动前对象可能已开始析构，此时再调用worker()会调用到纯虚函数。
+        // worker读取的子类成员则由各子类析构函数先stop()来保证存活。
+        auto work = this->worker();
+        this->thread = new std::thread([this, work] {
+#if defined(__linux__)
+            this->tid = (int) syscall(SYS_gettid);
+#endif
+            work();
             this->_is_running = false;
         });
     }
@@ -107,7 +233,7 @@ public:
         if (this->thread) {
             // 已执行完的线程无法join
             if (this->thread->joinable()) {
-                this->condition.notify_all();
+                this->clk->notify(this->condition);
                 this->thread->join();
             }
             delete this->thread;
@@ -118,7 +244,7 @@ public:
     /**
      * @brief 清空任务。
      */
-    void clear() {
+    virtual void clear() {
         JAR_EXEC_LOCK_GUARD
         this->tasks.clear();
         this->tasks.shrink_to_fit();
@@ -145,8 +271,8 @@ public:
     template <typename _Rp, typename ... _Ap>
     void submit(const std::promise<_Rp> & prom, const func<_Rp(_Ap...)> & task, const _Ap & ... args) {
         JAR_EXEC_LOCK_GUARD
-        this->tasks.push_back([=, &prom] { const_cast<std::promise<_Rp> &>(prom).set_value(task(args...)); });
-        this->condition.notify_all();
+        this->push([=, &prom] { const_cast<std::promise<_Rp> &>(prom).set_value(task(args...)); });
+        this->notify();
     }
     
     /**
@@ -160,11 +286,55 @@ public:
     template <typename ... _Ap>
     void submit(const std::promise<void> & prom, const func_v<_Ap...> & task, const _Ap & ... args) {
         JAR_EXEC_LOCK_GUARD
-        this->tasks.push_back([=, &prom] {
+        this->push([=, &prom] {
             task(args...);
             const_cast<std::promise<void> &>(prom).set_value();
         });
-        this->condition.notify_all();
+        this->notify();
+    }
+
+    /**
+     * @brief 提交任务，结果写入jar::promise。promise按值持有，任务抛出的异常会传给对应的future。
+     * 
+     * @tparam _Rp 
+     * @tparam _Ap 
+     * @param prom 
+     * @param task 
+     * @param args 
+     */
+    template <typename _Rp, typename ... _Ap>
+    void submit(const promise<_Rp> & prom, const func<_Rp(_Ap...)> & task, const _Ap & ... args) {
+        JAR_EXEC_LOCK_GUARD
+        this->push([=] {
+            try {
+                prom.set_value(task(args...));
+            } catch (...) {
+                prom.set_exception(std::current_exception());
+            }
+        });
+        this->notify();
+    }
+
+    /**
+     * @brief 提交任务，完成后设置jar::promise。promise按值持有，任务抛出的异常会传给对应的future。
+     * 
+     * @tparam _Ap 
+     * @param prom 
+     * @param task 
+     * @param args 
+     */
+    template <typename ... _Ap>
+    void submit(const promise<void> & prom, const func_v<_Ap...> & task, const _Ap & ... args) {
+        JAR_EXEC_LOCK_GUARD
+        this->push([=] {
+            try {
+                task(args...);
+                prom.set_value();
+            } catch (...) {
+                prom.set_exception(std::current_exception());
+            }
+        });
+        this->notify();
     }
 
     /**
@@ -178,19 +348,69 @@ public:
     template <typename _Rp, typename ... _Ap>
     void submit(const func<_Rp(_Ap...)> & task, const _Ap & ... args) {
         JAR_EXEC_LOCK_GUARD
-        this->tasks.push_back([=] { task(args...); });
-        this->condition.notify_all();
+        this->push([=] { task(args...); });
+        this->notify();
     }
 
 protected:
     virtual func_vv worker() = 0;
 
+    /**
+     * @brief 新任务入队后的通知，调用时已持有mutex。默认唤醒等待中的工作线程。
+     */
+    virtual void notify() { this->clk->notify(this->condition); }
+
+    /**
+     * @brief 尚未开始执行的任务数，调用时已持有mutex。
+     */
+    virtual size_t queued() const { return this->tasks.size(); }
+
+    /**
+     * @brief 在工作线程上开始执行一个任务前调用，有watchdog时记录开始时间。
+     */
+    void task_begin() {
+        if (executor::watchers.load(std::memory_order_relaxed) > 0)
+            this->task_since.store(coarse_now_ns(), std::memory_order_relaxed);
+    }
+
+    /**
+     * @brief 任务执行完后调用，清除开始时间。
+     */
+    void task_end() { this->task_since.store(0, std::memory_order_relaxed); }
+
+    /**
+     * @brief 更换时钟时调整按旧时钟记录的到期时间，调用时已持有mutex。
+     * 
+     * @param delta 新时钟与旧时钟的差值
+     */
+    virtual void rebase(int64_t) { }
+
+    /**
+     * @brief 任务入队，调用时已持有mutex。
+     */
+    void push(func_vv && task) { this->tasks.push_back(std::move(task)); }
+
     std::vector<func_vv>    tasks;
-    std::mutex              mutex;
+    mutable std::mutex      mutex;
     std::condition_variable condition;
+    mutable std::mutex      name_mutex; // 名称单独加锁，任务在mutex内执行时也能取到
     std::string             name;
+    clock                 * clk;
+    std::atomic<bool>       working;    // 是否正在执行任务
+    std::atomic<int64_t>    task_since; // 当前任务开始执行的时间（粗粒度时钟），没有watchdog或不在执行时为0
+    std::atomic<int>        tid;
 
 private:
+    struct registry_t {
+        std::mutex                  mutex;
+        std::vector<executor *>     list;
+    };
+
+    static registry_t & registry() {
+        static registry_t r;
+        return r;
+    }
+
     bool            _is_running;
     std::thread   * thread;
 
@@ -214,11 +434,63 @@ using exec = executor;
 class queuer : public exec {
 
 public:
-    queuer() {
+    queuer() : since(0), batch_since(0), running(), batch(0), cursor(0) {
         this->set_name("jar::queuer #" + std::to_string(++queuer::name_idx));
     }
+    ~queuer() { this->stop(); }
+
+public:
+    /**
+     * @brief 最早一个尚未开始执行的任务已经排队的时长，单位：纳秒。没有这样的任务时为0。
+     */
+    int64_t wait_ns() const {
+        auto s = this->cursor.load(std::memory_order_relaxed) < this->batch.load(std::memory_order_relaxed)
+               ? this->batch_since.load(std::memory_order_relaxed)
+               : this->since.load(std::memory_order_relaxed);
+        return s ? steady_now_ns() - s : 0;
+    }
+
+    /**
+     * @brief 取出所有尚未开始执行的任务，用于把积压迁移到其他执行器。
+     * 
+     * @return std::vector<func_vv> 
+     */
+    std::vector<func_vv> take_pending() {
+        JAR_EXEC_LOCK_GUARD
+        std::vector<func_vv> r;
+        // 先取正在执行的批次中尚未认领的部分，保持原有顺序
+        for (auto i = this->cursor.exchange(this->running.size()); i < this->running.size(); i++)
+            r.push_back(std::move(this->running[i]));
+        for (auto & task : this->tasks) r.push_back(std::move(task));
+        this->tasks.clear();
+        this->since = 0;
+        return r;
+    }
+
+    void clear() override {
+        exec::clear();
+        JAR_EXEC_LOCK_GUARD
+        this->since = 0;
+    }
 
 protected:
+    /**
+     * @brief 包括正在执行的批次中排在后面的任务。
+     */
+    size_t queued() const override {
+        auto n = this->batch.load(std::memory_order_relaxed);
+        auto c = this->cursor.load(std::memory_order_relaxed);
+        return this->tasks.size() + (c < n ? n - c : 0);
+    }
+
+    /**
+     * @brief 调用时已持有mutex。队列由空变为非空时记下时间，用于计算排队时长。
+     */
+    void notify() override {
+        if (0 == this->since) this->since = steady_now_ns();
+        exec::notify();
+    }
+
     func_vv worker() override {
         return [this] {
             const long CHECK_SECONDS = 1;
@@ -227,13 +499,235 @@ protected:
                     JAR_EXEC_LOCK_WAIT_FOR(std::chrono::seconds(CHECK_SECONDS))
                     continue;
                 }
+                {
+                    JAR_EXEC_LOCK_GUARD
+                    this->running.swap(this->tasks);
+                    // 批次中排在后面的任务仍在排队，保留原来的入队时间，直到全部被认领
+                    this->batch_since = this->since.load();
+                    this->since = 0;
+                    this->cursor = 0;
+                    this->batch = this->running.size();
+                    this->working = true;
+                }
+                // 在锁外执行，任务内可以继续向本队列提交任务；逐个认领，剩余的任务可以被take_pending取走
+                size_t i;
+                while ((i = this->cursor++) < this->running.size()) {
+                    this->task_begin();
+                    this->running[i]();
+                }
+                this->task_end();
+                {
+                    JAR_EXEC_LOCK_GUARD
+                    this->running.clear();
+                    this->batch = 0;
+                    this->batch_since = 0;
+                    this->working = false;
+                }
+            }
+        };
+    }
+
+private:
+    std::atomic<int64_t>    since;          // 队列由空变为非空的时间，队列为空时为0
+    std::atomic<int64_t>    batch_since;    // 正在执行的批次的入队时间
+    std::vector<func_vv>    running;        // 正在执行的批次
+    std::atomic<size_t>     batch;          // 批次的大小
+    std::atomic<size_t>     cursor;         // 批次中下一个待认领的任务
+
+private:
+    static uint32_t name_idx;
+
+};
+
+
+
+/**
+ * @brief 调用方驱动的执行器。不持有内部线程，由使用方在自己的主循环中调用run_one/poll/run_for执行任务。
+ * 
+ * 在Linux上提供一个eventfd，有新任务时变为可读，直到所有任务都执行完才清除，可以加入使用方自己的epoll循环。
+ * 最后一个任务执行完后可能还会多可读一次，此时poll返回0并清除：
+ * 
+ * poller p;
+ * epoll_ctl(ep, EPOLL_CTL_ADD, p.fd(), ...);
+ * ...
+ * p.poll(); // fd可读时
+ * 
+ * @see exec
+ * 
+ * @author fomjar
+ * @date 2022/05/03
+ */
+class poller : public exec {
+
+public:
+    poller() : ready(), ready_pos(0), waiters(0), woken(false), driven(false), signaled(false), efd(-1) {
+        this->set_name("jar::poller #" + std::to_string(++poller::name_idx));
+#if defined(__linux__)
+        this->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+#endif
+    }
+    ~poller() {
+        this->stop();
+#if defined(__linux__)
+        if (this->efd >= 0) close(this->efd);
+#endif
+    }
+
+public:
+    /**
+     * @brief 有待执行任务时可读的文件描述符，不支持时为-1。
+     */
+    int fd() const { return this->efd; }
+
+    /**
+     * @brief 执行一个任务，没有任务时阻塞等待，直到执行了一个任务或被wakeup。
+     * 
+     * @return size_t 执行的任务数量，0或1
+     */
+    size_t run_one() {
+        if (!this->fetch(true, INT64_MAX))
+            return 0;
+        this->run_front();
+        return 1;
+    }
+
+    /**
+     * @brief 执行所有已就绪的任务，不阻塞。
+     * 
+     * @return size_t 执行的任务数量
+     */
+    size_t poll() {
+        size_t count = 0;
+        while (this->fetch(false, INT64_MAX)) {
+            this->run_front();
+            count++;
+        }
+        return count;
+    }
+
+    /**
+     * @brief 在给定时长内执行任务，没有任务时阻塞等待，超时或被wakeup时返回。时长按执行器的时钟计算。
+     * 
+     * @tparam _Rep 
+     * @tparam _Period 
+     * @param duration 
+     * @return size_t 执行的任务数量
+     */
+    template <class _Rep, class _Period>
+    size_t run_for(const std::chrono::duration<_Rep, _Period> & duration) {
+        auto now = this->clk->now_ns();
+        auto ns  = std::chrono::duration<double, std::nano>(duration).count();
+        auto deadline = ns >= (double) (INT64_MAX - now) ? INT64_MAX
+                      : now + std::chrono::duration_cast<std::chrono::nanoseconds>(duration).count();
+        size_t count = 0;
+        while (this->clk->now_ns() < deadline && this->fetch(true, deadline)) {
+            this->run_front();
+            count++;
+        }
+        return count;
+    }
+
+    /**
+     * @brief 唤醒阻塞中的run_one/run_for，使其立即返回。没有阻塞中的调用时不产生效果。
+     */
+    void wakeup() {
+        JAR_EXEC_LOCK_GUARD
+        if (0 == this->waiters) return;
+        this->woken = true;
+        this->clk->notify(this->condition);
+    }
+
+protected:
+    func_vv worker() override {
+        return [this] {
+            {
                 JAR_EXEC_LOCK_GUARD
-                JAR_EXEC_EXECUTE_TASKS
-                this->tasks.clear();
+                this->driven = true;
             }
+            while (this->is_running()) {
+                this->run_for(std::chrono::seconds(1));
+            }
+            JAR_EXEC_LOCK_GUARD
+            this->driven = false;
         };
     }
 
+    /**
+     * @brief 只在有阻塞中的调用时唤醒，eventfd只在尚未置位时写入，连续提交不会每次都产生系统调用。
+     */
+    void notify() override {
+        if (this->waiters > 0)
+            this->clk->notify(this->condition);
+#if defined(__linux__)
+        if (this->efd >= 0 && !this->signaled) {
+            uint64_t one = 1;
+            auto n = write(this->efd, &one, sizeof(one));
+            (void) n;
+            this->signaled = true;
+        }
+#endif
+    }
+
+private:
+    /**
+     * @brief 保证ready中至少有一个任务。ready只由驱动线程访问，取任务时整批交换，避免每个任务都加锁。
+     * eventfd只在ready和tasks都为空时清除，notify在持有mutex时写入，清除和写入不会交错。
+     * deadline为执行器时钟的纳秒时间，INT64_MAX表示不限。
+     */
+    bool fetch(bool wait, int64_t deadline) {
+        if (this->ready_pos < this->ready.size())
+            return true;
+
+        this->ready.clear();
+        this->ready_pos = 0;
+
+        std::unique_lock<std::mutex> lock(this->mutex);
+        if (this->tasks.empty()) this->drain_fd();
+        this->waiters++;
+        // 由工作线程驱动时，stop之后不再等待，虚拟时钟下也能及时退出
+        while (wait && this->tasks.empty() && !this->woken && !(this->driven && !this->is_running())) {
+            if (INT64_MAX == deadline)
+                this->condition.wait(lock);
+            else if (this->clk->now_ns() >= deadline)
+                break;
+            else
+                this->clk->wait_until(lock, this->condition, deadline);
+        }
+        this->waiters--;
+        this->woken = false;
+        if (this->tasks.empty())
+            return false;
+
+        this->ready.swap(this->tasks);
+        return true;
+    }
+
+    void drain_fd() {
+#if defined(__linux__)
+        if (this->efd >= 0 && this->signaled) {
+            uint64_t count;
+            auto n = read(this->efd, &count, sizeof(count));
+            (void) n;
+            this->signaled = false;
+        }
+#endif
+    }
+
+    void run_front() {
+        auto task = std::move(this->ready[this->ready_pos++]);
+        this->task_begin();
+        task();
+        this->task_end();
+    }
+
+    std::vector<func_vv>    ready;
+    size_t                  ready_pos;
+    size_t                  waiters;    // 阻塞在fetch中的调用数
+    bool                    woken;
+    bool                    driven;     // 由start启动的工作线程驱动
+    bool                    signaled;   // eventfd已写入尚未清除
+    int                     efd;
+
 private:
     static uint32_t name_idx;
 
@@ -258,6 +752,7 @@ public:
     {
         this->set_name("jar::delayer #" + std::to_string(++delayer::name_idx));
     }
+    ~delayer() { this->stop(); }
 
 public:
     template <class _Rep, class _Period>
@@ -302,12 +797,21 @@ public:
     {
         this->set_name("jar::looper #" + std::to_string(++looper::name_idx));
     }
+    ~looper() { this->stop(); }
 
 public:
     template <class _Rep, class _Period>
     void set_interval(const std::chrono::duration<_Rep, _Period> & interval)
         { this->interval = std::chrono::duration_cast<std::chrono::microseconds>(interval); }
 
+    /**
+     * @brief 立即唤醒，提前开始下一轮循环。
+     */
+    void wake() {
+        JAR_EXEC_LOCK_GUARD
+        this->clk->notify(this->condition);
+    }
+
 protected:
     func_vv worker() override {
         return [this] {
@@ -345,6 +849,7 @@ public:
     animator(float frequency = 24.0f) : frequency(frequency) {
         this->set_name("jar::animator #" + std::to_string(++animator::name_idx));
     }
+    ~animator() { this->stop(); }
 
 public:
     void set_frequency(float frequency) { this->frequency = frequency; }
@@ -353,18 +858,17 @@ protected:
     func_vv worker() override {
         return [this] {
             while (this->is_running()) {
-                auto beg = now();
+                auto beg = this->clk->now_ns();
                 {
                     JAR_EXEC_LOCK_GUARD
                     JAR_EXEC_EXECUTE_TASKS
                 }
-                auto end = now();
-                auto cost = end - beg;
-                auto interval = 1000000LL / this->frequency;
+                auto cost = this->clk->now_ns() - beg;
+                auto interval = 1000000000LL / this->frequency;
                 if (cost >= interval)
                     std::this_thread::yield();
                 else
-                    JAR_EXEC_LOCK_WAIT_FOR(std::chrono::microseconds((long long) (interval - cost)));
+                    JAR_EXEC_LOCK_WAIT_FOR(std::chrono::nanoseconds((long long) (interval - cost)));
             }
         };
     }
@@ -379,6 +883,94 @@ private:
 
 
 
+/**
+ * @brief 定时执行器。一个线程按到期时间顺序执行任意多个定时任务，到期时间相同的任务按提交顺序执行。
+ * 
+ * 通过submit提交的任务立即执行，通过submit_after提交的任务在给定时长后执行。任务在锁外执行，任务内可以继续提交。
+ * 
+ * @see exec
+ * 
+ * @author fomjar
+ * @date 2022/05/05
+ */
+class timer : public exec {
+
+public:
+    timer() : timers() {
+        this->set_name("jar::timer #" + std::to_string(++timer::name_idx));
+    }
+    ~timer() { this->stop(); }
+
+public:
+    size_t pending() {
+        JAR_EXEC_LOCK_GUARD
+        return this->timers.size();
+    }
+
+    /**
+     * @brief 在给定时长后执行任务。
+     * 
+     * @tparam _Rep 
+     * @tparam _Period 
+     * @param duration 
+     * @param task 
+     */
+    template <class _Rep, class _Period>
+    void submit_after(const std::chrono::duration<_Rep, _Period> & duration, const func_vv & task) {
+        JAR_EXEC_LOCK_GUARD
+        auto deadline = this->clk->now_ns() + std::chrono::duration_cast<std::chrono::nanoseconds>(duration).count();
+        bool earliest = this->timers.empty() || deadline < this->timers.begin()->first;
+        this->timers.insert(std::make_pair(deadline, task));
+        if (earliest) this->clk->notify(this->condition);
+    }
+
+protected:
+    func_vv worker() override {
+        return [this] {
+            const long CHECK_SECONDS = 1;
+            while (this->is_running()) {
+                std::vector<func_vv> batch;
+                {
+                    std::unique_lock<std::mutex> lock(this->mutex);
+                    if (this->tasks.empty()) {
+                        if (this->timers.empty())
+                            this->clk->wait_for(lock, this->condition, std::chrono::seconds(CHECK_SECONDS));
+                        else
+                            this->clk->wait_until(lock, this->condition, this->timers.begin()->first);
+                    }
+                    batch.swap(this->tasks);
+                    auto now = this->clk->now_ns();
+                    while (!this->timers.empty() && this->timers.begin()->first <= now) {
+                        batch.push_back(std::move(this->timers.begin()->second));
+                        this->timers.erase(this->timers.begin());
+                    }
+                }
+                for (auto & task : batch) {
+                    this->task_begin();
+                    task();
+                }
+                this->task_end();
+            }
+        };
+    }
+
+protected:
+    void rebase(int64_t delta) override {
+        std::multimap<int64_t, func_vv> r;
+        for (auto & t : this->timers) r.insert(std::make_pair(t.first + delta, std::move(t.second)));
+        this->timers.swap(r);
+    }
+
+private:
+    std::multimap<int64_t, func_vv> timers;    // 按时钟的纳秒到期时间
+
+private:
+    static uint32_t name_idx;
+
+};
+
+
+
 /**
  * @brief 线程池。内部的子线程均为queuer的实现。
  * 
@@ -435,7 +1027,7 @@ public:
         while (this->size() > size) {
             bool has_idle = false;
             for (auto i = this->execs.end() - 1; i != this->execs.begin() - 1; i--) {
-                if ((*i)->is_idle()) {
+                if ((*i)->is_idle() && !(*i)->is_working()) {
                     has_idle = true;
                     (*i)->stop();
                     delete (*i);
@@ -481,6 +1073,34 @@ public:
             std::forward<const _Ap>(args)...
         );
     }
+
+    /**
+     * @brief 提交任务，结果写入jar::promise。
+     * 
+     * @tparam _Rp 
+     * @tparam _Ap 
+     * @param prom 
+     * @param task 
+     * @param args 
+     */
+    template <typename _Rp, typename ... _Ap>
+    void submit(const promise<_Rp> & prom, const func<_Rp(_Ap...)> & task, const _Ap & ... args) {
+        this->choose()->submit(prom, task, args...);
+    }
+
+    /**
+     * @brief 提交任务，完成后设置jar::promise。
+     * 
+     * @tparam _Ap 
+     * @param prom 
+     * @param task 
+     * @param args 
+     */
+    template <typename ... _Ap>
+    void submit(const promise<void> & prom, const func_v<_Ap...> & task, const _Ap & ... args) {
+        this->choose()->submit(prom, task, args...);
+    }
+
     /**
      * @brief 提交任务。执行方式和时机取决于实现。
      * 
@@ -527,9 +1147,11 @@ protected:
         if (0 == this->size())
             return nullptr;
         
+        // 正在执行任务的算作多一个任务，批次被取走后队列为空不代表空闲
+        auto load = [] (exec * e) { return e->size() + (e->is_working() ? 1 : 0); };
         auto e = this->execs.front();
         for (auto exec : this->execs) {
-            if (exec->size() < e->size())
+            if (load(exec) < load(e))
                 e = exec;
         }
         return e;
@@ -539,37 +1161,291 @@ protected:
 
 
 /**
- * @brief 缓冲大小的线程池实现。当没有空闲线程时自动创建新线程，当线程空闲超过1分钟时会自动释放，但至少会保留指定数量的线程。
+ * @brief 缓冲线程池的运行统计。
+ * 
+ * @author fomjar
+ * @date 2022/05/14
+ */
+struct pool_stats {
+    size_t      size;           // 工作中的线程数
+    size_t      parked;         // 停放待复用的线程数
+    size_t      busy;           // 上次采样时有任务的线程数
+    int64_t     max_wait_ns;    // 上次采样时最长的排队时长
+    uint64_t    grown;          // 扩容次数
+    uint64_t    retired;        // 收缩停放次数
+    uint64_t    reused;         // 扩容时复用停放线程的次数
+    uint64_t    migrated;       // 从积压线程迁移到新线程的任务数
+};
+
+
+/**
+ * @brief 缓冲大小的线程池实现。线程数由一个按固定间隔采样的控制器调整，目标是让任务的排队时长不超过target_latency。
+ * 
+ * 提交时优先交给空闲线程，没有空闲线程时排在积压最少的线程上，不会立即创建线程，避免突发的短任务造成线程暴涨。
+ * 控制器发现有线程的排队时长超过目标时扩容，并把这些线程尚未开始的任务迁移到新线程上；
+ * 排队时长低于目标的一半、且忙碌的线程不到一半的状态持续一段时间后，每次采样停放一个空闲线程。
+ * 扩容和收缩的阈值不同，线程数不会来回振荡。
+ * 
+ * 停放的线程不销毁，扩容时优先复用；停放超过2分钟才真正释放。至少保留cached_size个线程。
+ * 
+ * 有负载时每10毫秒采样一次；持续空闲时采样间隔逐次翻倍，最长1秒，之后的第一次提交会立即唤醒控制器。
  * 
  * @see exec_pool
+ * @see pool_stats
  * 
  * @author fomjar
  * @date 2022/04/30
  */
 class cached_pool : public exec_pool {
 
+    struct parked_exec {
+        exec      * e;
+        int64_t     since;
+    };
+
+    static const int64_t TICK_NS        = 10000000LL;       // 有负载时的采样间隔
+    static const int64_t MAX_TICK_NS    = 1000000000LL;     // 空闲时采样间隔退避的上限
+    static const int64_t CALM_NS        = 1000000000LL;     // 收缩前需要持续空闲的时长
+    static const int64_t PARK_LIMIT_NS  = 120000000000LL;   // 停放线程的最长保留时长
+
 public:
-    cached_pool(size_t cached_size = 4) :
-        monitor(std::chrono::minutes(2)) {
-        this->monitor.submit((func_vv) [this, cached_size] {
-            if (this->size() > cached_size)
-                this->shrink(cached_size);
-        });
+    cached_pool(size_t cached_size = 4, size_t max_size = 1024) :
+        min_size(cached_size),
+        max_size(std::max(max_size, std::max(cached_size, (size_t) 1))),
+        target_ns(5000000),
+        calm_since(0),
+        tick_ns(TICK_NS),
+        backed_off(false),
+        parked(),
+        stat { 0, 0, 0, 0, 0, 0, 0, 0 },
+        monitor(std::chrono::milliseconds(10)) {
+        {
+            JAR_EXEC_LOCK_GUARD
+            while (this->execs.size() < this->min_size) this->add();
+        }
+        this->monitor.set_name("jar::cached_pool monitor");
+        this->monitor.submit((func_vv) [this] { this->adjust(); });
         this->monitor.start();
     }
+    ~cached_pool() {
+        this->monitor.stop();
+        JAR_EXEC_LOCK_GUARD
+        for (auto & p : this->parked) {
+            p.e->stop();
+            delete p.e;
+        }
+        this->parked.clear();
+    }
+
+public:
+    /**
+     * @brief 设置目标排队时长，默认5毫秒。
+     */
+    template <class _Rep, class _Period>
+    void set_target_latency(const std::chrono::duration<_Rep, _Period> & latency) {
+        this->target_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(latency).count();
+    }
+
+    pool_stats stats() {
+        JAR_EXEC_LOCK_GUARD
+        auto s = this->stat;
+        s.size   = this->execs.size();
+        s.parked = this->parked.size();
+        return s;
+    }
 
 protected:
     exec * choose() override {
+        auto e = this->pick();
+        // 不能持有mutex唤醒控制器，adjust()是先持有控制器的mutex再取线程池的mutex
+        if (this->backed_off.exchange(false)) this->monitor.wake();
+        return e;
+    }
+
+private:
+    exec * pick() {
+        JAR_EXEC_LOCK_GUARD
+        if (this->execs.empty()) return this->add();
+
+        exec * least = nullptr;
         for (auto exec : this->execs) {
-            if (exec->is_idle())
+            if (exec->is_idle() && !exec->is_working())
                 return exec;
+            if (!least || exec->size() < least->size())
+                least = exec;
+        }
+        return least;
+    }
+
+    /**
+     * @brief 增加一个线程，优先复用最近停放的。调用时已持有mutex。
+     */
+    exec * add() {
+        exec * e;
+        if (!this->parked.empty()) {
+            e = this->parked.back().e;
+            this->parked.pop_back();
+            this->stat.reused++;
+        } else {
+            e = new queuer;
+            e->start();
         }
-        this->reserve(this->size() + 1);
-        return this->execs.back();
+        this->execs.push_back(e);
+        return e;
+    }
+
+    /**
+     * @brief 一次采样和调整。
+     */
+    void adjust() {
+        JAR_EXEC_LOCK_GUARD
+        auto now = steady_now_ns();
+        size_t busy = 0;
+        int64_t max_wait = 0;
+        std::vector<queuer *> late;
+        for (auto exec : this->execs) {
+            // 线程池只创建queuer
+            auto q = static_cast<queuer *>(exec);
+            auto w = q->wait_ns();
+            if (q->is_working() || !q->is_idle()) busy++;
+            if (w > this->target_ns) late.push_back(q);
+            max_wait = std::max(max_wait, w);
+        }
+        this->stat.busy         = busy;
+        this->stat.max_wait_ns  = max_wait;
+
+        // 有负载或者刚被提交唤醒时恢复正常采样，否则逐次退避
+        auto woken = this->tick_ns > TICK_NS && !this->backed_off;
+        if (busy > 0 || woken) this->tick_ns = TICK_NS;
+        else this->tick_ns = this->tick_ns * 2 < MAX_TICK_NS ? this->tick_ns * 2 : MAX_TICK_NS;
+        this->backed_off = this->tick_ns > TICK_NS;
+        this->monitor.set_interval(std::chrono::nanoseconds(this->tick_ns));
+
+        if (!late.empty()) {
+            this->calm_since = 0;
+            for (auto from : late) {
+                if (this->execs.size() >= this->max_size) break;
+                auto to = this->add();
+                this->stat.grown++;
+                for (auto & task : from->take_pending()) {
+                    to->submit(task);
+                    this->stat.migrated++;
+                }
+            }
+        } else if (this->execs.size() > this->min_size && busy * 2 < this->execs.size() && max_wait * 2 < this->target_ns) {
+            if (0 == this->calm_since) this->calm_since = now;
+            if (now - this->calm_since >= CALM_NS) this->retire(now);
+        } else {
+            this->calm_since = 0;
+        }
+
+        while (!this->parked.empty() && now - this->parked.front().since > PARK_LIMIT_NS) {
+            auto e = this->parked.front().e;
+            this->parked.pop_front();
+            e->stop();
+            delete e;
+        }
+    }
+
+    /**
+     * @brief 停放一个空闲线程。调用时已持有mutex。
+     */
+    void retire(int64_t now) {
+        for (auto i = this->execs.end() - 1; i != this->execs.begin() - 1; i--) {
+            if ((*i)->is_idle() && !(*i)->is_working()) {
+                this->parked.push_back(parked_exec { *i, now });
+                this->execs.erase(i);
+                this->stat.retired++;
+                return;
+            }
+        }
+    }
+
+    size_t                      min_size;
+    size_t                      max_size;
+    std::atomic<int64_t>        target_ns;
+    int64_t                     calm_since;
+    int64_t                     tick_ns;        // 当前的采样间隔
+    std::atomic<bool>           backed_off;     // 采样间隔是否已退避，提交时据此唤醒控制器
+    std::deque<parked_exec>     parked;
+    pool_stats                  stat;
+    looper                      monitor;
+
+};
+
+
+
+/**
+ * @brief 串行执行序列。提交到strand的任务在线程池上执行，但彼此之间严格按提交顺序串行，不同的strand之间可以并行。
+ * 
+ * 同一时刻每个strand最多只有一个排空任务在池中，每次排空有限数量的任务后重新入池，避免长期霸占一个线程。
+ * 
+ * jar::fixed_pool pool;
+ * jar::strand s(pool);
+ * s.submit(task1);
+ * s.submit(task2); // task1执行完后才会执行
+ * 
+ * @see exec_pool
+ * 
+ * @author fomjar
+ * @date 2022/05/04
+ */
+class strand {
+
+    struct state {
+        state(exec_pool & pool) : pool(pool), tasks(), mutex(), scheduled(false) { }
+
+        exec_pool             & pool;
+        std::deque<func_vv>     tasks;
+        std::mutex              mutex;
+        bool                    scheduled;
+    };
+
+public:
+    strand(exec_pool & pool) : s(std::make_shared<state>(pool)) { }
+
+    size_t size() const {
+        std::lock_guard<std::mutex> guard(this->s->mutex);
+        return this->s->tasks.size();
+    }
+
+    /**
+     * @brief 提交任务。
+     * 
+     * @param task 
+     */
+    void submit(const func_vv & task) {
+        {
+            std::lock_guard<std::mutex> guard(this->s->mutex);
+            this->s->tasks.push_back(task);
+            if (this->s->scheduled) return;
+            this->s->scheduled = true;
+        }
+        strand::schedule(this->s);
     }
 
 private:
-    looper  monitor;
+    static void schedule(const std::shared_ptr<state> & s) {
+        s->pool.submit((func_vv) [s] {
+            const size_t BATCH = 64;
+            for (size_t i = 0; i < BATCH; i++) {
+                func_vv task;
+                {
+                    std::lock_guard<std::mutex> guard(s->mutex);
+                    if (s->tasks.empty()) {
+                        s->scheduled = false;
+                        return;
+                    }
+                    task = std::move(s->tasks.front());
+                    s->tasks.pop_front();
+                }
+                task();
+            }
+            strand::schedule(s);
+        });
+    }
+
+    std::shared_ptr<state> s;
 
 };
 
@@ -577,6 +1453,176 @@ private:
 extern cached_pool pool;
 
 
+/**
+ * @brief 主定时器。
+ */
+extern timer sched;
+
+
+
+/**
+ * @brief 限流统计。
+ * 
+ * @author fomjar
+ * @date 2022/05/13
+ */
+struct throttle_stats {
+    uint64_t    submitted;      // 提交的任务数
+    uint64_t    passed;         // 有令牌、直接派发的任务数
+    uint64_t    deferred;       // 因缺少令牌而延后派发的任务数
+    size_t      pending;        // 当前等待令牌的任务数
+    int64_t     delay_total_ns; // 延后任务累计等待时长
+    int64_t     delay_max_ns;   // 延后任务的最大等待时长
+};
+
+
+
+/**
+ * @brief 令牌桶限流器。包装一个执行器或线程池，限制任务派发给它的速率。
+ * 
+ * 桶以rate个每秒的速度补充令牌，最多存burst个，每派发一个任务消耗一个。有令牌时任务直接派发；
+ * 没有令牌时任务按提交顺序排队，由timer在下一个令牌到达时派发，不占用任何工作线程。
+ * burst为1时退化为漏桶，输出间隔均匀为1/rate秒。
+ * 
+ * 时间取自timer的时钟，timer换成virtual_clock后限流同样可以确定性地测试。
+ * 被包装的执行器和timer需要比限流器中的任务活得更久。
+ * 
+ * jar::throttle t(jar::pool, 100, 10); // 每秒100个，允许10个突发
+ * t.submit(task);
+ * 
+ * @author fomjar
+ * @date 2022/05/13
+ */
+class throttle {
+
+    struct state {
+        state(const func<void(const func_vv &)> & dispatch, timer & sched, double rate, size_t burst) :
+            dispatch(dispatch), sched(sched), mutex(), pending(),
+            rate(rate), burst(burst), tokens(burst), last(sched.get_clock().now_ns()), scheduled(false),
+            stats { 0, 0, 0, 0, 0, 0 } { }
+
+        func<void(const func_vv &)>                 dispatch;
+        timer                                     & sched;
+        std::mutex                                  mutex;
+        std::deque<std::pair<int64_t, func_vv>>     pending;    // 入队时间、任务
+        double                                      rate;
+        size_t                                      burst;
+        double                                      tokens;
+        int64_t                                     last;
+        bool                                        scheduled;
+        throttle_stats                              stats;
+
+        void refill(int64_t now) {
+            if (now > this->last) {
+                this->tokens = std::min((double) this->burst, this->tokens + (now - this->last) * this->rate / 1e9);
+                this->last = now;
+            }
+        }
+    };
+
+public:
+    /**
+     * @brief 包装线程池。
+     * 
+     * @param pool 
+     * @param rate 每秒派发的任务数
+     * @param burst 允许的突发数量，至少为1
+     * @param sched 负责延后派发的定时器
+     */
+    throttle(exec_pool & pool, double rate, size_t burst = 1, timer & sched = jar::sched) :
+        s(std::make_shared<state>([&pool] (const func_vv & task) { pool.submit(task); }, sched, rate, std::max(burst, (size_t) 1))) { }
+
+    /**
+     * @brief 包装执行器。
+     * 
+     * @param exec 
+     * @param rate 每秒派发的任务数
+     * @param burst 允许的突发数量，至少为1
+     * @param sched 负责延后派发的定时器
+     */
+    throttle(exec & exec, double rate, size_t burst = 1, timer & sched = jar::sched) :
+        s(std::make_shared<state>([&exec] (const func_vv & task) { exec.submit(task); }, sched, rate, std::max(burst, (size_t) 1))) { }
+
+    /**
+     * @brief 调整速率和突发数量，已排队的任务按新速率派发。
+     * 
+     * @param rate 
+     * @param burst 
+     */
+    void set_rate(double rate, size_t burst = 1) {
+        std::lock_guard<std::mutex> guard(this->s->mutex);
+        this->s->refill(this->s->sched.get_clock().now_ns());
+        this->s->rate   = rate;
+        this->s->burst  = std::max(burst, (size_t) 1);
+        this->s->tokens = std::min(this->s->tokens, (double) this->s->burst);
+    }
+
+    throttle_stats stats() const {
+        std::lock_guard<std::mutex> guard(this->s->mutex);
+        auto r = this->s->stats;
+        r.pending = this->s->pending.size();
+        return r;
+    }
+
+    /**
+     * @brief 提交任务。有令牌时立即派发，否则排队等待令牌。
+     * 
+     * @param task 
+     */
+    void submit(const func_vv & task) {
+        std::lock_guard<std::mutex> guard(this->s->mutex);
+        auto now = this->s->sched.get_clock().now_ns();
+        this->s->refill(now);
+        this->s->stats.submitted++;
+        // 派发在锁内进行，保证进入被包装执行器的顺序与提交顺序一致
+        if (this->s->pending.empty() && this->s->tokens >= 1) {
+            this->s->tokens -= 1;
+            this->s->stats.passed++;
+            this->s->dispatch(task);
+            return;
+        }
+        this->s->pending.push_back(std::make_pair(now, task));
+        if (!this->s->scheduled) throttle::schedule(this->s);
+    }
+
+    /**
+     * @brief 丢弃所有排队中的任务。
+     */
+    void clear() {
+        std::lock_guard<std::mutex> guard(this->s->mutex);
+        this->s->pending.clear();
+    }
+
+private:
+    /**
+     * @brief 在下一个令牌到达时排空队列，调用时已持有mutex。
+     */
+    static void schedule(const std::shared_ptr<state> & s) {
+        auto wait = s->rate > 0 ? (int64_t) std::ceil((1 - s->tokens) * 1e9 / s->rate) : (int64_t) 1000000000;
+        s->scheduled = true;
+        s->sched.submit_after(std::chrono::nanoseconds(std::max(wait, (int64_t) 1)), (func_vv) [s] {
+            std::lock_guard<std::mutex> guard(s->mutex);
+            auto now = s->sched.get_clock().now_ns();
+            s->refill(now);
+            while (!s->pending.empty() && s->tokens >= 1) {
+                auto delay = now - s->pending.front().first;
+                s->tokens -= 1;
+                s->stats.deferred++;
+                s->stats.delay_total_ns += delay;
+                s->stats.delay_max_ns = std::max(s->stats.delay_max_ns, delay);
+                s->dispatch(s->pending.front().second);
+                s->pending.pop_front();
+            }
+            s->scheduled = false;
+            if (!s->pending.empty()) throttle::schedule(s);
+        });
+    }
+
+    std::shared_ptr<state> s;
+
+};
+
+
 /**
  * @brief 异步执行。
  * 
@@ -618,6 +1664,39 @@ inline void async(const std::promise<void> & prom, const func_v<_Ap...> & task,
     );
 }
 
+/**
+ * @brief 异步执行，结果写入jar::promise。可以通过future::then继续编排，不需要阻塞线程等待。
+ * 
+ * @tparam _Rp 
+ * @tparam _Ap 
+ * @param prom 
+ * @param task 
+ * @param args 
+ * 
+ * @author fomjar
+ * @date 2022/05/14
+ */
+template <typename _Rp, typename ... _Ap>
+inline void async(const promise<_Rp> & prom, const func<_Rp(_Ap...)> & task, const _Ap & ... args) {
+    pool.submit(prom, task, args...);
+}
+
+/**
+ * @brief 异步执行，完成后设置jar::promise。
+ * 
+ * @tparam _Ap 
+ * @param prom 
+ * @param task 
+ * @param args 
+ * 
+ * @author fomjar
+ * @date 2022/05/14
+ */
+template <typename ... _Ap>
+inline void async(const promise<void> & prom, const func_v<_Ap...> & task, const _Ap & ... args) {
+    pool.submit(prom, task, args...);
+}
+
 /**
  * @brief 异步执行。
  * 
@@ -638,7 +1717,7 @@ inline void async(const func<_Rp(_Ap...)> & task, const _Ap & ... args) {
 }
 
 /**
- * @brief 延迟执行。
+ * @brief 延迟执行。由sched计时，到期后在pool上执行，计时跟随sched的时钟。
  * 
  * @tparam _Rep
  * @tparam _Period
@@ -659,15 +1738,8 @@ inline void delay(
     const func<_Rp(_Ap...)> & task,
     const               _Ap & ... args
 ) {
-    pool.submit((func_vv) [=, &prom] {
-        delayer e(std::forward<const std::chrono::duration<_Rep, _Period>>(dura));
-        e.submit(
-            std::forward<const std::promise<_Rp>>(prom),
-            std::forward<const func<_Rp(_Ap...)>>(task),
-            std::forward<const               _Ap>(args)...
-        );
-        e.start();
-        e.join();
+    sched.submit_after(dura, (func_vv) [=, &prom] {
+        pool.submit(prom, task, args...);
     });
 }
 
@@ -692,15 +1764,8 @@ inline void delay(
     const     func_v<_Ap...> & task,
     const                _Ap & ... args
 ) {
-    pool.submit((func_vv) [=, &prom] {
-        delayer e(std::forward<const std::chrono::duration<_Rep, _Period>>(dura));
-        e.submit(
-            std::forward<const std::promise<void>>(prom),
-            std::forward<const     func_v<_Ap...>>(task),
-            std::forward<const                _Ap>(args)...
-        );
-        e.start();
-        e.join();
+    sched.submit_after(dura, (func_vv) [=, &prom] {
+        pool.submit(prom, task, args...);
     });
 }
 
@@ -724,14 +1789,8 @@ inline void delay(
     const func<_Rp(_Ap...)> & task,
     const               _Ap & ... args
 ) {
-    pool.submit((func_vv) [=] () {
-        delayer e(std::forward<const std::chrono::duration<_Rep, _Period>>(dura));
-        e.submit(
-            std::forward<const func<_Rp(_Ap...)>>(task),
-            std::forward<const               _Ap>(args)...
-        );
-        e.start();
-        e.join();
+    sched.submit_after(dura, (func_vv) [=] {
+        pool.submit(task, args...);
     });
 }
 
@@ -0,0 +1,547 @@
+/**
+ * @file future.h
+ * @author fomjar (fomjar@gmail.com)
+ * @brief 
+ * @version 0.1
+ * @date 2022-05-14
+ * 
+ * @copyright Copyright (c) 2022
+ * 
+ */
+
+#ifndef _JAR_FUTURE_H
+#define _JAR_FUTURE_H
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace jar {
+
+
+
+template <typename _Tp> class future;
+template <typename _Tp> class promise;
+
+
+
+namespace detail {
+
+struct unit { };
+
+template <typename _Tp> struct future_value       { using type = _Tp; };
+template <>             struct future_value<void> { using type = unit; };
+
+/**
+ * @brief 阻塞等待用的条件变量，按状态地址分散到固定数量的槽位上。状态本身不带锁和条件变量，
+ * 只有真正阻塞在get上时才会用到这里。
+ */
+struct future_parking {
+    std::mutex              mutex;
+    std::condition_variable cv;
+
+    static future_parking & of(const void * p) {
+        static future_parking slots[64];
+        return slots[((uintptr_t) p >> 6) % 64];
+    }
+};
+
+/**
+ * @brief promise和future共享的状态。结果直接存放在状态内部，整个状态只有一次分配；
+ * 完成与登记后续之间用一个自旋标志互斥，临界区只有几条指令。
+ */
+template <typename _Tp>
+class future_state {
+
+    enum : uint8_t { PENDING, VALUE, ERROR };
+
+public:
+    using value_type = typename future_value<_Tp>::type;
+
+    future_state() : promises(0), refs(1), status(PENDING), waiting(false), next(), error() { this->guard.clear(); }
+    ~future_state() { if (VALUE == this->status.load(std::memory_order_relaxed)) this->value()->~value_type(); }
+
+    void retain() { this->refs.fetch_add(1, std::memory_order_relaxed); }
+    void release() { if (1 == this->refs.fetch_sub(1, std::memory_order_acq_rel)) delete this; }
+
+    bool ready()     const { return PENDING != this->status.load(std::memory_order_acquire); }
+    bool has_error() const { return ERROR   == this->status.load(std::memory_order_acquire); }
+    value_type * value() { return (value_type *) &this->storage; }
+    std::exception_ptr exception() const { return this->error; }
+
+    template <typename ... _Up>
+    bool set_value(_Up && ... v) {
+        this->lock();
+        if (PENDING != this->status.load(std::memory_order_relaxed)) {
+            this->unlock();
+            return false;
+        }
+        // 构造抛出异常时先释放guard，调用方还可以再set_exception
+        try {
+            new (&this->storage) value_type(std::forward<_Up>(v)...);
+        } catch (...) {
+            this->unlock();
+            throw;
+        }
+        this->finish(VALUE);
+        return true;
+    }
+
+    bool set_exception(std::exception_ptr e) {
+        this->lock();
+        if (PENDING != this->status.load(std::memory_order_relaxed)) {
+            this->unlock();
+            return false;
+        }
+        this->error = e;
+        this->finish(ERROR);
+        return true;
+    }
+
+    /**
+     * @brief 登记完成后的回调，已完成时在当前线程立即调用。只能登记一次。
+     */
+    void on_ready(std::function<void()> && f) {
+        this->lock();
+        if (!this->ready()) {
+            this->next = std::move(f);
+            this->unlock();
+            return;
+        }
+        this->unlock();
+        f();
+    }
+
+    void wait() {
+        if (this->ready()) return;
+        auto & p = future_parking::of(this);
+        this->waiting.store(true);
+        std::unique_lock<std::mutex> lock(p.mutex);
+        p.cv.wait(lock, [this] { return this->ready(); });
+    }
+
+    template <class _Rep, class _Period>
+    bool wait_for(const std::chrono::duration<_Rep, _Period> & timeout) {
+        if (this->ready()) return true;
+        auto & p = future_parking::of(this);
+        this->waiting.store(true);
+        std::unique_lock<std::mutex> lock(p.mutex);
+        return p.cv.wait_for(lock, timeout, [this] { return this->ready(); });
+    }
+
+    std::atomic<uint32_t> promises;
+
+private:
+    void lock() { while (this->guard.test_and_set(std::memory_order_acquire)) { } }
+    void unlock() { this->guard.clear(std::memory_order_release); }
+
+    /**
+     * @brief 调用时持有guard。状态与waiting的读写都是顺序一致的：要么这里看到等待者，要么等待者在加锁后看到完成。
+     */
+    void finish(uint8_t s) {
+        this->status.store(s);
+        auto f = std::move(this->next);
+        this->next = nullptr;
+        this->unlock();
+        if (this->waiting.load()) {
+            auto & p = future_parking::of(this);
+            std::lock_guard<std::mutex> guard(p.mutex);
+            p.cv.notify_all();
+        }
+        if (f) f();
+    }
+
+    std::atomic<uint32_t>   refs;
+    std::atomic<uint8_t>    status;
+    std::atomic<bool>       waiting;
+    std::atomic_flag        guard;
+    std::function<void()>   next;
+    std::exception_ptr      error;
+    typename std::aligned_storage<sizeof(value_type), alignof(value_type)>::type storage;
+};
+
+/**
+ * @brief 共享状态的引用，复制时增加引用计数。
+ */
+template <typename _Tp>
+class future_ref {
+
+public:
+    future_ref() : s(nullptr) { }
+    explicit future_ref(future_state<_Tp> * s) : s(s) { }
+    future_ref(const future_ref & r) : s(r.s) { if (this->s) this->s->retain(); }
+    future_ref(future_ref && r) noexcept : s(r.s) { r.s = nullptr; }
+    ~future_ref() { if (this->s) this->s->release(); }
+
+    future_ref & operator=(future_ref r) noexcept {
+        std::swap(this->s, r.s);
+        return *this;
+    }
+
+    future_state<_Tp> * operator->() const { return this->s; }
+    future_state<_Tp> & operator* () const { return *this->s; }
+    explicit operator bool() const { return nullptr != this->s; }
+
+private:
+    future_state<_Tp> * s;
+};
+
+template <typename _Tp>
+struct future_take {
+    static _Tp take(future_state<_Tp> & s) { return std::move(*s.value()); }
+};
+
+template <>
+struct future_take<void> {
+    static void take(future_state<void> &) { }
+};
+
+template <typename _Tp, typename _Fp>
+struct then_result { using type = decltype(std::declval<const _Fp &>()(std::declval<_Tp>())); };
+
+template <typename _Fp>
+struct then_result<void, _Fp> { using type = decltype(std::declval<const _Fp &>()()); };
+
+template <typename _Tp, typename _Rp>
+struct then_call {
+    template <typename _Pp, typename _Fp>
+    static void call(future_state<_Tp> & s, const _Pp & p, const _Fp & f) { p.set_value(f(std::move(*s.value()))); }
+};
+
+template <typename _Tp>
+struct then_call<_Tp, void> {
+    template <typename _Pp, typename _Fp>
+    static void call(future_state<_Tp> & s, const _Pp & p, const _Fp & f) {
+        f(std::move(*s.value()));
+        p.set_value();
+    }
+};
+
+template <typename _Rp>
+struct then_call<void, _Rp> {
+    template <typename _Pp, typename _Fp>
+    static void call(future_state<void> &, const _Pp & p, const _Fp & f) { p.set_value(f()); }
+};
+
+template <>
+struct then_call<void, void> {
+    template <typename _Pp, typename _Fp>
+    static void call(future_state<void> &, const _Pp & p, const _Fp & f) {
+        f();
+        p.set_value();
+    }
+};
+
+/**
+ * @brief 在完成的线程上直接执行后续。
+ */
+struct inline_executor {
+    void submit(const std::function<void()> & task) { task(); }
+
+    static inline_executor & instance() {
+        static inline_executor e;
+        return e;
+    }
+};
+
+struct future_access;
+
+} // namespace detail
+
+
+
+/**
+ * @brief 轻量的promise。与std::promise相比，共享状态不带互斥锁和条件变量，结果直接存放在状态内部，只有一次分配。
+ * 
+ * promise是可复制的句柄，可以按值捕获进任务。set_value和set_exception只有第一次生效，返回是否生效。
+ * 所有句柄析构时仍未设置结果，future会得到std::future_errc::broken_promise。
+ * 
+ * @tparam _Tp 结果类型，可以为void
+ * 
+ * @see future
+ * 
+ * @author fomjar
+ * @date 2022/05/14
+ */
+template <typename _Tp>
+class promise {
+
+public:
+    promise() : s(new detail::future_state<_Tp>) { this->s->promises++; }
+    promise(const promise & p) : s(p.s) { if (this->s) this->s->promises++; }
+    promise(promise && p) noexcept : s(std::move(p.s)) { }
+    ~promise() { this->drop(); }
+
+    promise & operator=(promise p) noexcept {
+        this->drop();
+        this->s = std::move(p.s);
+        return *this;
+    }
+
+    /**
+     * @brief 取得对应的future。结果只能被一个future取走。
+     */
+    future<_Tp> get_future() const { return future<_Tp>(this->s); }
+
+    template <typename ... _Up>
+    bool set_value(_Up && ... v) const { return this->s->set_value(std::forward<_Up>(v)...); }
+
+    bool set_exception(std::exception_ptr e) const { return this->s->set_exception(e); }
+
+    bool is_set() const { return this->s->ready(); }
+
+private:
+    void drop() {
+        if (this->s && 1 == this->s->promises.fetch_sub(1) && !this->s->ready())
+            this->s->set_exception(std::make_exception_ptr(std::future_error(std::future_errc::broken_promise)));
+    }
+
+    detail::future_ref<_Tp> s;
+};
+
+
+
+/**
+ * @brief 轻量的future。可以阻塞获取结果，也可以通过then登记后续，后续在指定的执行器上执行，不占用等待的线程。
+ * 
+ * future只能移动，get和then都会消耗它，之后valid为false。结果或异常沿then链向后传递，
+ * 前一步抛出异常时后续的处理函数不会被调用，异常直接传给下一个future。
+ * 
+ * jar::promise<int> p;
+ * jar::async(p, task, args...);
+ * p.get_future()
+ *     .then(jar::pool, [] (int v) { return v * 2; })
+ *     .then([] (int v) { std::cout << v; });
+ * 
+ * @tparam _Tp 结果类型，可以为void
+ * 
+ * @see promise
+ * @see when_all
+ * @see when_any
+ * 
+ * @author fomjar
+ * @date 2022/05/14
+ */
+template <typename _Tp>
+class future {
+
+    friend class promise<_Tp>;
+    friend struct detail::future_access;
+
+public:
+    future() : s() { }
+    future(future && f) noexcept : s(std::move(f.s)) { }
+    future & operator=(future && f) noexcept {
+        this->s = std::move(f.s);
+        return *this;
+    }
+    future(const future &) = delete;
+    future & operator=(const future &) = delete;
+
+    bool valid() const { return (bool) this->s; }
+    bool ready() const { return this->s && this->s->ready(); }
+
+    void wait() const { this->s->wait(); }
+
+    /**
+     * @brief 最多等待给定时长。
+     * 
+     * @return true 已完成
+     * @return false 超时
+     */
+    template <class _Rep, class _Period>
+    bool wait_for(const std::chrono::duration<_Rep, _Period> & timeout) const { return this->s->wait_for(timeout); }
+
+    /**
+     * @brief 阻塞直到完成，取走结果。
+     * 
+     * @return _Tp 
+     * @throw 设置的异常
+     */
+    _Tp get() {
+        auto s = std::move(this->s);
+        s->wait();
+        if (s->has_error()) std::rethrow_exception(s->exception());
+        return detail::future_take<_Tp>::take(*s);
+    }
+
+    /**
+     * @brief 完成后在给定执行器上执行f，f的参数为本future的结果（_Tp为void时无参数）。
+     * 
+     * @tparam _Ex 有submit(func_vv)的执行器，如exec、exec_pool、strand、throttle
+     * @tparam _Fp 
+     * @param e 
+     * @param f 
+     * @return future<R> f的返回值
+     */
+    template <typename _Ex, typename _Fp>
+    future<typename detail::then_result<_Tp, _Fp>::type> then(_Ex & e, const _Fp & f) {
+        using _Rp = typename detail::then_result<_Tp, _Fp>::type;
+
+        promise<_Rp> p;
+        auto r = p.get_future();
+        auto s = std::move(this->s);
+        auto x = &e;
+        s->on_ready([s, p, f, x] {
+            x->submit(std::function<void()>([s, p, f] {
+                if (s->has_error()) {
+                    p.set_exception(s->exception());
+                    return;
+                }
+                try {
+                    detail::then_call<_Tp, _Rp>::call(*s, p, f);
+                } catch (...) {
+                    p.set_exception(std::current_exception());
+                }
+            }));
+        });
+        return r;
+    }
+
+    /**
+     * @brief 完成后在完成的线程上直接执行f，适合开销很小的后续。
+     */
+    template <typename _Fp>
+    future<typename detail::then_result<_Tp, _Fp>::type> then(const _Fp & f) {
+        return this->then(detail::inline_executor::instance(), f);
+    }
+
+private:
+    explicit future(const detail::future_ref<_Tp> & s) : s(s) { }
+
+    detail::future_ref<_Tp> s;
+};
+
+
+
+namespace detail {
+
+struct future_access {
+    template <typename _Tp>
+    static future_ref<_Tp> take(future<_Tp> & f) { return std::move(f.s); }
+};
+
+template <typename _Tp>
+struct when_all_result {
+    using type = std::vector<_Tp>;
+
+    static void set(const promise<type> & p, std::vector<_Tp> & values) { p.set_value(std::move(values)); }
+};
+
+template <>
+struct when_all_result<void> {
+    using type = void;
+
+    static void set(const promise<void> & p, std::vector<unit> &) { p.set_value(); }
+};
+
+template <typename _Tp>
+struct when_any_result {
+    using type = std::pair<size_t, _Tp>;
+
+    static void set(const promise<type> & p, size_t i, future_state<_Tp> & s) { p.set_value(i, std::move(*s.value())); }
+};
+
+template <>
+struct when_any_result<void> {
+    using type = size_t;
+
+    static void set(const promise<type> & p, size_t i, future_state<void> &) { p.set_value(i); }
+};
+
+} // namespace detail
+
+
+
+/**
+ * @brief 所有future都完成后完成，结果按输入顺序排列（void时没有结果）。任何一个出错时以第一个异常完成。
+ * 输入的future被消耗，等待过程不占用任何线程。_Tp需要能默认构造。
+ * 
+ * @tparam _Tp 
+ * @param futures 
+ * @return future<std::vector<_Tp>> _Tp为void时为future<void>
+ * 
+ * @author fomjar
+ * @date 2022/05/14
+ */
+template <typename _Tp>
+inline future<typename detail::when_all_result<_Tp>::type> when_all(std::vector<future<_Tp>> & futures) {
+    using result = detail::when_all_result<_Tp>;
+
+    struct context {
+        context(size_t n) : p(), values(n), left(n), failed(false) { }
+
+        promise<typename result::type>                              p;
+        std::vector<typename detail::future_value<_Tp>::type>       values;
+        std::atomic<size_t>                                         left;
+        std::atomic<bool>                                           failed;
+    };
+
+    auto c = std::make_shared<context>(futures.size());
+    auto r = c->p.get_future();
+    if (futures.empty()) result::set(c->p, c->values);
+    for (size_t i = 0; i < futures.size(); i++) {
+        auto s = detail::future_access::take(futures[i]);
+        s->on_ready([c, s, i] {
+            if (s->has_error()) {
+                if (!c->failed.exchange(true)) c->p.set_exception(s->exception());
+            } else {
+                c->values[i] = std::move(*s->value());
+            }
+            if (0 == --c->left && !c->failed) result::set(c->p, c->values);
+        });
+    }
+    return r;
+}
+
+/**
+ * @brief 任意一个future完成时完成，结果为它的下标和结果（void时只有下标），先完成的是异常时以该异常完成。
+ * 输入的future被消耗，其余future的结果被丢弃。
+ * 
+ * @tparam _Tp 
+ * @param futures 不能为空
+ * @return future<std::pair<size_t, _Tp>> _Tp为void时为future<size_t>
+ * 
+ * @author fomjar
+ * @date 2022/05/14
+ */
+template <typename _Tp>
+inline future<typename detail::when_any_result<_Tp>::type> when_any(std::vector<future<_Tp>> & futures) {
+    using result = detail::when_any_result<_Tp>;
+
+    struct context {
+        context() : p(), done(false) { }
+
+        promise<typename result::type>  p;
+        std::atomic<bool>               done;
+    };
+
+    auto c = std::make_shared<context>();
+    auto r = c->p.get_future();
+    if (futures.empty()) c->p.set_exception(std::make_exception_ptr(std::future_error(std::future_errc::no_state)));
+    for (size_t i = 0; i < futures.size(); i++) {
+        auto s = detail::future_access::take(futures[i]);
+        s->on_ready([c, s, i] {
+            if (c->done.exchange(true)) return;
+            if (s->has_error()) c->p.set_exception(s->exception());
+            else                result::set(c->p, i, *s);
+        });
+    }
+    return r;
+}
+
+
+} // namespace jar
+
+
+#endif // _JAR_FUTURE_H
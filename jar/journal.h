@@ -0,0 +1,563 @@
+/**
+ * @file journal.h
+ * @author fomjar (fomjar@gmail.com)
+ * @brief 
+ * @version 0.1
+ * @date 2022-05-09
+ * 
+ * @copyright Copyright (c) 2022
+ * 
+ */
+
+#ifndef _JAR_JOURNAL_H
+#define _JAR_JOURNAL_H
+
+#include "exec.h"
+#include "shared.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace jar {
+
+
+
+/**
+ * @brief 序列化。默认支持可平凡复制的类型，按内存布局原样读写；其他类型可以特化此模板。
+ * 
+ * template <>
+ * struct serializer<my_type> {
+ *     static void write(std::string & out, const my_type & v);
+ *     static bool read(const char *& p, const char * end, my_type & v);
+ * };
+ * 
+ * @tparam _Tp 
+ * 
+ * @author fomjar
+ * @date 2022/05/09
+ */
+template <typename _Tp, typename = void>
+struct serializer;
+
+template <typename _Tp>
+struct serializer<_Tp, typename std::enable_if<std::is_trivially_copyable<_Tp>::value>::type> {
+    static void write(std::string & out, const _Tp & v) {
+        out.append((const char *) &v, sizeof(_Tp));
+    }
+    static bool read(const char *& p, const char * end, _Tp & v) {
+        if ((size_t) (end - p) < sizeof(_Tp)) return false;
+        memcpy(&v, p, sizeof(_Tp));
+        p += sizeof(_Tp);
+        return true;
+    }
+};
+
+template <>
+struct serializer<std::string> {
+    static void write(std::string & out, const std::string & v) {
+        serializer<uint32_t>::write(out, (uint32_t) v.size());
+        out.append(v);
+    }
+    static bool read(const char *& p, const char * end, std::string & v) {
+        uint32_t size;
+        if (!serializer<uint32_t>::read(p, end, size) || (size_t) (end - p) < size) return false;
+        v.assign(p, size);
+        p += size;
+        return true;
+    }
+};
+
+
+
+namespace detail {
+
+template <typename _Tp, typename = void>
+struct is_serializable : std::false_type { };
+
+template <typename _Tp>
+struct is_serializable<_Tp, decltype((void) sizeof(serializer<_Tp>))> : std::true_type { };
+
+} // namespace detail
+
+template <typename _Tp>
+struct serializer<shared<_Tp>, typename std::enable_if<detail::is_serializable<_Tp>::value>::type> {
+    static void write(std::string & out, const shared<_Tp> & v) {
+        serializer<_Tp>::write(out, *v);
+    }
+    static bool read(const char *& p, const char * end, shared<_Tp> & v) {
+        _Tp t;
+        if (!serializer<_Tp>::read(p, end, t)) return false;
+        v = share(std::move(t));
+        return true;
+    }
+};
+
+
+
+/**
+ * @brief 类型的稳定标识，由名称和序列化格式的版本组成，用于区分日志和共享内存总线中不同参数类型的记录。
+ * 不依赖编译器和构建，换一个编译器或改动代码后写出的记录仍然能对上。
+ * 
+ * 算术类型按种类和位宽命名，std::string和shared<T>已提供。其他类型需要特化此模板才会被写入日志或在共享内存总线上传递，
+ * 名称在应用内唯一，序列化格式改变时增加版本号，旧的记录不会被当作新格式解码。
+ * 
+ * template <>
+ * struct type_tag<my_type> {
+ *     static const char * name()    { return "app.my_type"; }
+ *     static uint32_t     version() { return 1; }
+ * };
+ * 
+ * @tparam _Tp 
+ * 
+ * @author fomjar
+ * @date 2022/05/09
+ */
+template <typename _Tp, typename = void>
+struct type_tag;
+
+template <typename _Tp>
+struct type_tag<_Tp, typename std::enable_if<std::is_arithmetic<_Tp>::value>::type> {
+    static const char * name() {
+        static const char * const names[3][5] = {
+            { "i8", "i16", "i32", "i64", "i128" },
+            { "u8", "u16", "u32", "u64", "u128" },
+            { "f8", "f16", "f32", "f64", "f128" },
+        };
+        if (std::is_same<_Tp, bool>::value) return "bool";
+        auto k = std::is_floating_point<_Tp>::value ? 2 : std::is_signed<_Tp>::value ? 0 : 1;
+        auto w = sizeof(_Tp) <= 1 ? 0 : sizeof(_Tp) <= 2 ? 1 : sizeof(_Tp) <= 4 ? 2 : sizeof(_Tp) <= 8 ? 3 : 4;
+        return names[k][w];
+    }
+    static uint32_t version() { return 1; }
+};
+
+template <>
+struct type_tag<std::string> {
+    static const char * name()    { return "string"; }
+    static uint32_t     version() { return 1; }
+};
+
+namespace detail {
+
+template <typename _Tp, typename = void>
+struct is_tagged : std::false_type { };
+
+template <typename _Tp>
+struct is_tagged<_Tp, decltype((void) sizeof(jar::type_tag<_Tp>))> : std::true_type { };
+
+} // namespace detail
+
+template <typename _Tp>
+struct type_tag<shared<_Tp>, typename std::enable_if<detail::is_tagged<_Tp>::value>::type> {
+    static const char * name() {
+        static const std::string n = std::string("shared<") + type_tag<_Tp>::name() + ">";
+        return n.c_str();
+    }
+    static uint32_t version() { return type_tag<_Tp>::version(); }
+};
+
+
+
+namespace detail {
+
+/**
+ * @brief 可以写入日志：可序列化且有type_tag。
+ */
+template <typename ... _Ap>
+struct all_recordable;
+
+template <>
+struct all_recordable<> : std::true_type { };
+
+template <typename _A0, typename ... _Ap>
+struct all_recordable<_A0, _Ap...> : std::integral_constant<bool,
+        is_serializable<_A0>::value && is_tagged<_A0>::value && all_recordable<_Ap...>::value> { };
+
+inline void write_all(std::string &) { }
+
+template <typename _A0, typename ... _Ap>
+inline void write_all(std::string & out, const _A0 & a0, const _Ap & ... args) {
+    serializer<_A0>::write(out, a0);
+    write_all(out, args...);
+}
+
+template <typename _Tuple, size_t _I = 0>
+inline typename std::enable_if<_I == std::tuple_size<_Tuple>::value, bool>::type
+read_all(const char *&, const char *, _Tuple &) { return true; }
+
+template <typename _Tuple, size_t _I = 0>
+inline typename std::enable_if<_I < std::tuple_size<_Tuple>::value, bool>::type
+read_all(const char *& p, const char * end, _Tuple & t) {
+    using _Ep = typename std::tuple_element<_I, _Tuple>::type;
+    return serializer<_Ep>::read(p, end, std::get<_I>(t)) && read_all<_Tuple, _I + 1>(p, end, t);
+}
+
+template <typename ... _Ap>
+inline typename std::enable_if<0 == sizeof...(_Ap)>::type describe(std::string &) { }
+
+template <typename _A0, typename ... _Ap>
+inline void describe(std::string & out) {
+    out.append(jar::type_tag<_A0>::name());
+    out.append("/" + std::to_string(jar::type_tag<_A0>::version()) + ";");
+    describe<_Ap...>(out);
+}
+
+/**
+ * @brief 类型列表的签名，用于区分日志中不同参数类型的记录。对各类型的type_tag名称和版本做FNV-1a，跨构建稳定。
+ */
+template <typename ... _Ap>
+inline uint64_t signature() {
+    static const uint64_t sig = [] {
+        std::string s;
+        describe<_Ap...>(s);
+        uint64_t h = 0xcbf29ce484222325ULL;
+        for (auto c : s) {
+            h ^= (unsigned char) c;
+            h *= 0x100000001b3ULL;
+        }
+        return h;
+    } ();
+    return sig;
+}
+
+/**
+ * @brief CRC-32（IEEE 802.3），按字节查表。
+ */
+inline uint32_t crc32(uint32_t crc, const void * data, size_t size) {
+    static const struct table {
+        table() {
+            for (uint32_t i = 0; i < 256; i++) {
+                uint32_t c = i;
+                for (int k = 0; k < 8; k++) c = c & 1 ? 0xedb88320u ^ (c >> 1) : c >> 1;
+                this->t[i] = c;
+            }
+        }
+        uint32_t t[256];
+    } tab;
+
+    auto p = (const unsigned char *) data;
+    crc = ~crc;
+    for (size_t i = 0; i < size; i++) crc = tab.t[(crc ^ p[i]) & 0xff] ^ (crc >> 8);
+    return ~crc;
+}
+
+} // namespace detail
+
+
+
+/**
+ * @brief 只追加的事件日志。记录按段存放在内存映射文件里，追加只是一次内存复制；落盘（msync）在后台线程上按批次进行，
+ * 不阻塞追加的线程。回放直接遍历映射内存，不做额外复制。
+ * 
+ * 每条记录为16字节头（长度、校验、标签）加载荷，按8字节对齐。校验是覆盖长度、标签和载荷的CRC-32，长度字段最后写入。
+ * 进程崩溃或断电后残缺的记录校验不通过，回放在第一条无效记录处停止，之后的追加从那里开始覆盖。
+ * 重新打开时该位置之后的空间被清零，无效记录后面残留的旧记录不会在新记录写完后被接着回放出来。
+ * 
+ * jar::journal j("/var/lib/app/events");
+ * j.append(tag, data, size);
+ * j.replay([] (uint64_t tag, const char * data, size_t size) { ... });
+ * 
+ * @author fomjar
+ * @date 2022/05/09
+ */
+class journal {
+
+    struct header {
+        uint32_t size;
+        uint32_t check;
+        uint64_t tag;
+    };
+
+    static const uint32_t MAGIC = 0x4a415221; // "JAR!"，校验的初值
+
+    static size_t align(size_t n) { return (n + 7) & ~(size_t) 7; }
+
+    static uint32_t checksum(uint32_t size, uint64_t tag, const char * data) {
+        auto c = detail::crc32(MAGIC, &size, sizeof(size));
+        c = detail::crc32(c, &tag, sizeof(tag));
+        return detail::crc32(c, data, size);
+    }
+
+public:
+    /**
+     * @brief 打开或创建日志目录，已有日志时接在最后一条记录之后追加。
+     * 
+     * @param dir 日志目录，需已存在
+     * @param segment_size 每个段文件的大小
+     * @param sync_batch 每追加多少条记录落盘一次，0表示只在sync和换段时落盘
+     */
+    journal(const std::string & dir, size_t segment_size = 64 << 20, size_t sync_batch = 256) :
+        dir(dir),
+        segment_size(segment_size),
+        sync_batch(sync_batch),
+        mutex(),
+        index(0),
+        base(nullptr),
+        capacity(0),
+        offset(0),
+        synced(0),
+        unsynced(0),
+        syncer() {
+        this->syncer.set_name("jar::journal sync");
+        this->syncer.start();
+        auto segs = this->segments();
+        if (segs.empty()) {
+            this->open_segment(0, 0);
+            return;
+        }
+        this->index = segs.back();
+        if (this->open_segment(this->index, 0)) {
+            this->offset = this->scan(this->base, this->capacity, nullptr);
+            this->synced = this->offset;
+            this->reset_tail();
+        }
+    }
+    journal(const journal &) = delete;
+    journal & operator=(const journal &) = delete;
+    ~journal() {
+        {
+            std::lock_guard<std::mutex> lock(this->mutex);
+            this->close_segment();
+        }
+        this->drain();
+        this->syncer.stop();
+    }
+
+    bool is_open() const { return nullptr != this->base; }
+
+    /**
+     * @brief 追加一条记录。
+     * 
+     * @param tag 记录标签，回放时原样返回
+     * @param data 
+     * @param size 
+     * @return true 
+     * @return false 日志不可写
+     */
+    bool append(uint64_t tag, const void * data, size_t size) {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        if (!this->base) return false;
+
+        auto need = sizeof(header) + align(size);
+        if (this->offset + need + sizeof(header) > this->capacity) {
+            this->close_segment();
+            if (!this->open_segment(this->index + 1, need + sizeof(header)))
+                return false;
+        }
+
+        auto h = (header *) (this->base + this->offset);
+        memcpy(this->base + this->offset + sizeof(header), data, size);
+        h->tag   = tag;
+        h->check = checksum((uint32_t) size, tag, (const char *) data);
+        __atomic_store_n(&h->size, (uint32_t) size, __ATOMIC_RELEASE);
+        this->offset += need;
+
+        if (this->sync_batch && ++this->unsynced >= this->sync_batch)
+            this->flush();
+        return true;
+    }
+
+    /**
+     * @brief 把已追加的记录落盘，返回时已完成。
+     */
+    void sync() {
+        {
+            std::lock_guard<std::mutex> lock(this->mutex);
+            this->flush();
+        }
+        this->drain();
+    }
+
+    /**
+     * @brief 按追加顺序回放所有记录。载荷指向映射内存，只在回调内有效。
+     * 
+     * @param f void(uint64_t tag, const char * data, size_t size)
+     * @return size_t 回放的记录数
+     */
+    size_t replay(const func<void(uint64_t, const char *, size_t)> & f) {
+        this->sync();
+
+        size_t count = 0;
+        for (auto i : this->segments()) {
+            auto fd = ::open(this->path(i).c_str(), O_RDONLY | O_CLOEXEC);
+            if (fd < 0) continue;
+
+            struct stat st;
+            if (0 == fstat(fd, &st) && st.st_size > 0) {
+                auto p = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+                if (MAP_FAILED != p) {
+                    madvise(p, st.st_size, MADV_SEQUENTIAL);
+                    this->scan((char *) p, st.st_size, [&f, &count] (const header & h, const char * data) {
+                        f(h.tag, data, h.size);
+                        count++;
+                    });
+                    munmap(p, st.st_size);
+                }
+            }
+            ::close(fd);
+        }
+        return count;
+    }
+
+private:
+    std::string path(uint64_t i) const {
+        char name[32];
+        snprintf(name, sizeof(name), "/%016llx.jnl", (unsigned long long) i);
+        return this->dir + name;
+    }
+
+    std::vector<uint64_t> segments() const {
+        std::vector<uint64_t> segs;
+        auto d = opendir(this->dir.c_str());
+        if (!d) return segs;
+        while (auto e = readdir(d)) {
+            unsigned long long i;
+            char ext[8];
+            if (2 == sscanf(e->d_name, "%16llx.%3s", &i, ext) && 0 == strcmp(ext, "jnl"))
+                segs.push_back(i);
+        }
+        closedir(d);
+        std::sort(segs.begin(), segs.end());
+        return segs;
+    }
+
+    /**
+     * @brief 遍历映射中的有效记录。
+     * 
+     * @return size_t 有效记录的结尾
+     */
+    template <typename _Fp>
+    size_t scan(const char * p, size_t size, _Fp f) const {
+        size_t off = 0;
+        while (off + sizeof(header) <= size) {
+            auto h = (const header *) (p + off);
+            auto n = __atomic_load_n(&h->size, __ATOMIC_ACQUIRE);
+            if (0 == n || off + sizeof(header) + n > size) break;
+            if (checksum(n, h->tag, p + off + sizeof(header)) != h->check) break;
+            this->visit(f, *h, p + off + sizeof(header));
+            off += sizeof(header) + align(n);
+        }
+        return off;
+    }
+
+    static void visit(std::nullptr_t, const header &, const char *) { }
+    template <typename _Fp>
+    static void visit(_Fp & f, const header & h, const char * data) { f(h, data); }
+
+    bool open_segment(uint64_t i, size_t min_size) {
+        auto fd = ::open(this->path(i).c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        if (fd < 0) return false;
+
+        struct stat st;
+        size_t size = std::max(this->segment_size, min_size);
+        if (0 == fstat(fd, &st) && (size_t) st.st_size > size)
+            size = st.st_size;
+        if (0 != posix_fallocate(fd, 0, size) && 0 != ftruncate(fd, size)) {
+            ::close(fd);
+            return false;
+        }
+
+        auto p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (MAP_FAILED == p) return false;
+
+        this->index     = i;
+        this->base      = (char *) p;
+        this->capacity  = size;
+        this->offset    = 0;
+        this->synced    = 0;
+        this->unsynced  = 0;
+        return true;
+    }
+
+    /**
+     * @brief 把当前段中offset之后的空间清零。先截断再扩回原大小，由文件系统丢弃旧数据，不需要逐页写零；
+     * 无法截断时退回到直接清零映射内存并落盘。截断后无法扩回时映射已不可访问，关闭日志。
+     */
+    void reset_tail() {
+        if (this->offset >= this->capacity) return;
+
+        auto fd = ::open(this->path(this->index).c_str(), O_RDWR | O_CLOEXEC);
+        if (fd >= 0 && 0 == ftruncate(fd, this->offset)) {
+            bool grown = 0 == posix_fallocate(fd, 0, this->capacity) || 0 == ftruncate(fd, this->capacity);
+            ::close(fd);
+            if (!grown) {
+                munmap(this->base, this->capacity);
+                this->base = nullptr;
+            }
+            return;
+        }
+        if (fd >= 0) ::close(fd);
+
+        auto page = (size_t) sysconf(_SC_PAGESIZE);
+        auto beg = this->offset / page * page;
+        memset(this->base + this->offset, 0, this->capacity - this->offset);
+        msync(this->base + beg, this->capacity - beg, MS_SYNC);
+    }
+
+    /**
+     * @brief 关闭当前段，调用时持有mutex。解除映射排在该段的落盘之后，在后台线程上进行。
+     */
+    void close_segment() {
+        if (!this->base) return;
+        this->flush();
+        auto p = this->base;
+        auto n = this->capacity;
+        this->syncer.submit((func_vv) [p, n] { munmap(p, n); });
+        this->base = nullptr;
+    }
+
+    /**
+     * @brief 安排落盘已追加的记录，调用时持有mutex。msync在后台线程上执行，不阻塞追加。
+     */
+    void flush() {
+        if (!this->base || this->synced == this->offset) return;
+
+        auto page = (size_t) sysconf(_SC_PAGESIZE);
+        auto beg = this->synced / page * page;
+        auto p = this->base + beg;
+        auto n = this->offset - beg;
+        this->syncer.submit((func_vv) [p, n] { msync(p, n, MS_SYNC); });
+        this->synced   = this->offset;
+        this->unsynced = 0;
+    }
+
+    /**
+     * @brief 等待后台线程执行完已安排的落盘。
+     */
+    void drain() {
+        std::promise<void> done;
+        auto f = done.get_future();
+        this->syncer.submit(done, (func_vv) [] { });
+        f.wait();
+    }
+
+    std::string     dir;
+    size_t          segment_size;
+    size_t          sync_batch;
+    std::mutex      mutex;
+    uint64_t        index;      // 当前段
+    char          * base;
+    size_t          capacity;
+    size_t          offset;     // 下一条记录的位置
+    size_t          synced;     // 已落盘的位置
+    size_t          unsynced;   // 未落盘的记录数
+    queuer          syncer;     // 执行msync和munmap
+};
+
+
+} // namespace jar
+
+
+#endif // _JAR_JOURNAL_H
@@ -0,0 +1,491 @@
+/**
+ * @file log.h
+ * @author fomjar (fomjar@gmail.com)
+ * @brief 
+ * @version 0.1
+ * @date 2022-05-12
+ * 
+ * @copyright Copyright (c) 2022
+ * 
+ */
+
+#ifndef _JAR_LOG_H
+#define _JAR_LOG_H
+
+#include "clock.h"
+#include "exec.h"
+#include "time.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+namespace jar {
+
+
+
+/**
+ * @brief 日志级别。
+ * 
+ * @author fomjar
+ * @date 2022/05/12
+ */
+enum class level : uint8_t {
+    trace,
+    debug,
+    info,
+    warn,
+    error,
+};
+
+
+
+namespace detail {
+
+/**
+ * @brief 日志参数的二进制编码。数值原样复制，字符串连同内容一起复制，后台线程解码并格式化。
+ */
+template <typename _Tp, typename = void>
+struct log_arg;
+
+template <typename _Tp>
+struct log_arg<_Tp, typename std::enable_if<std::is_arithmetic<_Tp>::value || std::is_enum<_Tp>::value>::type> {
+    static size_t size(const _Tp &) { return sizeof(_Tp); }
+    static void write(char *& p, const _Tp & v) {
+        memcpy(p, &v, sizeof(_Tp));
+        p += sizeof(_Tp);
+    }
+    static void render(std::string & out, const char *& p) {
+        _Tp v;
+        memcpy(&v, p, sizeof(_Tp));
+        p += sizeof(_Tp);
+        append(out, v);
+    }
+
+private:
+    static void append(std::string & out, bool v) { out += v ? "true" : "false"; }
+    static void append(std::string & out, char v) { out += v; }
+    static void append(std::string & out, float v) { append(out, (double) v); }
+    static void append(std::string & out, double v) {
+        char buf[32];
+        out.append(buf, snprintf(buf, sizeof(buf), "%g", v));
+    }
+    static void append(std::string & out, long double v) {
+        char buf[48];
+        out.append(buf, snprintf(buf, sizeof(buf), "%Lg", v));
+    }
+    template <typename _Vp>
+    static typename std::enable_if<std::is_enum<_Vp>::value>::type
+    append(std::string & out, _Vp v) { out += std::to_string((long long) v); }
+    template <typename _Vp>
+    static typename std::enable_if<std::is_integral<_Vp>::value>::type
+    append(std::string & out, _Vp v) { out += std::to_string(v); }
+};
+
+struct log_str {
+    static size_t size(const char *, size_t n) { return sizeof(uint32_t) + n; }
+    static void write(char *& p, const char * s, size_t n) {
+        auto len = (uint32_t) n;
+        memcpy(p, &len, sizeof(len));
+        memcpy(p + sizeof(len), s, n);
+        p += sizeof(len) + n;
+    }
+    static void render(std::string & out, const char *& p) {
+        uint32_t len;
+        memcpy(&len, p, sizeof(len));
+        out.append(p + sizeof(len), len);
+        p += sizeof(len) + len;
+    }
+};
+
+template <>
+struct log_arg<const char *> {
+    static size_t size(const char * v) { return log_str::size(v, v ? strlen(v) : 0); }
+    static void write(char *& p, const char * v) { log_str::write(p, v, v ? strlen(v) : 0); }
+    static void render(std::string & out, const char *& p) { log_str::render(out, p); }
+};
+
+template <>
+struct log_arg<char *> : log_arg<const char *> { };
+
+template <size_t _Np>
+struct log_arg<char[_Np]> : log_arg<const char *> { };
+
+template <>
+struct log_arg<std::string> {
+    static size_t size(const std::string & v) { return log_str::size(v.data(), v.size()); }
+    static void write(char *& p, const std::string & v) { log_str::write(p, v.data(), v.size()); }
+    static void render(std::string & out, const char *& p) { log_str::render(out, p); }
+};
+
+template <typename _Tp>
+struct log_arg<_Tp *, typename std::enable_if<!std::is_same<typename std::remove_cv<_Tp>::type, char>::value>::type> {
+    static size_t size(const void *) { return sizeof(uintptr_t); }
+    static void write(char *& p, const void * v) {
+        auto u = (uintptr_t) v;
+        memcpy(p, &u, sizeof(u));
+        p += sizeof(u);
+    }
+    static void render(std::string & out, const char *& p) {
+        uintptr_t u;
+        memcpy(&u, p, sizeof(u));
+        p += sizeof(u);
+        char buf[24];
+        out.append(buf, snprintf(buf, sizeof(buf), "0x%llx", (unsigned long long) u));
+    }
+};
+
+} // namespace detail
+
+
+
+/**
+ * @brief 异步日志。调用线程只把时间戳、级别、格式串地址和参数的二进制编码写入本线程的环形缓冲，格式化和写文件都在后台线程批量完成。
+ * 
+ * 每个线程第一次写日志时分配一个单生产者单消费者的环形缓冲，写入无锁，不分配内存；后台looper定期取出所有线程的记录，按时间排序、格式化后一次写出。
+ * 缓冲大小固定，写满时按策略丢弃新记录（计入dropped）或等待后台线程腾出空间。
+ * 
+ * 格式串中的"{}"按顺序替换为参数，格式串只保存地址，必须是字符串字面量，因此通过JAR_LOG_*宏调用，宏在编译期拒绝非字面量。
+ * 参数支持数值、枚举、指针、C字符串和std::string，字符串内容会被复制。
+ * 
+ * jar::logger log("/var/log/app.log");
+ * JAR_LOG_INFO(log, "order {} filled at {}", id, px);
+ * JAR_LOG_ERROR(log, "connect {} failed: {}", host, std::string(strerror(errno)));
+ * 
+ * @author fomjar
+ * @date 2022/05/12
+ */
+class logger {
+
+    struct record {
+        uint32_t    size;       // 包括记录头，PAD位表示填充
+        uint8_t     lv;
+        uint8_t     reserved[3];
+        int64_t     ts;
+        const char* fmt;
+        void     (* render)(std::string &, const char *, const char *);
+    };
+
+    static const uint32_t PAD   = 0x80000000u;
+    static const size_t   SLOTS = 8;            // 每个线程缓存缓冲的logger数
+
+    struct buffer {
+        explicit buffer(size_t capacity) : data(new char[capacity]), capacity(capacity), head(0), tail(0) { }
+        ~buffer() { delete[] this->data; }
+
+        char                  * data;
+        size_t                  capacity;   // 2的幂
+        std::atomic<uint64_t>   head;       // 仅生产者写
+        std::atomic<uint64_t>   tail;       // 仅消费者写
+    };
+
+    struct line {
+        int64_t     ts;
+        uint64_t    seq;
+        std::string text;
+    };
+
+public:
+    /**
+     * @brief 格式串是字符串字面量的标记，只由JAR_LOG_*宏构造。
+     */
+    struct literal { };
+
+    /**
+     * @brief 写满时的处理策略。
+     * 
+     * drop:    丢弃新记录，调用线程不等待。
+     * block:   等待后台线程腾出空间。
+     */
+    enum class policy {
+        drop,
+        block,
+    };
+
+public:
+    /**
+     * @brief 
+     * 
+     * @param path 日志文件，追加写入；为空时写到标准输出
+     * @param buffer_size 每个线程的缓冲大小，向上取整为2的幂
+     * @param flush_interval 后台线程的刷新间隔
+     */
+    template <class _Rep = long long, class _Period = std::milli>
+    explicit logger(const std::string & path = "", size_t buffer_size = 64 << 10,
+            const std::chrono::duration<_Rep, _Period> & flush_interval = std::chrono::milliseconds(5)) :
+        file(path.empty() ? stdout : fopen(path.c_str(), "a")),
+        owned(!path.empty()),
+        buffer_size(round(buffer_size)),
+        threshold((uint8_t) level::info),
+        overflow(policy::drop),
+        _dropped(0),
+        id(next_id()),
+        buffers(),
+        mutex(),
+        drain_mutex(),
+        format("YYYY/MM/DD hh:mm:ss.SSSSSS"),
+        base_ns(tsc::now_ns()),
+        base_us(now()),
+        flusher(flush_interval) {
+        this->flusher.set_name("jar::logger #" + std::to_string(this->id));
+        this->flusher.submit((func_vv) [this] { this->flush(); });
+        this->flusher.start();
+    }
+    logger(const logger &) = delete;
+    logger & operator=(const logger &) = delete;
+    ~logger() {
+        this->flusher.stop();
+        this->flush();
+        if (this->owned && this->file) fclose(this->file);
+    }
+
+    bool is_open() const { return nullptr != this->file; }
+
+    void set_level(level lv) { this->threshold = (uint8_t) lv; }
+    level get_level() const { return (level) this->threshold.load(); }
+
+    void set_policy(policy p) { this->overflow = p; }
+
+    /**
+     * @brief 因缓冲写满而丢弃的记录数。
+     */
+    uint64_t dropped() const { return this->_dropped; }
+
+public:
+    template <size_t _Np, typename ... _Ap>
+    bool trace(literal, const char (&fmt)[_Np], const _Ap & ... args) { return this->write(level::trace, literal(), fmt, args...); }
+    template <size_t _Np, typename ... _Ap>
+    bool debug(literal, const char (&fmt)[_Np], const _Ap & ... args) { return this->write(level::debug, literal(), fmt, args...); }
+    template <size_t _Np, typename ... _Ap>
+    bool info (literal, const char (&fmt)[_Np], const _Ap & ... args) { return this->write(level::info,  literal(), fmt, args...); }
+    template <size_t _Np, typename ... _Ap>
+    bool warn (literal, const char (&fmt)[_Np], const _Ap & ... args) { return this->write(level::warn,  literal(), fmt, args...); }
+    template <size_t _Np, typename ... _Ap>
+    bool error(literal, const char (&fmt)[_Np], const _Ap & ... args) { return this->write(level::error, literal(), fmt, args...); }
+
+    /**
+     * @brief 写一条日志。
+     * 
+     * @tparam _Ap 
+     * @param lv 
+     * @param fmt 字符串字面量，通过JAR_LOG_WRITE传入
+     * @param args 
+     * @return true 
+     * @return false 级别被过滤，或缓冲已满被丢弃
+     */
+    template <size_t _Np, typename ... _Ap>
+    bool write(level lv, literal, const char (&fmt)[_Np], const _Ap & ... args) {
+        if ((uint8_t) lv < this->threshold.load(std::memory_order_relaxed)) return false;
+
+        auto ts = tsc::now_ns();
+        size_t n = sizeof(record);
+        int sizes[] = { 0, ((n += detail::log_arg<_Ap>::size(args)), 0)... };
+        (void) sizes;
+        n = (n + 7) & ~(size_t) 7;
+
+        auto & b = this->local();
+        char * p = this->reserve(b, n);
+        if (!p) {
+            this->_dropped++;
+            return false;
+        }
+
+        auto r = (record *) p;
+        r->size     = (uint32_t) n;
+        r->lv       = (uint8_t) lv;
+        r->ts       = ts;
+        r->fmt      = fmt;
+        r->render   = &logger::render<_Ap...>;
+        char * q = p + sizeof(record);
+        int writes[] = { 0, (detail::log_arg<_Ap>::write(q, args), 0)... };
+        (void) writes;
+
+        b.head.store(b.head.load(std::memory_order_relaxed) + n, std::memory_order_release);
+        return true;
+    }
+
+    /**
+     * @brief 取出所有线程的记录，格式化后写出。后台线程定期调用，也可以手动调用以确保已写的日志落地。
+     */
+    void flush() {
+        std::lock_guard<std::mutex> lock(this->drain_mutex);
+
+        std::vector<std::shared_ptr<buffer>> bufs;
+        {
+            JAR_EXEC_LOCK_GUARD
+            bufs = this->buffers;
+        }
+
+        std::vector<line> lines;
+        uint64_t seq = 0;
+        for (const auto & b : bufs) this->drain(*b, lines, seq);
+
+        {
+            // 线程退出或切换logger后，缓冲只被buffers和上面的bufs持有，取空后回收
+            JAR_EXEC_LOCK_GUARD
+            this->buffers.erase(std::remove_if(this->buffers.begin(), this->buffers.end(), [] (const std::shared_ptr<buffer> & b) {
+                return b.use_count() <= 2 && b->head.load() == b->tail.load();
+            }), this->buffers.end());
+        }
+
+        if (lines.empty() || !this->file) return;
+
+        std::sort(lines.begin(), lines.end(), [] (const line & a, const line & b) {
+            return a.ts < b.ts || (a.ts == b.ts && a.seq < b.seq);
+        });
+        for (const auto & l : lines) fwrite(l.text.data(), 1, l.text.size(), this->file);
+        fflush(this->file);
+    }
+
+private:
+    static size_t round(size_t n) {
+        size_t c = 1024;
+        while (c < n) c <<= 1;
+        return c;
+    }
+
+    static uint64_t next_id() {
+        static std::atomic<uint64_t> id(0);
+        return ++id;
+    }
+
+    template <typename ... _Ap>
+    static void render(std::string & out, const char * fmt, const char * p) {
+        using arg_render = void (*)(std::string &, const char *&);
+        static const arg_render renders[] = { &detail::log_arg<_Ap>::render..., nullptr };
+
+        size_t i = 0;
+        for (auto c = fmt; *c; c++) {
+            if ('{' == c[0] && '}' == c[1] && i < sizeof...(_Ap)) {
+                renders[i++](out, p);
+                c++;
+            } else {
+                out += *c;
+            }
+        }
+    }
+
+    /**
+     * @brief 当前线程在此logger上的缓冲。线程按logger各缓存一个缓冲，最近使用的排在最前，交替使用几个logger时不会反复分配和加锁。
+     * 最多缓存SLOTS个，超出时放掉最久未用的，它取空后由所属logger回收。
+     */
+    buffer & local() {
+        struct slot {
+            uint64_t                id;
+            std::shared_ptr<buffer> buf;
+        };
+        static thread_local std::vector<slot> slots;
+        if (!slots.empty() && slots.front().id == this->id) return *slots.front().buf;
+
+        for (size_t i = 1; i < slots.size(); i++) {
+            if (slots[i].id != this->id) continue;
+            std::rotate(slots.begin(), slots.begin() + i, slots.begin() + i + 1);
+            return *slots.front().buf;
+        }
+
+        JAR_EXEC_LOCK_GUARD
+        auto buf = std::make_shared<buffer>(this->buffer_size);
+        this->buffers.push_back(buf);
+        if (slots.size() >= SLOTS) slots.pop_back();
+        slots.insert(slots.begin(), slot { this->id, buf });
+        return *buf;
+    }
+
+    char * reserve(buffer & b, size_t n) {
+        if (n > b.capacity / 2) return nullptr;
+
+        auto head = b.head.load(std::memory_order_relaxed);
+        auto off  = head & (b.capacity - 1);
+        auto room = b.capacity - off;
+        auto need = n <= room ? n : room + n;   // 放不下时先填充到缓冲末尾
+
+        while (b.capacity - (head - b.tail.load(std::memory_order_acquire)) < need) {
+            if (policy::drop == this->overflow) return nullptr;
+            std::this_thread::yield();
+        }
+
+        if (n > room) {
+            uint32_t pad = (uint32_t) room | PAD;
+            memcpy(b.data + off, &pad, sizeof(pad));
+            head += room;
+            b.head.store(head, std::memory_order_release);
+            off = 0;
+        }
+        return b.data + off;
+    }
+
+    void drain(buffer & b, std::vector<line> & lines, uint64_t & seq) {
+        static const char * NAMES[] = { "TRACE", "DEBUG", "INFO ", "WARN ", "ERROR" };
+
+        auto tail = b.tail.load(std::memory_order_relaxed);
+        auto head = b.head.load(std::memory_order_acquire);
+        while (tail < head) {
+            auto p = b.data + (tail & (b.capacity - 1));
+            uint32_t size;
+            memcpy(&size, p, sizeof(size));
+            if (size & PAD) {
+                tail += size & ~PAD;
+                continue;
+            }
+
+            auto r = (const record *) p;
+            line l { r->ts, seq++, std::string() };
+            char ts[32];
+            auto n = this->format.format(ts, sizeof(ts), this->base_us + (r->ts - this->base_ns) / 1000);
+            l.text.reserve(64);
+            l.text.append(ts, n);
+            l.text += ' ';
+            l.text += NAMES[std::min<size_t>(r->lv, 4)];
+            l.text += ' ';
+            r->render(l.text, r->fmt, p + sizeof(record));
+            l.text += '\n';
+            lines.push_back(std::move(l));
+            tail += size;
+        }
+        b.tail.store(tail, std::memory_order_release);
+    }
+
+    FILE                                  * file;
+    bool                                    owned;
+    size_t                                  buffer_size;
+    std::atomic<uint8_t>                    threshold;
+    std::atomic<policy>                     overflow;
+    std::atomic<uint64_t>                   _dropped;
+    uint64_t                                id;         // 区分线程缓存属于哪个logger
+    std::vector<std::shared_ptr<buffer>>    buffers;
+    std::mutex                              mutex;      // buffers的锁
+    std::mutex                              drain_mutex;
+    time_format                             format;
+    int64_t                                 base_ns;    // 构造时的tsc时间与墙上时间，用于换算记录的时间戳
+    long long                               base_us;
+    looper                                  flusher;
+
+};
+
+
+} // namespace jar
+
+
+
+/**
+ * @brief 写日志。格式串必须是字符串字面量："" fmt 只有在fmt是字面量时才能拼接，传入数组或指针时编译失败。
+ * 
+ * JAR_LOG_INFO(log, "order {} filled at {}", id, px);
+ */
+#define JAR_LOG_WRITE(log, lv, ...) (log).write(lv, jar::logger::literal(), "" __VA_ARGS__)
+#define JAR_LOG_TRACE(log, ...)     (log).trace(jar::logger::literal(), "" __VA_ARGS__)
+#define JAR_LOG_DEBUG(log, ...)     (log).debug(jar::logger::literal(), "" __VA_ARGS__)
+#define JAR_LOG_INFO(log, ...)      (log).info (jar::logger::literal(), "" __VA_ARGS__)
+#define JAR_LOG_WARN(log, ...)      (log).warn (jar::logger::literal(), "" __VA_ARGS__)
+#define JAR_LOG_ERROR(log, ...)     (log).error(jar::logger::literal(), "" __VA_ARGS__)
+
+
+#endif // _JAR_LOG_H
@@ -0,0 +1,317 @@
+/**
+ * @file pipeline.h
+ * @author fomjar (fomjar@gmail.com)
+ * @brief 
+ * @version 0.1
+ * @date 2022-05-13
+ * 
+ * @copyright Copyright (c) 2022
+ * 
+ */
+
+#ifndef _JAR_PIPELINE_H
+#define _JAR_PIPELINE_H
+
+#include "channel.h"
+#include "clock.h"
+#include "exec.h"
+
+#include <atomic>
+#include <cstdint>
+#include <future>
+#include <iterator>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace jar {
+
+
+
+/**
+ * @brief 流水线阶段的配置。
+ * 
+ * @author fomjar
+ * @date 2022/05/13
+ */
+struct stage_options {
+    stage_options(size_t workers = 1, size_t batch = 1, size_t capacity = 1024) :
+        workers(workers), batch(batch), capacity(capacity) { }
+
+    size_t  workers;    // 工作线程数，1为串行并保持顺序，大于1为并行、不保证顺序
+    size_t  batch;      // 每次从输入队列取出的最大数量
+    size_t  capacity;   // 输入队列容量
+};
+
+
+
+/**
+ * @brief 流水线阶段的统计。吞吐量为processed除以运行时长，busy_ns除以(workers * 运行时长)为利用率，
+ * 利用率接近1、输入队列长期接近满的阶段就是瓶颈。
+ * 
+ * @author fomjar
+ * @date 2022/05/13
+ */
+struct stage_stats {
+    std::string name;
+    size_t      workers;
+    size_t      capacity;   // 输入队列容量
+    size_t      depth;      // 输入队列当前长度
+    uint64_t    processed;  // 已处理的输入数
+    uint64_t    emitted;    // 已输出的数量
+    int64_t     busy_ns;    // 所有worker在处理函数内的累计时长
+};
+
+
+
+namespace detail {
+
+struct pipeline_stage_base {
+    virtual ~pipeline_stage_base() { }
+    virtual void start() = 0;
+    virtual void close() = 0;
+    virtual void wait() = 0;
+    virtual stage_stats stats() const = 0;
+};
+
+struct pipeline_end { };
+
+/**
+ * @brief 流水线的一个阶段。持有自己的输入通道和worker，输出写入下一阶段的输入通道。
+ * 最后一个退出的worker关闭下一阶段的输入，关闭由此沿流水线逐级传递。
+ */
+template <typename _In, typename _Out>
+struct pipeline_stage : pipeline_stage_base {
+
+    using batch_fn = func_v<std::vector<_In> &, std::vector<_Out> &>;
+
+    pipeline_stage(const std::string & name, const batch_fn & fn, const stage_options & opt) :
+        name(name), fn(fn), opt(opt), input(std::max(opt.capacity, (size_t) 1)), next(nullptr), workers(),
+        active(0), processed(0), emitted(0), busy_ns(0), finished(), done(finished.get_future()) {
+        this->opt.workers   = std::max(opt.workers, (size_t) 1);
+        this->opt.batch     = std::max(opt.batch, (size_t) 1);
+    }
+    ~pipeline_stage() { for (auto & w : this->workers) w->stop(); }
+
+    void start() override {
+        this->active = this->opt.workers;
+        for (size_t i = 0; i < this->opt.workers; i++) {
+            auto w = std::unique_ptr<queuer>(new queuer);
+            w->set_name("jar::pipeline " + this->name + " #" + std::to_string(i + 1));
+            w->start();
+            w->submit((func_vv) [this] { this->work(); });
+            this->workers.push_back(std::move(w));
+        }
+    }
+
+    void close() override { this->input.close(); }
+    void wait() override { this->done.wait(); }
+
+    stage_stats stats() const override {
+        return stage_stats {
+            this->name, this->opt.workers, this->input.capacity(), this->input.size(),
+            this->processed.load(), this->emitted.load(), this->busy_ns.load(),
+        };
+    }
+
+    void work() {
+        std::vector<_In>  in;
+        std::vector<_Out> out;
+        in.reserve(this->opt.batch);
+        while (this->input.recv_batch(std::back_inserter(in), this->opt.batch) > 0) {
+            auto beg = steady_now_ns();
+            this->fn(in, out);
+            this->busy_ns   += steady_now_ns() - beg;
+            this->processed += in.size();
+            this->emitted   += out.size();
+            // 下游满时在这里阻塞，形成反压
+            if (this->next) this->next->send_batch(out.begin(), out.end());
+            in.clear();
+            out.clear();
+        }
+        if (0 == --this->active) {
+            if (this->next) this->next->close();
+            this->finished.set_value();
+        }
+    }
+
+    std::string                                 name;
+    batch_fn                                    fn;
+    stage_options                               opt;
+    mpmc_channel<_In>                           input;
+    mpmc_channel<_Out>                        * next;
+    std::vector<std::unique_ptr<queuer>>        workers;
+    std::atomic<size_t>                         active;
+    std::atomic<uint64_t>                       processed;
+    std::atomic<uint64_t>                       emitted;
+    std::atomic<int64_t>                        busy_ns;
+    std::promise<void>                          finished;
+    std::shared_future<void>                    done;
+};
+
+} // namespace detail
+
+
+
+/**
+ * @brief 流水线的构建器，表示输出类型为_Tp的末端，通过then继续追加阶段，通过sink结束。
+ * 
+ * @tparam _Tp 
+ * 
+ * @author fomjar
+ * @date 2022/05/13
+ */
+template <typename _Tp>
+class pipeline_link {
+
+    using stages_t = std::vector<std::unique_ptr<detail::pipeline_stage_base>>;
+
+public:
+    pipeline_link(stages_t & stages, const func_v<mpmc_channel<_Tp> *> & connect) : stages(stages), connect(connect) { }
+
+    /**
+     * @brief 追加逐个处理的阶段，每个输入对应一个输出。
+     */
+    template <typename _Out>
+    pipeline_link<_Out> then(const std::string & name, const func<_Out(_Tp &)> & fn, const stage_options & opt = stage_options()) {
+        return this->then_batch<_Out>(name, [fn] (std::vector<_Tp> & in, std::vector<_Out> & out) {
+            for (auto & v : in) out.push_back(fn(v));
+        }, opt);
+    }
+
+    /**
+     * @brief 追加批量处理的阶段。处理函数每次拿到最多batch个输入，可以输出任意数量，适合过滤和聚合。
+     */
+    template <typename _Out>
+    pipeline_link<_Out> then_batch(const std::string & name, const func_v<std::vector<_Tp> &, std::vector<_Out> &> & fn,
+            const stage_options & opt = stage_options()) {
+        auto s = new detail::pipeline_stage<_Tp, _Out>(name, fn, opt);
+        this->stages.push_back(std::unique_ptr<detail::pipeline_stage_base>(s));
+        this->connect(&s->input);
+        return pipeline_link<_Out>(this->stages, [s] (mpmc_channel<_Out> * next) { s->next = next; });
+    }
+
+    /**
+     * @brief 追加最终消费的阶段。
+     */
+    void sink(const std::string & name, const func_v<_Tp &> & fn, const stage_options & opt = stage_options()) {
+        this->then_batch<detail::pipeline_end>(name, [fn] (std::vector<_Tp> & in, std::vector<detail::pipeline_end> &) {
+            for (auto & v : in) fn(v);
+        }, opt);
+    }
+
+private:
+    stages_t                    & stages;
+    func_v<mpmc_channel<_Tp> *>   connect;
+};
+
+
+
+/**
+ * @brief 分阶段的流水线。每个阶段有自己的有界输入队列和若干worker（每个worker是一个queuer），
+ * 阶段之间通过channel传递批量数据。任何一个阶段处理不过来时，它的输入队列被填满，上游的发送随之阻塞，
+ * 一直传递到push，内存占用不会无限增长。
+ * 
+ * close后已进入流水线的数据会被处理完，wait等待所有阶段退出。stats返回每个阶段的吞吐量、利用率和队列占用，
+ * 用于定位瓶颈。
+ * 
+ * jar::pipeline<std::string> p;
+ * p.then<record>("parse", parse, {1, 64, 4096})
+ *  .then<record>("enrich", enrich, {4, 16, 1024})
+ *  .sink("write", write, {1, 256, 4096});
+ * p.start();
+ * while (read(line)) p.push(line);
+ * p.close();
+ * p.wait();
+ * 
+ * @tparam _In 流水线的输入类型
+ * 
+ * @author fomjar
+ * @date 2022/05/13
+ */
+template <typename _In>
+class pipeline {
+
+public:
+    pipeline() : stages(), head(nullptr), started(false) { }
+    ~pipeline() {
+        if (!this->started) return;
+        this->close();
+        this->wait();
+    }
+    pipeline(const pipeline &) = delete;
+    pipeline & operator=(const pipeline &) = delete;
+
+    template <typename _Out>
+    pipeline_link<_Out> then(const std::string & name, const func<_Out(_In &)> & fn, const stage_options & opt = stage_options()) {
+        return this->link().template then<_Out>(name, fn, opt);
+    }
+
+    template <typename _Out>
+    pipeline_link<_Out> then_batch(const std::string & name, const func_v<std::vector<_In> &, std::vector<_Out> &> & fn,
+            const stage_options & opt = stage_options()) {
+        return this->link().template then_batch<_Out>(name, fn, opt);
+    }
+
+    void sink(const std::string & name, const func_v<_In &> & fn, const stage_options & opt = stage_options()) {
+        this->link().sink(name, fn, opt);
+    }
+
+    /**
+     * @brief 启动所有阶段。之后不能再追加阶段。
+     */
+    void start() {
+        if (this->started) return;
+        this->started = true;
+        for (auto & s : this->stages) s->start();
+    }
+
+    /**
+     * @brief 送入数据，第一个阶段的输入队列满时阻塞。
+     * 
+     * @return true 
+     * @return false 流水线为空或已关闭
+     */
+    template <typename _Up>
+    bool push(_Up && v) { return this->head && this->head->send(std::forward<_Up>(v)); }
+
+    /**
+     * @brief 尝试送入数据，不阻塞。
+     * 
+     * @return true 
+     * @return false 队列已满、流水线为空或已关闭
+     */
+    template <typename _Up>
+    bool try_push(_Up && v) { return this->head && this->head->try_send(std::forward<_Up>(v)); }
+
+    /**
+     * @brief 关闭输入。已送入的数据会沿流水线处理完。
+     */
+    void close() { if (this->head) this->head->close(); }
+
+    /**
+     * @brief 等待所有阶段处理完并退出，需要先close。
+     */
+    void wait() { for (auto & s : this->stages) s->wait(); }
+
+    std::vector<stage_stats> stats() const {
+        std::vector<stage_stats> r;
+        for (auto & s : this->stages) r.push_back(s->stats());
+        return r;
+    }
+
+private:
+    pipeline_link<_In> link() {
+        return pipeline_link<_In>(this->stages, [this] (mpmc_channel<_In> * c) { this->head = c; });
+    }
+
+    std::vector<std::unique_ptr<detail::pipeline_stage_base>>   stages;
+    mpmc_channel<_In>                                         * head;
+    bool                                                        started;
+};
+
+
+} // namespace jar
+
+
+#endif // _JAR_PIPELINE_H
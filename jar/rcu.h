@@ -0,0 +1,164 @@
+/**
+ * @file rcu.h
+ * @author fomjar (fomjar@gmail.com)
+ * @brief 
+ * @version 0.1
+ * @date 2022-05-03
+ * 
+ * @copyright Copyright (c) 2022
+ * 
+ */
+
+#ifndef _JAR_RCU_H
+#define _JAR_RCU_H
+
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+#include <utility>
+
+
+namespace jar {
+
+
+
+/**
+ * @brief 读多写少的不可变快照。读取无锁，写入时整体替换为新版本，旧版本在最后一个读者释放后回收。
+ * 
+ * 指针与外部引用计数打包在同一个64位字里：读者通过CAS增加外部计数获得快照，写者交换指针后把剩余的外部计数转移到旧版本的内部计数上。
+ * 写者之间不做互斥，读-改-写需要调用方自己加锁。
+ * 
+ * 指针占低48位，地址超出48位（如开启了5级页表的x86-64把堆放在高地址）时无法表示，分配时检查并终止程序。
+ * 外部计数占高16位，同一版本同时被持有的快照达到65535个时，新的读者让出CPU等待有快照归还，不会进位到指针上；
+ * 因此单个线程不能同时持有超过65535个同一版本的快照。
+ * 
+ * rcu<std::vector<int>> v;
+ * {
+ *     auto r = v.read();
+ *     for (auto i : *r) ...
+ * }
+ * v.store(std::vector<int>{1, 2, 3});
+ * 
+ * @tparam _Tp 
+ * 
+ * @author fomjar
+ * @date 2022/05/03
+ */
+template <typename _Tp>
+class rcu {
+
+    struct node {
+        template <typename ... _Ap>
+        node(_Ap && ... args) : value(std::forward<_Ap>(args)...), count(0) { }
+
+        const _Tp           value;
+        std::atomic<long>   count;  // 已脱离发布字的读者引用
+    };
+
+    static_assert(sizeof(void *) <= sizeof(uint64_t), "jar::rcu packs pointers into 64 bits");
+
+    static const int        COUNT_SHIFT = 48;
+    static const uint64_t   COUNT_ONE   = 1ULL << COUNT_SHIFT;
+    static const uint64_t   COUNT_MAX   = 0xffffULL;
+    static const uint64_t   PTR_MASK    = COUNT_ONE - 1;
+
+    static node * ptr(uint64_t w) { return (node *) (uintptr_t) (w & PTR_MASK); }
+
+    /**
+     * @brief 节点地址作为发布字。地址放不进48位时终止，继续运行会把计数和指针混在一起。
+     */
+    static uint64_t pack(node * n) {
+        auto w = (uint64_t) (uintptr_t) n;
+        if (w & ~PTR_MASK) {
+            fprintf(stderr, "jar::rcu: node address %p does not fit in 48 bits\n", (void *) n);
+            abort();
+        }
+        return w;
+    }
+
+public:
+    /**
+     * @brief 快照的读者。持有期间快照不会被回收。
+     */
+    class reader {
+
+    public:
+        reader(const rcu * owner, node * n) : owner(owner), n(n) { }
+        reader(reader && r) : owner(r.owner), n(r.n) { r.n = nullptr; }
+        reader(const reader &) = delete;
+        reader & operator=(const reader &) = delete;
+        ~reader() { if (this->n) this->owner->release(this->n); }
+
+        const _Tp & operator* () const { return  this->n->value; }
+        const _Tp * operator->() const { return &this->n->value; }
+
+    private:
+        const rcu   * owner;
+        node        * n;
+    };
+
+public:
+    rcu() : word(pack(new node())) { }
+    explicit rcu(const _Tp  & v) : word(pack(new node(v))) { }
+    explicit rcu(      _Tp && v) : word(pack(new node(std::move(v)))) { }
+    rcu(const rcu &) = delete;
+    rcu & operator=(const rcu &) = delete;
+    ~rcu() { this->retire(this->word.load()); }
+
+    /**
+     * @brief 获取当前快照。无锁。
+     */
+    reader read() const {
+        auto w = this->word.load();
+        while (true) {
+            // 外部计数已满，等其他读者归还
+            if ((w >> COUNT_SHIFT) == COUNT_MAX) {
+                std::this_thread::yield();
+                w = this->word.load();
+                continue;
+            }
+            if (this->word.compare_exchange_weak(w, w + COUNT_ONE)) break;
+        }
+        return reader(this, ptr(w));
+    }
+
+    /**
+     * @brief 发布新版本。
+     */
+    void store(const _Tp  & v) { this->publish(new node(v)); }
+    void store(      _Tp && v) { this->publish(new node(std::move(v))); }
+
+private:
+    void publish(node * n) {
+        this->retire(this->word.exchange(pack(n)));
+    }
+
+    void retire(uint64_t w) {
+        auto n = ptr(w);
+        long ext = (long) (w >> COUNT_SHIFT);
+        if (n->count.fetch_add(ext) + ext == 0)
+            delete n;
+    }
+
+    void release(node * n) const {
+        auto w = this->word.load();
+        while (ptr(w) == n) {
+            // 仍处于发布状态，直接归还外部计数
+            if (this->word.compare_exchange_weak(w, w - COUNT_ONE))
+                return;
+        }
+        if (n->count.fetch_sub(1) == 1)
+            delete n;
+    }
+
+    mutable std::atomic<uint64_t> word;
+};
+
+
+
+} // namespace jar
+
+
+#endif // _JAR_RCU_H
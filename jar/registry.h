@@ -0,0 +1,206 @@
+/**
+ * @file registry.h
+ * @author fomjar (fomjar@gmail.com)
+ * @brief 
+ * @version 0.1
+ * @date 2022-05-03
+ * 
+ * @copyright Copyright (c) 2022
+ * 
+ */
+
+#ifndef _JAR_REGISTRY_H
+#define _JAR_REGISTRY_H
+
+#include <algorithm>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <vector>
+
+
+namespace jar {
+
+
+
+/**
+ * @brief 不可变的开放寻址哈希表。修改操作返回新表，原表不变，适合作为rcu快照发布。
+ * 
+ * 表被分成固定数量的分片，分片之间共享：修改只复制分片指针数组和被修改的那个分片，订阅量大时写入代价也不会随总量线性增长。
+ * 分片内线性探测，容量为2的幂，负载不超过1/2。
+ * 
+ * registry<int, std::string> r0;
+ * auto r1 = r0.with(1, "one");
+ * r1.find(1); // "one"
+ * r0.find(1); // nullptr
+ * 
+ * @tparam _Kp 
+ * @tparam _Vp 
+ * @tparam _Hp 
+ * 
+ * @author fomjar
+ * @date 2022/05/03
+ */
+template <typename _Kp, typename _Vp, typename _Hp = std::hash<_Kp>>
+class registry {
+
+    static const size_t SHARD_BITS  = 6;
+    static const size_t SHARDS      = 1 << SHARD_BITS;
+
+    struct slot {
+        slot() : used(false), hash(0), key(), value() { }
+
+        bool        used;
+        uint64_t    hash;
+        _Kp         key;
+        _Vp         value;
+    };
+
+    struct shard {
+        shard() : slots(), count(0) { }
+
+        const slot * find(uint64_t h, const _Kp & key) const {
+            if (this->slots.empty()) return nullptr;
+
+            auto mask = this->slots.size() - 1;
+            for (auto i = h & mask; ; i = (i + 1) & mask) {
+                const auto & s = this->slots[i];
+                if (!s.used) return nullptr;
+                if (s.hash == h && s.key == key) return &s;
+            }
+        }
+
+        void put(uint64_t h, const _Kp & key, const _Vp & value) {
+            if ((this->count + 1) * 2 > this->slots.size()) {
+                std::vector<slot> old(std::max<size_t>(this->slots.size() * 2, 4));
+                old.swap(this->slots);
+                this->count = 0;
+                for (const auto & s : old) {
+                    if (s.used) this->put(s.hash, s.key, s.value);
+                }
+            }
+
+            auto mask = this->slots.size() - 1;
+            for (auto i = h & mask; ; i = (i + 1) & mask) {
+                auto & s = this->slots[i];
+                if (!s.used) {
+                    s.used  = true;
+                    s.hash  = h;
+                    s.key   = key;
+                    s.value = value;
+                    this->count++;
+                    return;
+                }
+                if (s.hash == h && s.key == key) {
+                    s.value = value;
+                    return;
+                }
+            }
+        }
+
+        std::vector<slot>   slots;
+        size_t              count;
+    };
+
+    /**
+     * @brief 对std::hash的结果再做一次混合。std::hash对整数是恒等映射，直接用于线性探测会形成长簇。
+     */
+    static uint64_t mix(uint64_t h) {
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccdULL;
+        h ^= h >> 33;
+        h *= 0xc4ceb9fe1a85ec53ULL;
+        h ^= h >> 33;
+        return h;
+    }
+
+    static size_t shard_of(uint64_t h) { return (size_t) (h >> (64 - SHARD_BITS)); }
+
+public:
+    registry() : shards(), count(0) { }
+
+    size_t size()  const { return this->count; }
+    bool   empty() const { return 0 == this->count; }
+
+    /**
+     * @brief 查找。
+     * 
+     * @param key 
+     * @return const _Vp* 不存在时为nullptr
+     */
+    const _Vp * find(const _Kp & key) const {
+        if (this->shards.empty()) return nullptr;
+
+        auto h = mix(_Hp()(key));
+        const auto & p = this->shards[shard_of(h)];
+        if (!p) return nullptr;
+
+        auto s = p->find(h, key);
+        return s ? &s->value : nullptr;
+    }
+
+    /**
+     * @brief 返回设置了给定键值的新表。
+     */
+    registry with(const _Kp & key, const _Vp & value) const {
+        auto h = mix(_Hp()(key));
+        auto i = shard_of(h);
+
+        registry r(*this);
+        if (r.shards.empty()) r.shards.resize(SHARDS);
+
+        auto p = r.shards[i] ? std::make_shared<shard>(*r.shards[i]) : std::make_shared<shard>();
+        auto before = p->count;
+        p->put(h, key, value);
+        r.count += p->count - before;
+        r.shards[i] = p;
+        return r;
+    }
+
+    /**
+     * @brief 返回删除了给定键的新表。
+     */
+    registry without(const _Kp & key) const {
+        registry r(*this);
+        if (!this->find(key)) return r;
+
+        auto h = mix(_Hp()(key));
+        auto i = shard_of(h);
+
+        auto p = std::make_shared<shard>();
+        for (const auto & s : this->shards[i]->slots) {
+            if (s.used && !(s.key == key))
+                p->put(s.hash, s.key, s.value);
+        }
+        r.shards[i] = p->count ? p : nullptr;
+        r.count--;
+        return r;
+    }
+
+    /**
+     * @brief 遍历所有键值。
+     * 
+     * @tparam _Fp void(const _Kp &, const _Vp &)
+     * @param f 
+     */
+    template <typename _Fp>
+    void each(_Fp f) const {
+        for (const auto & p : this->shards) {
+            if (!p) continue;
+            for (const auto & s : p->slots) {
+                if (s.used) f(s.key, s.value);
+            }
+        }
+    }
+
+private:
+    std::vector<std::shared_ptr<const shard>>   shards;
+    size_t                                      count;
+};
+
+
+
+} // namespace jar
+
+
+#endif // _JAR_REGISTRY_H
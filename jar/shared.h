@@ -0,0 +1,76 @@
+/**
+ * @file shared.h
+ * @author fomjar (fomjar@gmail.com)
+ * @brief 
+ * @version 0.1
+ * @date 2022-05-08
+ * 
+ * @copyright Copyright (c) 2022
+ * 
+ */
+
+#ifndef _JAR_SHARED_H
+#define _JAR_SHARED_H
+
+#include <memory>
+#include <type_traits>
+#include <utility>
+
+
+namespace jar {
+
+
+
+/**
+ * @brief 不可变的引用计数载荷。载荷只在构造时创建一次，之后的复制只增加引用计数，可以跨线程传递和持有。
+ * 
+ * 发布到事件队列时，订阅者以const shared<_Tp> &接收，无论多少订阅者载荷都不会被复制：
+ * 
+ * queue.sub(e, (jar::func_v<const jar::shared<frame> &>) [] (const jar::shared<frame> & f) { ... });
+ * queue.pub(e, jar::share(std::move(big_frame)));
+ * 
+ * @tparam _Tp 
+ * 
+ * @author fomjar
+ * @date 2022/05/08
+ */
+template <typename _Tp>
+class shared {
+
+public:
+    shared() : p() { }
+    explicit shared(const _Tp  & v) : p(std::make_shared<const _Tp>(v)) { }
+    explicit shared(      _Tp && v) : p(std::make_shared<const _Tp>(std::move(v))) { }
+
+    const _Tp & operator* () const { return *this->p; }
+    const _Tp * operator->() const { return  this->p.get(); }
+    const _Tp * get()        const { return  this->p.get(); }
+
+    explicit operator bool() const { return (bool) this->p; }
+    long use_count()         const { return this->p.use_count(); }
+
+private:
+    std::shared_ptr<const _Tp> p;
+};
+
+
+/**
+ * @brief 把值包装成不可变的共享载荷。右值会被移动而不是复制。
+ * 
+ * @tparam _Tp 
+ * @param v 
+ * @return shared<typename std::decay<_Tp>::type> 
+ * 
+ * @author fomjar
+ * @date 2022/05/08
+ */
+template <typename _Tp>
+inline shared<typename std::decay<_Tp>::type> share(_Tp && v) {
+    return shared<typename std::decay<_Tp>::type>(std::forward<_Tp>(v));
+}
+
+
+} // namespace jar
+
+
+#endif // _JAR_SHARED_H
@@ -0,0 +1,449 @@
+/**
+ * @file shm.h
+ * @author fomjar (fomjar@gmail.com)
+ * @brief 
+ * @version 0.1
+ * @date 2022-05-10
+ * 
+ * @copyright Copyright (c) 2022
+ * 
+ */
+
+#ifndef _JAR_SHM_H
+#define _JAR_SHM_H
+
+#include "clock.h"
+#include "event.h"
+#include "journal.h"
+#include "rcu.h"
+#include "registry.h"
+
+#include <atomic>
+#include <climits>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <tuple>
+#include <type_traits>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#if defined(__linux__)
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
+
+namespace jar {
+
+
+
+namespace detail {
+
+template <typename ... _Ap>
+struct all_trivial;
+
+template <>
+struct all_trivial<> : std::true_type { };
+
+template <typename _A0, typename ... _Ap>
+struct all_trivial<_A0, _Ap...> : std::integral_constant<bool,
+        std::is_trivially_copyable<_A0>::value && all_trivial<_Ap...>::value> { };
+
+template <typename ... _Ap>
+struct all_tagged;
+
+template <>
+struct all_tagged<> : std::true_type { };
+
+template <typename _A0, typename ... _Ap>
+struct all_tagged<_A0, _Ap...> : std::integral_constant<bool,
+        is_tagged<_A0>::value && all_tagged<_Ap...>::value> { };
+
+inline size_t pack_size() { return 0; }
+
+template <typename _A0, typename ... _Ap>
+inline size_t pack_size(const _A0 &, const _Ap & ... args) { return sizeof(_A0) + pack_size(args...); }
+
+inline void pack(char *) { }
+
+template <typename _A0, typename ... _Ap>
+inline void pack(char * p, const _A0 & a0, const _Ap & ... args) {
+    memcpy(p, &a0, sizeof(_A0));
+    pack(p + sizeof(_A0), args...);
+}
+
+template <typename _Tuple, size_t _I = 0>
+inline typename std::enable_if<_I == std::tuple_size<_Tuple>::value>::type
+unpack(const char *, _Tuple &) { }
+
+template <typename _Tuple, size_t _I = 0>
+inline typename std::enable_if<_I < std::tuple_size<_Tuple>::value>::type
+unpack(const char * p, _Tuple & t) {
+    memcpy(&std::get<_I>(t), p, sizeof(typename std::tuple_element<_I, _Tuple>::type));
+    unpack<_Tuple, _I + 1>(p + sizeof(typename std::tuple_element<_I, _Tuple>::type), t);
+}
+
+} // namespace detail
+
+
+
+/**
+ * @brief 跨进程的共享内存事件总线。同一主机上的进程打开同名总线后，可以互相发布和订阅可平凡复制的事件参数。
+ * 
+ * 总线是shm_open/mmap映射的一段环形缓冲，多个发布者通过原子递增的序号各自占用槽位，参数直接写入共享内存，不经过socket也不做序列化。
+ * 每个槽位带有序列号（奇数为写入中，偶数为已发布），接收线程按序号读取，读取后再次校验序列号，被覆盖的槽位会被丢弃并计入lost。
+ * 发布者用CAS认领槽位：槽位已被更新的序号认领时放弃写入，被更早的序号占用时等它写完，两个发布者不会同时写一个槽位。
+ * 占用槽位超过1秒仍未写完的发布者被当作已退出，它的槽位和序号会被跳过。
+ * 没有新事件时接收线程在共享内存中的futex上等待，发布者只在有等待者时唤醒。
+ * 
+ * 接收到的事件被转发给进程内的event_queue，订阅者的执行方式与event_queue相同。参数类型通过type_tag的名称和版本区分，
+ * 不同构建的进程之间也能对上，发布和订阅的参数类型需要一致；算术类型之外的参数需要特化type_tag。
+ * 共享内存头部记录布局版本，与本进程的布局版本不一致时打开失败，不会按错误的布局读写。
+ * 
+ * 环形缓冲是广播语义：发布者不等待慢的接收者，接收者落后超过容量时丢弃最早的事件。
+ * 
+ * jar::shm_bus bus("/market");
+ * bus.sub(0x01, (jar::func_v<int, double>) [] (int id, double px) { ... });
+ * bus.pub(0x01, 7, 101.5); // 所有打开"/market"的进程都会收到
+ * 
+ * @author fomjar
+ * @date 2022/05/10
+ */
+class shm_bus {
+
+    struct header {
+        std::atomic<uint64_t>   magic;
+        uint32_t                version;    // 布局版本
+        uint32_t                capacity;   // 槽位数，2的幂
+        uint32_t                slot_size;  // 每个槽位的字节数，包括槽位头
+        std::atomic<uint64_t>   head;       // 下一个发布序号
+        std::atomic<uint32_t>   signal;     // futex字，每次发布加一
+        std::atomic<uint32_t>   waiters;
+    };
+
+    struct slot {
+        std::atomic<uint64_t>   seq;
+        uint64_t                event;
+        uint64_t                sig;
+        uint32_t                size;
+        uint32_t                reserved;
+    };
+
+    static_assert(ATOMIC_LLONG_LOCK_FREE == 2 && ATOMIC_INT_LOCK_FREE == 2, "shm_bus needs lock-free atomics");
+
+    static const uint64_t MAGIC = 0x4a41522d53484d31ULL; // "JAR-SHM1"
+    static const uint32_t LAYOUT = 2;                    // 头部、槽位或参数签名的格式改变时增加
+    static const int64_t  STALL_NS = 1000000000LL;      // 发布者占用序号后超过该时长仍未发布，视为已退出
+
+    using decoder = func<void(uint64_t, const char *)>;
+
+public:
+    /**
+     * @brief 打开或创建共享内存总线，并启动接收线程。已存在时使用已有的容量和槽位大小，布局版本不一致时打开失败。
+     * 
+     * @param name shm_open的名字，以'/'开头
+     * @param capacity 槽位数，向上取整为2的幂
+     * @param slot_size 每个事件参数的最大字节数
+     */
+    shm_bus(const std::string & name, uint32_t capacity = 4096, uint32_t slot_size = 256) :
+        name(name),
+        base(nullptr),
+        length(0),
+        decoders(),
+        mutex(),
+        local(),
+        cursor(0),
+        _lost(0),
+        running(false),
+        receiver() {
+        if (!this->open(capacity, slot_size)) return;
+
+        this->cursor = this->hdr()->head.load();
+        this->running = true;
+        this->receiver = std::thread([this] { this->receive(); });
+    }
+    shm_bus(const shm_bus &) = delete;
+    shm_bus & operator=(const shm_bus &) = delete;
+    ~shm_bus() {
+        if (this->running) {
+            this->running = false;
+            this->wake();
+            this->receiver.join();
+        }
+        if (this->base) munmap(this->base, this->length);
+    }
+
+    bool is_open() const { return nullptr != this->base; }
+
+    /**
+     * @brief 被覆盖而没有收到的事件数。
+     */
+    uint64_t lost() const { return this->_lost; }
+
+    /**
+     * @brief 删除共享内存段。已打开的总线不受影响，之后打开同名总线会重新创建。
+     */
+    static bool unlink(const std::string & name) { return 0 == shm_unlink(name.c_str()); }
+
+public:
+    /**
+     * @brief 订阅事件。只会收到订阅之后发布的、参数类型相同的事件。
+     * 
+     * @tparam _Ap 必须可平凡复制
+     * @param event 
+     * @param callback 
+     * @return uint64_t 订阅id，用于退订
+     */
+    template <typename ... _Ap>
+    uint64_t sub(uint64_t event, const func_v<_Ap...> & callback) {
+        static_assert(detail::all_trivial<_Ap...>::value, "shm_bus arguments must be trivially copyable");
+        static_assert(detail::all_tagged<_Ap...>::value, "shm_bus arguments need a jar::type_tag specialization");
+
+        {
+            JAR_EXEC_LOCK_GUARD
+
+            auto sig = detail::signature<_Ap...>();
+            auto d = this->decoders.read();
+            if (!d->find(sig)) {
+                this->decoders.store(d->with(sig, (decoder) [this] (uint64_t event, const char * data) {
+                    std::tuple<_Ap...> a;
+                    detail::unpack(data, a);
+                    this->forward(event, a, typename detail::make_index_seq<sizeof...(_Ap)>::type());
+                }));
+            }
+        }
+        return this->local.sub(event, callback);
+    }
+
+    /**
+     * @brief 退订事件。
+     * 
+     * @param event 
+     * @param id sub返回的订阅id
+     * @return true 退订成功
+     * @return false 没有找到订阅
+     */
+    bool unsub(uint64_t event, uint64_t id) { return this->local.unsub(event, id); }
+
+    /**
+     * @brief 发布事件到总线。无锁，不等待接收者。
+     * 
+     * @tparam _Ap 必须可平凡复制
+     * @param event 
+     * @param args 
+     * @return true 
+     * @return false 总线未打开、参数超过槽位大小，或发布太慢、槽位已被后来的发布者覆盖
+     */
+    template <typename ... _Ap>
+    bool pub(uint64_t event, const _Ap & ... args) {
+        static_assert(detail::all_trivial<_Ap...>::value, "shm_bus arguments must be trivially copyable");
+        static_assert(detail::all_tagged<_Ap...>::value, "shm_bus arguments need a jar::type_tag specialization");
+
+        if (!this->base) return false;
+        auto h = this->hdr();
+        auto size = detail::pack_size(args...);
+        if (sizeof(slot) + size > h->slot_size) return false;
+
+        auto t = h->head.fetch_add(1);
+        auto s = this->at(t);
+        if (!this->claim(s, t)) return false;
+        std::atomic_thread_fence(std::memory_order_release);
+        s->event    = event;
+        s->sig      = detail::signature<_Ap...>();
+        s->size     = (uint32_t) size;
+        detail::pack((char *) (s + 1), args...);
+        // 写入期间被判定为已退出、槽位被接管时，发布失败
+        auto mine = 2 * t + 1;
+        if (!s->seq.compare_exchange_strong(mine, 2 * t + 2, std::memory_order_release)) return false;
+
+        h->signal.fetch_add(1, std::memory_order_release);
+        if (h->waiters.load() > 0) this->wake();
+        return true;
+    }
+
+private:
+    header * hdr() const { return (header *) this->base; }
+
+    /**
+     * @brief 认领序号t的槽位，把序列号改为2t+1。槽位被更早的序号占用时等待它写完，超过STALL_NS后接管；
+     * 已被更新的序号认领时说明本发布者被套圈，放弃写入。
+     */
+    bool claim(slot * s, uint64_t t) {
+        int64_t since = 0;
+        auto cur = s->seq.load(std::memory_order_acquire);
+        while (true) {
+            if (cur >= 2 * t + 1) return false;
+            if (0 == cur % 2 || (since && steady_now_ns() - since > STALL_NS)) {
+                if (s->seq.compare_exchange_weak(cur, 2 * t + 1, std::memory_order_acquire)) return true;
+                continue;
+            }
+            if (!since) since = steady_now_ns();
+            std::this_thread::yield();
+            cur = s->seq.load(std::memory_order_acquire);
+        }
+    }
+
+    slot * at(uint64_t t) const {
+        auto h = this->hdr();
+        return (slot *) (this->base + sizeof(header) + (t & (h->capacity - 1)) * h->slot_size);
+    }
+
+    bool open(uint32_t capacity, uint32_t slot_size) {
+        uint32_t cap = 1;
+        while (cap < capacity) cap <<= 1;
+        slot_size = (uint32_t) ((sizeof(slot) + slot_size + 7) & ~(size_t) 7);
+
+        bool created = true;
+        auto fd = shm_open(this->name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0644);
+        if (fd < 0) {
+            created = false;
+            fd = shm_open(this->name.c_str(), O_RDWR, 0644);
+        }
+        if (fd < 0) return false;
+
+        struct stat st;
+        if (created) {
+            this->length = sizeof(header) + (size_t) cap * slot_size;
+            if (0 != ftruncate(fd, this->length)) {
+                ::close(fd);
+                shm_unlink(this->name.c_str());
+                return false;
+            }
+        } else {
+            // 创建者可能还没有设置大小
+            for (int i = 0; i < 1000 && 0 == fstat(fd, &st) && 0 == st.st_size; i++)
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            if (0 != fstat(fd, &st) || (size_t) st.st_size < sizeof(header)) {
+                ::close(fd);
+                return false;
+            }
+            this->length = st.st_size;
+        }
+
+        auto p = mmap(nullptr, this->length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (MAP_FAILED == p) return false;
+        this->base = (char *) p;
+
+        auto h = this->hdr();
+        if (created) {
+            h->version      = LAYOUT;
+            h->capacity     = cap;
+            h->slot_size    = slot_size;
+            h->head.store(0);
+            h->signal.store(0);
+            h->waiters.store(0);
+            h->magic.store(MAGIC, std::memory_order_release);
+        } else {
+            for (int i = 0; i < 1000 && MAGIC != h->magic.load(std::memory_order_acquire); i++)
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            if (MAGIC != h->magic.load(std::memory_order_acquire)
+             || LAYOUT != h->version
+             || this->length < sizeof(header) + (size_t) h->capacity * h->slot_size) {
+                munmap(this->base, this->length);
+                this->base = nullptr;
+                return false;
+            }
+        }
+        return true;
+    }
+
+    void receive() {
+        auto h = this->hdr();
+        std::vector<char> buf(h->slot_size);
+        int64_t stalled = 0; // 当前序号开始等待发布的时间
+
+        while (this->running) {
+            auto next = this->cursor;
+            auto s = this->at(next);
+            auto seq = s->seq.load(std::memory_order_acquire);
+
+            if (seq == 2 * next + 2) {
+                auto event  = s->event;
+                auto sig    = s->sig;
+                auto size   = std::min<size_t>(s->size, h->slot_size - sizeof(slot));
+                memcpy(buf.data(), (const char *) (s + 1), size);
+                std::atomic_thread_fence(std::memory_order_acquire);
+                if (s->seq.load(std::memory_order_relaxed) == seq) {
+                    auto d = this->decoders.read();
+                    auto f = d->find(sig);
+                    if (f) (*f)(event, buf.data());
+                } else {
+                    this->_lost++;
+                }
+                this->cursor = next + 1;
+                stalled = 0;
+                continue;
+            }
+            if (seq > 2 * next + 2) {
+                // 被覆盖，跳到仍在缓冲内的最早位置
+                auto head = h->head.load();
+                auto skip = head > h->capacity ? head - h->capacity : 0;
+                if (skip <= next) skip = next + 1;
+                this->_lost += skip - next;
+                this->cursor = skip;
+                stalled = 0;
+                continue;
+            }
+
+            // 尚未发布。发布者占用序号后退出会留下空洞，按时间而不是唤醒次数判断，其他发布者的唤醒不会让它提前被跳过
+            auto signal = h->signal.load(std::memory_order_acquire);
+            if (s->seq.load(std::memory_order_acquire) != seq) continue;
+            if (h->head.load() > next) {
+                auto now = steady_now_ns();
+                if (!stalled) stalled = now;
+                if (now - stalled > STALL_NS) {
+                    this->_lost++;
+                    this->cursor = next + 1;
+                    stalled = 0;
+                    continue;
+                }
+            }
+            h->waiters.fetch_add(1);
+            this->wait(signal);
+            h->waiters.fetch_sub(1);
+        }
+    }
+
+    template <typename ... _Ap, size_t ... _Is>
+    void forward(uint64_t event, const std::tuple<_Ap...> & a, detail::index_seq<_Is...>) {
+        this->local.pub(event, std::get<_Is>(a)...);
+    }
+
+    void wait(uint32_t signal) {
+#if defined(__linux__)
+        struct timespec ts = { 0, 10 * 1000 * 1000 };
+        syscall(SYS_futex, &this->hdr()->signal, FUTEX_WAIT, signal, &ts, nullptr, 0);
+#else
+        (void) signal;
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+#endif
+    }
+
+    void wake() {
+#if defined(__linux__)
+        syscall(SYS_futex, &this->hdr()->signal, FUTEX_WAKE, INT_MAX, nullptr, nullptr, 0);
+#endif
+    }
+
+    std::string                         name;
+    char                              * base;
+    size_t                              length;
+    rcu<registry<uint64_t, decoder>>    decoders;   // 按参数的type_tag签名
+    std::mutex                          mutex;      // 写锁
+    event_queue<uint64_t>               local;
+    uint64_t                            cursor;     // 仅接收线程访问
+    std::atomic<uint64_t>               _lost;
+    std::atomic<bool>                   running;
+    std::thread                         receiver;
+
+};
+
+
+} // namespace jar
+
+
+#endif // _JAR_SHM_H
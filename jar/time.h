@@ -12,8 +12,15 @@
 #ifndef _JAR_TIME_H
 #define _JAR_TIME_H
 
+#include <algorithm>
+#include <atomic>
 #include <chrono>
+#include <cstdint>
+#include <cstring>
 #include <string>
+#include <vector>
+
+#include <time.h>
 
 namespace jar {
 
@@ -26,42 +33,225 @@ namespace jar {
  * @date 2022/04/30
  */
 inline long long now() {
-    return std::chrono::system_clock::now().time_since_epoch().count();
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
 }
 
 /**
- * @brief 格式化当前时间。
+ * @brief 预编译的时间格式。格式串只在构造时解析一次，得到定长字段的列表；格式化时写入调用方提供的缓冲，不分配内存，可以多线程共用。
  * 
- * @param format YYYY: 年, MM: 月, DD: 日, hh: 时, mm: 分, ss: 秒, SSS: 毫秒, SSSSSS: 微秒
- * @return std::string 
+ * 每个线程缓存最近一秒渲染好的结果，同一秒内的格式化只复制缓存并改写毫秒、微秒字段；跨秒时用localtime_r重新渲染。
+ * 
+ * jar::time_format f("YYYY-MM-DD hh:mm:ss.SSS");
+ * char buf[64];
+ * f.format(buf, sizeof(buf)); // "2022-05-11 10:00:00.123"
  * 
  * @author fomjar
- * @date 2022/04/30
+ * @date 2022/05/11
  */
-inline std::string now2str(const std::string & format = "YYYY/MM/DD hh:mm:ss.SSSSSS") {
-    auto tp = std::chrono::system_clock::now();
-    auto tt = std::chrono::system_clock::to_time_t(tp);
-    auto tm = localtime(&tt);
+class time_format {
+
+    enum kind { literal, year, month, day, hour, minute, second, milli, micro };
 
-    std::string str = format;
+    struct token {
+        kind        k;
+        size_t      offset;     // 在结果中的位置
+        size_t      width;
+        size_t      text;       // literal在pattern中的位置
+    };
 
-    auto fmt = [] (long long n, size_t size) -> std::string {
-        std::string s = std::to_string(n);
-        while (s.length() < size) s.insert(0, "0");
-        return s;
+    struct cache {
+        uint64_t    id;
+        time_t      sec;
+        char        buf[256];
     };
 
-    while (std::string::npos != str.find("YYYY"))   str.replace(str.find("YYYY"),   4, fmt(tm->tm_year + 1900,  4));
-    while (std::string::npos != str.find("MM"))     str.replace(str.find("MM"),     2, fmt(tm->tm_mon + 1,      2));
-    while (std::string::npos != str.find("DD"))     str.replace(str.find("DD"),     2, fmt(tm->tm_mday,         2));
-    while (std::string::npos != str.find("hh"))     str.replace(str.find("hh"),     2, fmt(tm->tm_hour,         2));
-    while (std::string::npos != str.find("mm"))     str.replace(str.find("mm"),     2, fmt(tm->tm_min,          2));
-    while (std::string::npos != str.find("ss"))     str.replace(str.find("ss"),     2, fmt(tm->tm_sec,          2));
+    static const size_t CACHE_SIZE = sizeof(((cache *) nullptr)->buf);
+
+public:
+    /**
+     * @brief 
+     * 
+     * @param pattern YYYY: 年, MM: 月, DD: 日, hh: 时, mm: 分, ss: 秒, SSS: 毫秒, SSSSSS: 微秒
+     */
+    explicit time_format(const std::string & pattern = "YYYY/MM/DD hh:mm:ss.SSSSSS") :
+        pattern(pattern),
+        tokens(),
+        length(0),
+        id(next_id()) {
+        static const struct { const char * text; kind k; } FIELDS[] = {
+            { "YYYY", year }, { "SSSSSS", micro }, { "SSS", milli },
+            { "MM", month }, { "DD", day }, { "hh", hour }, { "mm", minute }, { "ss", second },
+        };
+
+        size_t i = 0;
+        while (i < pattern.size()) {
+            bool matched = false;
+            for (const auto & f : FIELDS) {
+                auto n = strlen(f.text);
+                if (0 == pattern.compare(i, n, f.text)) {
+                    this->tokens.push_back(token { f.k, this->length, n, 0 });
+                    this->length += n;
+                    i += n;
+                    matched = true;
+                    break;
+                }
+            }
+            if (matched) continue;
+
+            if (this->tokens.empty() || literal != this->tokens.back().k)
+                this->tokens.push_back(token { literal, this->length, 0, i });
+            this->tokens.back().width++;
+            this->length++;
+            i++;
+        }
+    }
+
+    /**
+     * @brief 格式化后的长度，不包括结尾的'\0'。
+     */
+    size_t size() const { return this->length; }
+
+    /**
+     * @brief 格式化给定时间。
+     * 
+     * @param buf 
+     * @param size 缓冲大小，结果超长时被截断，总以'\0'结尾
+     * @param us 从1970/01/01 00:00:00开始的微秒数
+     * @return size_t 写入的字符数，不包括'\0'
+     */
+    size_t format(char * buf, size_t size, long long us) const {
+        if (0 == size) return 0;
+
+        auto sec = (time_t) (us / 1000000);
+        auto sub = us % 1000000;
+        if (sub < 0) {
+            sub += 1000000;
+            sec--;
+        }
+
+        auto n = std::min(this->length, size - 1);
+        if (this->length <= CACHE_SIZE) {
+            auto & c = local();
+            if (c.id != this->id || c.sec != sec) {
+                this->render(c.buf, sec);
+                c.id  = this->id;
+                c.sec = sec;
+            }
+            memcpy(buf, c.buf, n);
+            this->render_sub(buf, n, sub);
+        } else {
+            // 超长的格式不走缓存，直接按字段渲染
+            struct tm tm;
+            localtime_r(&sec, &tm);
+            for (const auto & t : this->tokens) {
+                for (size_t j = 0; j < t.width && t.offset + j < n; j++)
+                    buf[t.offset + j] = this->field(t, tm, sub, j);
+            }
+        }
+        buf[n] = '\0';
+        return n;
+    }
+
+    /**
+     * @brief 格式化当前时间。
+     */
+    size_t format(char * buf, size_t size) const {
+        return this->format(buf, size, now());
+    }
 
-    while (std::string::npos != str.find("SSSSSS"))     str.replace(str.find("SSSSSS"),     6, fmt(tp.time_since_epoch().count()        % 1000000,      6));
-    while (std::string::npos != str.find("SSS"))        str.replace(str.find("SSS"),        3, fmt(tp.time_since_epoch().count() / 1000 % 1000,         3));
+    /**
+     * @brief 格式化当前时间。
+     */
+    std::string format() const {
+        std::string str(this->length, '\0');
+        this->format(&str[0], this->length + 1);
+        return str;
+    }
 
-    return str;
+private:
+    static uint64_t next_id() {
+        static std::atomic<uint64_t> id(0);
+        return ++id;
+    }
+
+    static cache & local() {
+        static thread_local cache c = { 0, 0, { 0 } };
+        return c;
+    }
+
+    static void digits(char * p, size_t width, long long v) {
+        for (size_t i = width; i > 0; i--) {
+            p[i - 1] = (char) ('0' + v % 10);
+            v /= 10;
+        }
+    }
+
+    char field(const token & t, const struct tm & tm, long long sub, size_t j) const {
+        char d[8];
+        switch (t.k) {
+        case literal:   return this->pattern[t.text + j];
+        case year:      digits(d, 4, tm.tm_year + 1900);    break;
+        case month:     digits(d, 2, tm.tm_mon + 1);        break;
+        case day:       digits(d, 2, tm.tm_mday);           break;
+        case hour:      digits(d, 2, tm.tm_hour);           break;
+        case minute:    digits(d, 2, tm.tm_min);            break;
+        case second:    digits(d, 2, tm.tm_sec);            break;
+        case milli:     digits(d, 3, sub / 1000);           break;
+        case micro:     digits(d, 6, sub);                  break;
+        }
+        return d[j];
+    }
+
+    void render(char * buf, time_t sec) const {
+        struct tm tm;
+        localtime_r(&sec, &tm);
+        for (const auto & t : this->tokens) {
+            switch (t.k) {
+            case literal:   memcpy(buf + t.offset, this->pattern.data() + t.text, t.width); break;
+            case year:      digits(buf + t.offset, 4, tm.tm_year + 1900);   break;
+            case month:     digits(buf + t.offset, 2, tm.tm_mon + 1);       break;
+            case day:       digits(buf + t.offset, 2, tm.tm_mday);          break;
+            case hour:      digits(buf + t.offset, 2, tm.tm_hour);          break;
+            case minute:    digits(buf + t.offset, 2, tm.tm_min);           break;
+            case second:    digits(buf + t.offset, 2, tm.tm_sec);           break;
+            case milli:
+            case micro:     break;
+            }
+        }
+    }
+
+    void render_sub(char * buf, size_t n, long long sub) const {
+        for (const auto & t : this->tokens) {
+            if (milli != t.k && micro != t.k) continue;
+            if (t.offset + t.width <= n) {
+                digits(buf + t.offset, t.width, milli == t.k ? sub / 1000 : sub);
+            } else if (t.offset < n) {
+                char d[8];
+                digits(d, t.width, milli == t.k ? sub / 1000 : sub);
+                memcpy(buf + t.offset, d, n - t.offset);
+            }
+        }
+    }
+
+    std::string         pattern;
+    std::vector<token>  tokens;
+    size_t              length;
+    uint64_t            id;     // 区分线程缓存属于哪个格式
+};
+
+/**
+ * @brief 格式化当前时间。默认格式使用预编译的time_format，其他格式每次调用都会重新解析，频繁调用时应直接使用time_format。
+ * 
+ * @param format YYYY: 年, MM: 月, DD: 日, hh: 时, mm: 分, ss: 秒, SSS: 毫秒, SSSSSS: 微秒
+ * @return std::string  
+ * 
+ * @author fomjar
+ * @date 2022/04/30
+ */
+inline std::string now2str(const std::string & format = "YYYY/MM/DD hh:mm:ss.SSSSSS") {
+    static const time_format def;
+    if (format == "YYYY/MM/DD hh:mm:ss.SSSSSS") return def.format();
+    return time_format(format).format();
 }
 
 } // namespace jar
@@ -0,0 +1,226 @@
+/**
+ * @file topic.h
+ * @author fomjar (fomjar@gmail.com)
+ * @brief 
+ * @version 0.1
+ * @date 2022-05-06
+ * 
+ * @copyright Copyright (c) 2022
+ * 
+ */
+
+#ifndef _JAR_TOPIC_H
+#define _JAR_TOPIC_H
+
+#include "any.h"
+#include "exec.h"
+#include "rcu.h"
+#include "registry.h"
+
+#include <algorithm>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace jar {
+
+
+
+/**
+ * @brief 层级主题的事件队列。主题以'.'分隔成段，订阅时可以使用通配符：'*'匹配一段，'#'匹配零或多段。
+ * 
+ * 订阅保存在按段组织的前缀树上，子节点索引为registry，前缀树以写时复制的方式发布在rcu上，修改只复制路径上的节点。发布时在分发线程上按主题查匹配缓存，
+ * 未命中时遍历前缀树，代价只与主题深度有关，与订阅数量无关；订阅变化后缓存整体失效。
+ * 事件的分发执行委托给了内部的异步队列。
+ * 
+ * jar::topic_queue queue;
+ * queue.sub("orders.us.*", (jar::func_v<int>) [] (int qty) { ... });
+ * queue.sub("orders.#",    (jar::func_v<int>) [] (int qty) { ... });
+ * queue.pub("orders.us.nyse", 100); // 两个订阅都会收到
+ * 
+ * @author fomjar
+ * @date 2022/05/06
+ */
+class topic_queue {
+
+    struct subscriber {
+        uint64_t                    id;
+        std::shared_ptr<const any>  callback;
+    };
+    using subscribers = std::vector<subscriber>;
+
+    struct node {
+        registry<std::string, std::shared_ptr<const node>>  children;
+        subscribers                                         subs;
+    };
+
+    struct trie {
+        trie() : root(std::make_shared<node>()), generation(0) { }
+
+        std::shared_ptr<const node> root;
+        uint64_t                    generation;
+    };
+
+public:
+    topic_queue() : subscriptions(), mutex(), next_id(0), cache(), cache_generation(0), quer() {
+        this->quer.start();
+    }
+
+public:
+    /**
+     * @brief 订阅主题。
+     * 
+     * @tparam _Ap 
+     * @param pattern 可以包含通配符'*'和'#'
+     * @param callback 
+     * @return uint64_t 订阅id，用于退订
+     */
+    template <typename ... _Ap>
+    uint64_t sub(const std::string & pattern, const func_v<_Ap...> & callback) {
+        JAR_EXEC_LOCK_GUARD
+
+        auto s = subscriber { ++this->next_id, std::make_shared<const any>(func_v<_Ap...>(callback)) }; // make a copy
+        auto t = this->subscriptions.read();
+        auto segs = split(pattern);
+
+        trie u;
+        u.root = update(t->root, segs, 0, [&s] (subscribers & subs) { subs.push_back(s); return true; });
+        u.generation = t->generation + 1;
+        this->subscriptions.store(std::move(u));
+        return s.id;
+    }
+
+    /**
+     * @brief 退订主题。
+     * 
+     * @param pattern 
+     * @param id sub返回的订阅id
+     * @return true 退订成功
+     * @return false 没有找到订阅
+     */
+    bool unsub(const std::string & pattern, uint64_t id) {
+        JAR_EXEC_LOCK_GUARD
+
+        auto t = this->subscriptions.read();
+        auto segs = split(pattern);
+
+        bool found = false;
+        trie u;
+        u.root = update(t->root, segs, 0, [id, &found] (subscribers & subs) {
+            auto i = std::remove_if(subs.begin(), subs.end(), [id] (const subscriber & s) { return s.id == id; });
+            found = i != subs.end();
+            subs.erase(i, subs.end());
+            return found;
+        });
+        if (!found) return false;
+
+        u.generation = t->generation + 1;
+        this->subscriptions.store(std::move(u));
+        return true;
+    }
+
+    /**
+     * @brief 发布事件。主题不能包含通配符。
+     * 
+     * @tparam _Ap 
+     * @param topic 
+     * @param args 
+     */
+    template <typename ... _Ap>
+    void pub(const std::string & topic, const _Ap & ... args) {
+        this->quer.submit((func_vv) [this, topic, args...] {
+            for (const auto & s : this->match(topic)) {
+                auto callback = s.callback->template get<func_v<_Ap...>>();
+                if (callback) (*callback)(args...);
+            }
+        });
+    }
+
+private:
+    static std::vector<std::string> split(const std::string & topic) {
+        std::vector<std::string> segs;
+        size_t beg = 0;
+        while (true) {
+            auto end = topic.find('.', beg);
+            segs.push_back(topic.substr(beg, end - beg));
+            if (std::string::npos == end) break;
+            beg = end + 1;
+        }
+        return segs;
+    }
+
+    /**
+     * @brief 复制从根到目标节点的路径，在目标节点上修改订阅，其余节点共享。
+     */
+    template <typename _Fp>
+    static std::shared_ptr<const node> update(const std::shared_ptr<const node> & n, const std::vector<std::string> & segs, size_t i, _Fp f) {
+        auto c = n ? std::make_shared<node>(*n) : std::make_shared<node>();
+        if (i == segs.size()) {
+            f(c->subs);
+        } else {
+            auto it = c->children.find(segs[i]);
+            auto child = update(it ? *it : nullptr, segs, i + 1, f);
+            if (child->subs.empty() && child->children.empty())
+                c->children = c->children.without(segs[i]);
+            else
+                c->children = c->children.with(segs[i], child);
+        }
+        return c;
+    }
+
+    static void collect(const node & n, const std::vector<std::string> & segs, size_t i, std::vector<subscriber> & out) {
+        auto hash = n.children.find("#");
+        if (hash) {
+            for (auto j = i; j <= segs.size(); j++)
+                collect(**hash, segs, j, out);
+        }
+        if (i == segs.size()) {
+            out.insert(out.end(), n.subs.begin(), n.subs.end());
+            return;
+        }
+        auto exact = n.children.find(segs[i]);
+        if (exact)
+            collect(**exact, segs, i + 1, out);
+        auto star = n.children.find("*");
+        if (star)
+            collect(**star, segs, i + 1, out);
+    }
+
+    /**
+     * @brief 查找主题的全部订阅者。只在分发线程上调用，缓存不需要加锁。
+     */
+    const subscribers & match(const std::string & topic) {
+        const size_t CACHE_LIMIT = 4096;
+
+        auto t = this->subscriptions.read();
+        if (this->cache_generation != t->generation || this->cache.size() >= CACHE_LIMIT) {
+            this->cache.clear();
+            this->cache_generation = t->generation;
+        }
+
+        auto it = this->cache.find(topic);
+        if (it != this->cache.end()) return it->second;
+
+        subscribers out;
+        collect(*t->root, split(topic), 0, out);
+        // 不同的通配路径可能匹配到同一个订阅，按id去重并保持订阅顺序
+        std::sort(out.begin(), out.end(), [] (const subscriber & a, const subscriber & b) { return a.id < b.id; });
+        out.erase(std::unique(out.begin(), out.end(), [] (const subscriber & a, const subscriber & b) { return a.id == b.id; }), out.end());
+        return this->cache[topic] = std::move(out);
+    }
+
+    rcu<trie>                                       subscriptions;
+    std::mutex                                      mutex;      // 写锁
+    uint64_t                                        next_id;
+    std::unordered_map<std::string, subscribers>    cache;      // 仅分发线程访问
+    uint64_t                                        cache_generation;
+    queuer                                          quer;
+
+};
+
+
+} // namespace jar
+
+
+#endif // _JAR_TOPIC_H
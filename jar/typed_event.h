@@ -0,0 +1,200 @@
+/**
+ * @file typed_event.h
+ * @author fomjar (fomjar@gmail.com)
+ * @brief 
+ * @version 0.1
+ * @date 2022-05-04
+ * 
+ * @copyright Copyright (c) 2022
+ * 
+ */
+
+#ifndef _JAR_TYPED_EVENT_H
+#define _JAR_TYPED_EVENT_H
+
+#include "exec.h"
+#include "rcu.h"
+
+#include <tuple>
+#include <type_traits>
+#include <vector>
+
+namespace jar {
+
+
+
+/**
+ * @brief 静态类型的事件。事件id和参数类型都在编译期确定。
+ * 
+ * using login  = jar::typed_event<0x01, std::string>;
+ * using logout = jar::typed_event<0x02, std::string, int>;
+ * 
+ * @tparam _Id 
+ * @tparam _Ap 
+ * 
+ * @author fomjar
+ * @date 2022/05/04
+ */
+template <uint64_t _Id, typename ... _Ap>
+struct typed_event {
+    static const uint64_t id = _Id;
+    using callback  = func_v<_Ap...>;
+    using args      = std::tuple<_Ap...>;
+};
+
+
+
+namespace detail {
+
+/**
+ * @brief 事件在事件列表中的下标，不存在时为列表长度。
+ */
+template <typename _Ev, typename ... _Evs>
+struct index_of;
+
+template <typename _Ev>
+struct index_of<_Ev> : std::integral_constant<size_t, 0> { };
+
+template <typename _Ev, typename ... _Evs>
+struct index_of<_Ev, _Ev, _Evs...> : std::integral_constant<size_t, 0> { };
+
+template <typename _Ev, typename _E0, typename ... _Evs>
+struct index_of<_Ev, _E0, _Evs...> : std::integral_constant<size_t, 1 + index_of<_Ev, _Evs...>::value> { };
+
+/**
+ * @brief 事件id是否两两不同。
+ */
+template <typename ... _Evs>
+struct unique_ids;
+
+template <>
+struct unique_ids<> : std::true_type { };
+
+template <typename _E0, typename ... _Evs>
+struct unique_ids<_E0, _Evs...> : std::integral_constant<bool,
+        !(index_of<typed_event<_E0::id>, typed_event<_Evs::id>...>::value < sizeof...(_Evs))
+        && unique_ids<_Evs...>::value> { };
+
+} // namespace detail
+
+
+
+/**
+ * @brief 静态类型的事件队列。事件集合在编译期确定，每个事件对应一张订阅表，订阅表里直接保存具体类型的回调。
+ * 
+ * 发布时按编译期下标找到订阅表，读取rcu快照后顺序调用，不经过any的类型擦除；订阅或发布的参数类型不匹配时编译失败。
+ * 事件的分发执行委托给了内部的异步队列。
+ * 
+ * jar::typed_event_queue<login, logout> queue;
+ * queue.sub<login>([] (std::string user) { ... });
+ * queue.pub<login>(std::string("fomjar"));
+ * 
+ * @tparam _Evs 
+ * 
+ * @author fomjar
+ * @date 2022/05/04
+ */
+template <typename ... _Evs>
+class typed_event_queue {
+
+    static_assert(detail::unique_ids<_Evs...>::value, "duplicate typed_event id");
+
+    template <typename _Ev>
+    struct subscriber {
+        uint64_t                    id;
+        typename _Ev::callback      callback;
+    };
+
+    template <typename _Ev>
+    using table = rcu<std::vector<subscriber<_Ev>>>;
+
+    template <typename _Ev>
+    struct index {
+        static const size_t value = detail::index_of<_Ev, _Evs...>::value;
+        static_assert(value < sizeof...(_Evs), "event is not registered in this typed_event_queue");
+    };
+
+public:
+    typed_event_queue() : tables(), mutex(), next_id(0), quer() {
+        this->quer.start();
+    }
+
+public:
+    /**
+     * @brief 订阅事件。
+     * 
+     * @tparam _Ev 
+     * @param callback 
+     * @return uint64_t 订阅id，用于退订
+     */
+    template <typename _Ev>
+    uint64_t sub(const typename _Ev::callback & callback) {
+        JAR_EXEC_LOCK_GUARD
+
+        auto & t = std::get<index<_Ev>::value>(this->tables);
+        auto v = *t.read();
+        v.push_back(subscriber<_Ev> { ++this->next_id, callback });
+        t.store(std::move(v));
+        return this->next_id;
+    }
+
+    /**
+     * @brief 退订事件。
+     * 
+     * @tparam _Ev 
+     * @param id sub返回的订阅id
+     * @return true 退订成功
+     * @return false 没有找到订阅
+     */
+    template <typename _Ev>
+    bool unsub(uint64_t id) {
+        JAR_EXEC_LOCK_GUARD
+
+        auto & t = std::get<index<_Ev>::value>(this->tables);
+        auto r = t.read();
+        std::vector<subscriber<_Ev>> v;
+        for (const auto & s : *r) {
+            if (s.id != id) v.push_back(s);
+        }
+        if (v.size() == r->size()) return false;
+
+        t.store(std::move(v));
+        return true;
+    }
+
+    /**
+     * @brief 发布事件。参数必须能构造出事件声明的参数类型。
+     * 
+     * @tparam _Ev 
+     * @tparam _Ap 
+     * @param args 
+     */
+    template <typename _Ev, typename ... _Ap>
+    void pub(_Ap && ... args) {
+        typename _Ev::args a(std::forward<_Ap>(args)...);
+        this->quer.submit((func_vv) [this, a] {
+            this->dispatch<_Ev>(a, typename detail::make_index_seq<std::tuple_size<typename _Ev::args>::value>::type());
+        });
+    }
+
+private:
+    template <typename _Ev, size_t ... _Is>
+    void dispatch(const typename _Ev::args & a, detail::index_seq<_Is...>) {
+        auto r = std::get<index<_Ev>::value>(this->tables).read();
+        for (const auto & s : *r) {
+            s.callback(std::get<_Is>(a)...);
+        }
+    }
+
+    std::tuple<table<_Evs>...>  tables;
+    std::mutex                  mutex;  // 写锁
+    uint64_t                    next_id;
+    queuer                      quer;
+
+};
+
+
+} // namespace jar
+
+
+#endif // _JAR_TYPED_EVENT_H
@@ -0,0 +1,286 @@
+/**
+ * @file watchdog.h
+ * @author fomjar (fomjar@gmail.com)
+ * @brief 
+ * @version 0.1
+ * @date 2022-05-14
+ * 
+ * @copyright Copyright (c) 2022
+ * 
+ */
+
+#ifndef _JAR_WATCHDOG_H
+#define _JAR_WATCHDOG_H
+
+#include "clock.h"
+#include "exec.h"
+#include "time.h"
+
+#include <atomic>
+#include <chrono>
+#include <csignal>
+#include <cstdlib>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#if defined(__linux__)
+#include <execinfo.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+namespace jar {
+
+
+
+/**
+ * @brief 一次卡顿的报告。
+ * 
+ * @author fomjar
+ * @date 2022/05/14
+ */
+struct stall_report {
+    std::string                 name;       // 执行器名称
+    int                         tid;        // 工作线程的系统线程号
+    int64_t                     running_ns; // 当前任务已执行的时长
+    size_t                      backlog;    // 排在它后面的任务数，任务在执行器的锁内卡住时为0
+    std::vector<std::string>    stack;      // 卡住线程的调用栈，未启用抓栈时为空
+};
+
+
+
+namespace detail {
+
+#if defined(__linux__)
+/**
+ * @brief 信号处理函数写入的调用栈。处理函数里只调用backtrace，符号化在watchdog线程上进行。
+ */
+struct stack_capture {
+    static const int MAX_FRAMES = 64;
+
+    void              * frames[MAX_FRAMES];
+    std::atomic<int>    depth;
+    std::atomic<bool>   done;
+
+    static stack_capture & instance() {
+        static stack_capture c;
+        return c;
+    }
+
+    static void handler(int) {
+        auto & c = stack_capture::instance();
+        c.depth.store(backtrace(c.frames, MAX_FRAMES), std::memory_order_relaxed);
+        c.done.store(true, std::memory_order_release);
+    }
+};
+#endif
+
+} // namespace detail
+
+
+
+/**
+ * @brief 卡顿看门狗。按固定间隔检查所有执行器（包括线程池中的工作线程）当前任务的执行时长，
+ * 超过阈值时报告执行器名称、线程号和排在后面的任务数，可选地通过信号抓取卡住线程的调用栈。
+ * poller的任务可能在调用方线程上执行，报告的线程号是它的工作线程，没有启动时为0，不抓栈。
+ * 
+ * 没有watchdog启用时，工作线程只多一次原子读；启用后每个任务多一次粗粒度时钟读取，只有几纳秒。
+ * 每个卡住的任务只报告一次。默认的处理函数输出到std::cerr。
+ * 
+ * 抓栈向卡住的线程发送信号（默认SIGUSR2），在处理函数里调用backtrace，等待最多100毫秒。
+ * 信号会被安装到整个进程，应用自己使用该信号时需要换一个；同一时刻只应有一个启用抓栈的watchdog。
+ * 没有以-rdynamic链接时，调用栈中只有模块和偏移，可以用addr2line还原。
+ * 
+ * jar::watchdog wd(std::chrono::seconds(1));
+ * wd.set_capture_stack(true);
+ * wd.start();
+ * 
+ * @author fomjar
+ * @date 2022/05/14
+ */
+class watchdog {
+
+public:
+    template <class _Rep = long long, class _Period = std::milli>
+    explicit watchdog(const std::chrono::duration<_Rep, _Period> & threshold = std::chrono::seconds(1)) :
+        threshold_ns(std::chrono::duration_cast<std::chrono::nanoseconds>(threshold).count()),
+        handler(watchdog::print),
+        capture(false),
+        signo(SIGUSR2),
+        installed(0),
+        reported(),
+        mutex(),
+        loop(std::chrono::nanoseconds(std::max(this->threshold_ns / 4, (int64_t) 1000000))),
+        active(false) {
+        this->loop.set_name("jar::watchdog");
+        this->loop.submit((func_vv) [this] { this->check(); });
+    }
+    ~watchdog() { this->stop(); }
+
+    watchdog(const watchdog &) = delete;
+    watchdog & operator=(const watchdog &) = delete;
+
+    /**
+     * @brief 设置卡顿的处理函数，在watchdog线程上调用。
+     */
+    void set_handler(const func_v<const stall_report &> & handler) {
+        std::lock_guard<std::mutex> guard(this->mutex);
+        this->handler = handler;
+    }
+
+    /**
+     * @brief 是否抓取卡住线程的调用栈。只在Linux上有效。
+     * 
+     * @param enable 
+     * @param signo 用于抓栈的信号
+     */
+    void set_capture_stack(bool enable, int signo = SIGUSR2) {
+        std::lock_guard<std::mutex> guard(this->mutex);
+        this->capture = enable;
+        this->signo   = signo;
+    }
+
+    /**
+     * @brief 开始定时检查。
+     */
+    void start() {
+        if (this->active.exchange(true)) return;
+        executor::watchers++;
+#if defined(__linux__)
+        {
+            std::lock_guard<std::mutex> guard(this->mutex);
+            if (this->capture) {
+                // backtrace第一次调用会加载libgcc，提前在普通上下文中调用，避免在信号处理函数里分配内存
+                void * warm[1];
+                backtrace(warm, 1);
+                detail::stack_capture::instance();
+
+                struct sigaction sa;
+                sa.sa_handler = detail::stack_capture::handler;
+                sigemptyset(&sa.sa_mask);
+                sa.sa_flags = SA_RESTART;
+                sigaction(this->signo, &sa, &this->old_action);
+                this->installed = this->signo;
+            }
+        }
+#endif
+        this->loop.start();
+    }
+
+    /**
+     * @brief 停止检查。
+     */
+    void stop() {
+        if (!this->active.exchange(false)) return;
+        this->loop.stop();
+        executor::watchers--;
+#if defined(__linux__)
+        std::lock_guard<std::mutex> guard(this->mutex);
+        if (this->installed) {
+            sigaction(this->installed, &this->old_action, nullptr);
+            this->installed = 0;
+        }
+#endif
+    }
+
+    /**
+     * @brief 立即检查一次。
+     * 
+     * @return size_t 新发现的卡顿数
+     */
+    size_t check() {
+        struct candidate {
+            const executor    * e;
+            int64_t             start;
+            stall_report        report;
+        };
+        std::vector<candidate> running;
+        auto now = coarse_now_ns();
+        executor::each([this, now, &running] (executor & e) {
+            auto ns = e.task_ns();
+            if (ns <= 0) return;
+            running.push_back(candidate { &e, now - ns, stall_report { "", e.thread_id(), ns, 0, { } } });
+            // 名称有单独的锁，不会在执行任务时被占用；delayer、looper、animator持有mutex执行任务，
+            // 卡住时mutex取不到，只能不阻塞地尝试，取不到时任务数记为0，避免在登记表的锁内等待
+            if (ns >= this->threshold_ns) {
+                running.back().report.name = e.get_name();
+                e.try_backlog(running.back().report.backlog);
+            }
+        });
+
+        std::lock_guard<std::mutex> guard(this->mutex);
+        // 同一个任务的开始时间不变（误差在一个时钟节拍内），已报告过的不再报告；任务结束后记录被清掉
+        std::map<const executor *, int64_t> reported;
+        std::vector<stall_report> stalls;
+        for (auto & c : running) {
+            auto r = this->reported.find(c.e);
+            bool same = r != this->reported.end() && std::abs(r->second - c.start) < this->threshold_ns / 2;
+            if (same) {
+                reported[c.e] = r->second;
+            } else if (c.report.running_ns >= this->threshold_ns) {
+                reported[c.e] = c.start;
+                stalls.push_back(std::move(c.report));
+            }
+        }
+        this->reported.swap(reported);
+
+        for (auto & s : stalls) {
+#if defined(__linux__)
+            if (this->installed && s.tid) s.stack = watchdog::capture_stack(s.tid, this->installed);
+#endif
+            this->handler(s);
+        }
+        return stalls.size();
+    }
+
+private:
+    static void print(const stall_report & s) {
+        std::cerr << jar::now2str() << " - " << "jar::watchdog: " << s.name << " (tid " << s.tid << ") stalled "
+                  << s.running_ns / 1000000 << "ms, " << s.backlog << " tasks behind" << std::endl;
+        for (auto & f : s.stack) std::cerr << "    " << f << std::endl;
+    }
+
+#if defined(__linux__)
+    static std::vector<std::string> capture_stack(int tid, int signo) {
+        std::vector<std::string> r;
+        auto & c = detail::stack_capture::instance();
+        c.done.store(false);
+        if (0 != syscall(SYS_tgkill, getpid(), tid, signo)) return r;
+
+        auto deadline = steady_now_ns() + 100000000LL;
+        while (!c.done.load(std::memory_order_acquire)) {
+            if (steady_now_ns() > deadline) return r;
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        auto depth = c.depth.load(std::memory_order_relaxed);
+        auto syms = backtrace_symbols(c.frames, depth);
+        if (!syms) return r;
+        // 跳过处理函数和信号跳板
+        for (int i = 2; i < depth; i++) r.push_back(syms[i]);
+        free(syms);
+        return r;
+    }
+
+    struct sigaction    old_action;
+#endif
+
+    int64_t                                 threshold_ns;
+    func_v<const stall_report &>            handler;
+    bool                                    capture;
+    int                                     signo;
+    int                                     installed;  // 已安装处理函数的信号
+    std::map<const executor *, int64_t>     reported;   // 已报告的执行器及其任务的开始时间
+    std::mutex                              mutex;
+    looper                                  loop;
+    std::atomic<bool>                       active;
+};
+
+
+} // namespace jar
+
+
+#endif // _JAR_WATCHDOG_H
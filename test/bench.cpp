@@ -0,0 +1,494 @@
+
+
+#include "jar/any.h"
+#include "jar/channel.h"
+#include "jar/clock.h"
+#include "jar/event.h"
+#include "jar/future.h"
+#include "jar/log.h"
+#include "jar/topic.h"
+#include "jar/shm.h"
+
+#include <any>
+#include <atomic>
+#include <cstdlib>
+#include <deque>
+#include <fstream>
+#include <iostream>
+#include <new>
+
+static std::atomic<uint64_t> allocs(0);
+
+void * operator new(size_t n) {
+    allocs++;
+    if (auto p = malloc(n ? n : 1)) return p;
+    throw std::bad_alloc();
+}
+void operator delete(void * p) noexcept { free(p); }
+void operator delete(void * p, size_t) noexcept { free(p); }
+
+template <typename _Fp>
+long long cost(_Fp f) {
+    auto beg = std::chrono::steady_clock::now();
+    f();
+    auto end = std::chrono::steady_clock::now();
+    return std::chrono::duration_cast<std::chrono::microseconds>(end - beg).count();
+}
+
+namespace legacy {
+
+/**
+ * @brief 原先的jar::any：每个右值都在堆上复制一份，并带一个std::function删除器。仅用于对比。
+ */
+class any {
+
+    using func_vv = std::function<void()>;
+
+public:
+    template <typename _Tp>
+    any(_Tp && v) { this->set_val(std::forward<_Tp>(v)); }
+    ~any()        { this->d(); }
+
+    template <typename _Tp>
+    _Tp & cast() const { return * (_Tp *) this->v; }
+
+private:
+    template <typename _Tp>
+    void set_val(_Tp && v) {
+        using _Vp = typename std::decay<_Tp>::type;
+#if defined(__GXX_RTTI)
+        this->t = typeid(v).name();
+#else
+        this->t = nullptr;
+#endif
+        auto p = new _Vp(v);
+        this->v = (void *) p;
+        this->d = [p] { delete p; };
+    }
+
+    const char * t;
+          void * v;
+       func_vv   d;
+};
+
+/**
+ * @brief 原先的now2str：每次调用都做一次localtime，再在格式串里逐个查找替换各字段，每个字段都分配临时字符串。仅用于对比。
+ */
+std::string now2str(const std::string & format = "YYYY/MM/DD hh:mm:ss.SSSSSS") {
+    auto tp = std::chrono::system_clock::now();
+    auto tt = std::chrono::system_clock::to_time_t(tp);
+    auto tm = localtime(&tt);
+    auto us = std::chrono::duration_cast<std::chrono::microseconds>(tp.time_since_epoch()).count();
+
+    std::string str = format;
+
+    auto fmt = [] (long long n, size_t size) -> std::string {
+        std::string s = std::to_string(n);
+        while (s.length() < size) s.insert(0, "0");
+        return s;
+    };
+
+    while (std::string::npos != str.find("YYYY"))   str.replace(str.find("YYYY"),   4, fmt(tm->tm_year + 1900,  4));
+    while (std::string::npos != str.find("MM"))     str.replace(str.find("MM"),     2, fmt(tm->tm_mon + 1,      2));
+    while (std::string::npos != str.find("DD"))     str.replace(str.find("DD"),     2, fmt(tm->tm_mday,         2));
+    while (std::string::npos != str.find("hh"))     str.replace(str.find("hh"),     2, fmt(tm->tm_hour,         2));
+    while (std::string::npos != str.find("mm"))     str.replace(str.find("mm"),     2, fmt(tm->tm_min,          2));
+    while (std::string::npos != str.find("ss"))     str.replace(str.find("ss"),     2, fmt(tm->tm_sec,          2));
+
+    while (std::string::npos != str.find("SSSSSS"))     str.replace(str.find("SSSSSS"),     6, fmt(us        % 1000000,      6));
+    while (std::string::npos != str.find("SSS"))        str.replace(str.find("SSS"),        3, fmt(us / 1000 % 1000,         3));
+
+    return str;
+}
+
+} // namespace legacy
+
+void bench_time() {
+    const uint32_t ROUNDS = 1000000;
+
+    volatile size_t sink = 0;
+    auto run = [&] (const char * name, jar::func<size_t()> f) {
+        auto a0 = allocs.load();
+        auto us = cost([&] { for (uint32_t i = 0; i < ROUNDS; i++) sink = sink + f(); });
+        std::cout << jar::now2str() << " - " << name << ": " << (double) us * 1000 / ROUNDS << "ns, "
+                  << (double) (allocs.load() - a0) / ROUNDS << " allocs/op" << std::endl;
+    };
+
+    jar::time_format f;
+    char buf[64];
+    run("legacy::now2str     ", [] { return legacy::now2str().size(); });
+    run("jar::now2str        ", [] { return jar::now2str().size(); });
+    run("jar::time_format now", [&] { return f.format(buf, sizeof(buf)); });
+    long long us = jar::now();
+    run("jar::time_format us ", [&] { return f.format(buf, sizeof(buf), us++); });
+}
+
+void bench_any() {
+    const uint32_t ROUNDS = 1000000;
+
+    struct point { double x, y; };
+
+    auto run = [&] (const char * name, const char * kind, jar::func<uint64_t()> f) {
+        volatile uint64_t sink = 0;
+        auto a0 = allocs.load();
+        auto us = cost([&] { for (uint32_t i = 0; i < ROUNDS; i++) sink = sink + f(); });
+        std::cout << jar::now2str() << " - " << name << " " << kind << ": " << (long long) us * 1000 / ROUNDS << "ns, "
+                  << (double) (allocs.load() - a0) / ROUNDS << " allocs/op" << std::endl;
+    };
+
+    uint64_t i = 0;
+    run("legacy::any", "int",    [&] { legacy::any a(i++);                  return (uint64_t) a.cast<uint64_t>(); });
+    run("std::any   ", "int",    [&] { std::any a(i++);                     return (uint64_t) std::any_cast<uint64_t &>(a); });
+    run("jar::any   ", "int",    [&] { jar::any a(i++);                     return (uint64_t) a.cast<uint64_t>(); });
+    run("legacy::any", "point",  [&] { legacy::any a(point { 1.0, 2.0 });  return (uint64_t) a.cast<point>().y; });
+    run("std::any   ", "point",  [&] { std::any a(point { 1.0, 2.0 });     return (uint64_t) std::any_cast<point &>(a).y; });
+    run("jar::any   ", "point",  [&] { jar::any a(point { 1.0, 2.0 });     return (uint64_t) a.cast<point>().y; });
+    run("legacy::any", "func",   [&] { legacy::any a((jar::func_vv) [] { }); return (uint64_t) (bool) a.cast<jar::func_vv>(); });
+    run("std::any   ", "func",   [&] { std::any a((jar::func_vv) [] { });    return (uint64_t) (bool) std::any_cast<jar::func_vv &>(a); });
+    run("jar::any   ", "func",   [&] { jar::any a((jar::func_vv) [] { });    return (uint64_t) (bool) a.cast<jar::func_vv>(); });
+
+    jar::any j = std::string("3.3.3");
+    std::any s = std::string("3.3.3");
+    run("std::any   ", "copy string", [&] { std::any b(s); return (uint64_t) std::any_cast<std::string &>(b).size(); });
+    run("jar::any   ", "copy string", [&] { jar::any b(j); return (uint64_t) b.cast<std::string>().size(); });
+    run("std::any   ", "move string", [&] { std::any b(std::move(s)); s = std::move(b); return (uint64_t) 1; });
+    run("jar::any   ", "move string", [&] { jar::any b(std::move(j)); j = std::move(b); return (uint64_t) 1; });
+}
+
+void bench_clock() {
+    const uint32_t ROUNDS = 10000000;
+
+    auto run = [&] (const char * name, int64_t (* f) ()) {
+        volatile int64_t sink = 0;
+        auto us = cost([&] { for (uint32_t i = 0; i < ROUNDS; i++) sink = f(); });
+        std::cout << jar::now2str() << " - " << name << ": " << (double) us * 1000 / ROUNDS << "ns" << std::endl;
+    };
+
+    std::cout << jar::now2str() << " - " << "tsc invariant: " << jar::tsc::invariant() << ", usable: " << jar::tsc::usable() << ", " << jar::tsc::ghz() << "GHz" << std::endl;
+    run("system_clock::now  ", [] { return (int64_t) std::chrono::system_clock::now().time_since_epoch().count(); });
+    run("steady_clock::now  ", [] { return (int64_t) std::chrono::steady_clock::now().time_since_epoch().count(); });
+    run("jar::now           ", [] { return (int64_t) jar::now(); });
+    run("jar::steady_now_ns ", jar::steady_now_ns);
+    run("jar::coarse_now_ns ", jar::coarse_now_ns);
+    run("jar::tsc::now_ns   ", jar::tsc::now_ns);
+}
+
+void bench_log() {
+    const uint32_t LINES = 100000;
+
+    {
+        std::ofstream out("/dev/null");
+        auto us = cost([&] {
+            for (uint32_t i = 0; i < LINES; i++) out << jar::now2str() << " - " << "order " << i << " filled at " << i * 0.5 << std::endl;
+        });
+        std::cout << jar::now2str() << " - " << "ostream << now2str: " << (double) us * 1000 / LINES << "ns/line" << std::endl;
+    }
+    {
+        jar::logger log("/dev/null", 16 << 20, std::chrono::milliseconds(5));
+        auto us = cost([&] {
+            for (uint32_t i = 0; i < LINES; i++) JAR_LOG_INFO(log, "order {} filled at {}", i, i * 0.5);
+        });
+        std::cout << jar::now2str() << " - " << "jar::logger info: " << (double) us * 1000 / LINES << "ns/line, dropped " << log.dropped() << std::endl;
+        us = cost([&] { log.flush(); });
+        std::cout << jar::now2str() << " - " << "jar::logger flush: " << us << "us" << std::endl;
+    }
+}
+
+void bench_event() {
+    const uint32_t TOPICS   = 10000;
+    const uint32_t ROUNDS   = 100;
+
+    jar::event_queue<uint32_t> queue;
+    std::atomic<uint64_t> count(0);
+
+    auto sub = cost([&] {
+        for (uint32_t i = 0; i < TOPICS; i++) {
+            queue.sub(i, (jar::func_v<uint32_t>) [&count] (uint32_t) { count++; });
+        }
+    });
+    std::cout << jar::now2str() << " - " << "event_queue sub " << TOPICS << " topics: " << sub << "us" << std::endl;
+
+    auto pub = cost([&] {
+        for (uint32_t r = 0; r < ROUNDS; r++) {
+            for (uint32_t i = 0; i < TOPICS; i++) {
+                queue.pub(i, i);
+            }
+        }
+        while (count < (uint64_t) TOPICS * ROUNDS) std::this_thread::yield();
+    });
+    std::cout << jar::now2str() << " - " << "event_queue pub " << TOPICS * ROUNDS << " events over " << TOPICS << " topics: "
+              << pub << "us, " << (long long) TOPICS * ROUNDS * 1000000 / (pub ? pub : 1) << " events/s" << std::endl;
+
+    auto miss = cost([&] {
+        for (uint32_t i = 0; i < TOPICS * ROUNDS; i++) {
+            queue.pub(TOPICS + i, i);
+        }
+        queue.pub(0u, 0u); // 队尾哨兵，确认前面的事件都已分发
+        while (count < (uint64_t) TOPICS * ROUNDS + 1) std::this_thread::yield();
+    });
+    std::cout << jar::now2str() << " - " << "event_queue pub " << TOPICS * ROUNDS << " unsubscribed events: " << miss << "us" << std::endl;
+}
+
+void bench_event_sync() {
+    const uint32_t EVENTS = 1000000;
+
+    jar::event_queue<uint32_t> queue;
+    std::atomic<uint64_t> count(0);
+    queue.sub(0u, (jar::func_v<uint32_t>) [&count] (uint32_t) { count++; });
+
+    auto async = cost([&] {
+        for (uint32_t i = 0; i < EVENTS / 10; i++) {
+            auto expect = count + 1;
+            queue.pub(0u, i);
+            while (count < expect) std::this_thread::yield();
+        }
+    });
+    std::cout << jar::now2str() << " - " << "event_queue pub round trip: " << async * 10000 / EVENTS << "ns/event" << std::endl;
+
+    auto sync = cost([&] {
+        for (uint32_t i = 0; i < EVENTS; i++) queue.pub_sync(0u, i);
+    });
+    std::cout << jar::now2str() << " - " << "event_queue pub_sync: " << sync * 1000 / EVENTS << "ns/event" << std::endl;
+}
+
+void bench_event_parallel() {
+    const uint32_t SUBS     = 8;
+    const uint32_t EVENTS   = 2000;
+
+    auto run = [&] (jar::event_queue<uint32_t> & queue) {
+        std::atomic<uint64_t> count(0);
+        for (uint32_t i = 0; i < SUBS; i++) {
+            queue.sub(0u, (jar::func_v<uint32_t>) [&count] (uint32_t) {
+                auto end = std::chrono::steady_clock::now() + std::chrono::microseconds(20);
+                while (std::chrono::steady_clock::now() < end) { }
+                count++;
+            });
+        }
+        return cost([&] {
+            for (uint32_t i = 0; i < EVENTS; i++) queue.pub(0u, i);
+            while (count < (uint64_t) SUBS * EVENTS) std::this_thread::yield();
+        });
+    };
+
+    {
+        jar::event_queue<uint32_t> queue;
+        std::cout << jar::now2str() << " - " << "event_queue queued " << SUBS << " subs x " << EVENTS << " events: " << run(queue) << "us" << std::endl;
+    }
+    {
+        jar::fixed_pool pool(std::max(2u, std::thread::hardware_concurrency()));
+        jar::event_queue<uint32_t> queue(pool);
+        std::cout << jar::now2str() << " - " << "event_queue parallel " << SUBS << " subs x " << EVENTS << " events: " << run(queue) << "us" << std::endl;
+    }
+}
+
+void bench_event_sharded() {
+    const uint32_t TOPICS   = 64;
+    const uint32_t EVENTS   = 200000;
+
+    auto run = [&] (size_t shards) {
+        jar::sharded_event_queue<uint32_t> queue(shards);
+        std::atomic<uint64_t> count(0);
+        for (uint32_t i = 0; i < TOPICS; i++) {
+            queue.sub(i, (jar::func_v<uint32_t>) [&count] (uint32_t) {
+                auto end = std::chrono::steady_clock::now() + std::chrono::microseconds(2);
+                while (std::chrono::steady_clock::now() < end) { }
+                count++;
+            });
+        }
+        auto us = cost([&] {
+            for (uint32_t i = 0; i < EVENTS; i++) queue.pub(i % TOPICS, i);
+            while (count < EVENTS) std::this_thread::yield();
+        });
+        std::cout << jar::now2str() << " - " << "sharded_event_queue " << shards << " shards, " << EVENTS << " events over " << TOPICS << " topics: "
+                  << us << "us, " << (long long) EVENTS * 1000000 / (us ? us : 1) << " events/s" << std::endl;
+    };
+
+    run(1);
+    run(std::max(2u, std::thread::hardware_concurrency()));
+}
+
+void bench_event_affine() {
+    const uint32_t SUBS     = 4;
+    const uint32_t EVENTS   = 200000;
+
+    jar::queuer target;
+    target.start();
+
+    {
+        // 回调里再submit到目标执行器
+        jar::event_queue<uint32_t> queue;
+        std::atomic<uint64_t> count(0);
+        for (uint32_t i = 0; i < SUBS; i++) {
+            queue.sub(0u, (jar::func_v<uint32_t>) [&target, &count] (uint32_t) {
+                target.submit((jar::func_vv) [&count] { count++; });
+            });
+        }
+        auto us = cost([&] {
+            for (uint32_t i = 0; i < EVENTS; i++) queue.pub(0u, i);
+            while (count < (uint64_t) SUBS * EVENTS) std::this_thread::yield();
+        });
+        std::cout << jar::now2str() << " - " << "event_queue resubmit " << SUBS << " subs x " << EVENTS << " events: " << us << "us" << std::endl;
+    }
+    {
+        jar::event_queue<uint32_t> queue;
+        std::atomic<uint64_t> count(0);
+        for (uint32_t i = 0; i < SUBS; i++) {
+            queue.sub(0u, target, (jar::func_v<uint32_t>) [&count] (uint32_t) { count++; });
+        }
+        auto us = cost([&] {
+            for (uint32_t i = 0; i < EVENTS; i++) queue.pub(0u, i);
+            while (count < (uint64_t) SUBS * EVENTS) std::this_thread::yield();
+        });
+        std::cout << jar::now2str() << " - " << "event_queue affine " << SUBS << " subs x " << EVENTS << " events: " << us << "us" << std::endl;
+    }
+}
+
+void bench_topic() {
+    const uint32_t TOPICS   = 10000;
+    const uint32_t EVENTS   = 1000000;
+
+    jar::topic_queue queue;
+    std::atomic<uint64_t> count(0);
+
+    auto sub = cost([&] {
+        for (uint32_t i = 0; i < TOPICS; i++) {
+            queue.sub("orders." + std::to_string(i) + ".*", (jar::func_v<uint32_t>) [&count] (uint32_t) { count++; });
+        }
+        queue.sub("orders.#", (jar::func_v<uint32_t>) [&count] (uint32_t) { count++; });
+    });
+    std::cout << jar::now2str() << " - " << "topic_queue sub " << TOPICS << " wildcard topics: " << sub << "us" << std::endl;
+
+    std::vector<std::string> topics;
+    for (uint32_t i = 0; i < 100; i++) topics.push_back("orders." + std::to_string(i) + ".nyse");
+
+    auto pub = cost([&] {
+        for (uint32_t i = 0; i < EVENTS; i++) queue.pub(topics[i % topics.size()], i);
+        while (count < (uint64_t) EVENTS * 2) std::this_thread::yield();
+    });
+    std::cout << jar::now2str() << " - " << "topic_queue pub " << EVENTS << " events: " << pub << "us, "
+              << (long long) EVENTS * 1000000 / (pub ? pub : 1) << " events/s" << std::endl;
+}
+
+void bench_shm() {
+    const uint32_t EVENTS = 1000000;
+
+    auto name = "/jar_bench_" + std::to_string(getpid());
+    jar::shm_bus bus(name, 1 << 16);
+    std::atomic<uint64_t> count(0);
+    bus.sub(0x01, (jar::func_v<uint64_t, double>) [&count] (uint64_t, double) { count++; });
+
+    auto pub = cost([&] {
+        for (uint32_t i = 0; i < EVENTS; i++) {
+            bus.pub(0x01, (uint64_t) i, 1.0);
+        }
+    });
+    std::this_thread::sleep_for(std::chrono::milliseconds(500));
+    std::cout << jar::now2str() << " - " << "shm_bus pub " << EVENTS << " events: " << pub << "us, "
+              << (long long) pub * 1000 / EVENTS << "ns/pub, received " << count << ", lost " << bus.lost() << std::endl;
+    jar::shm_bus::unlink(name);
+}
+
+void bench_channel() {
+    const uint64_t ITEMS = 5000000;
+
+    auto run = [&] (const char * name, std::function<void(uint64_t)> send, std::function<bool(uint64_t &)> recv, std::function<void()> close) {
+        std::atomic<uint64_t> sum(0);
+        auto us = cost([&] {
+            std::thread consumer([&] {
+                uint64_t v, s = 0;
+                while (recv(v)) s += v;
+                sum = s;
+            });
+            for (uint64_t i = 0; i < ITEMS; i++) send(i);
+            close();
+            consumer.join();
+        });
+        std::cout << jar::now2str() << " - " << name << ": " << (long long) ITEMS * 1000000 / (us ? us : 1) << " items/s, "
+                  << (double) us * 1000 / ITEMS << "ns/item, sum ok " << (sum == ITEMS * (ITEMS - 1) / 2) << std::endl;
+    };
+
+    {
+        std::mutex mutex;
+        std::condition_variable cv;
+        std::deque<uint64_t> q;
+        bool closed = false;
+        run("mutex deque ", [&] (uint64_t v) {
+            std::lock_guard<std::mutex> guard(mutex);
+            q.push_back(v);
+            cv.notify_one();
+        }, [&] (uint64_t & v) {
+            std::unique_lock<std::mutex> lock(mutex);
+            cv.wait(lock, [&] { return closed || !q.empty(); });
+            if (q.empty()) return false;
+            v = q.front();
+            q.pop_front();
+            return true;
+        }, [&] {
+            std::lock_guard<std::mutex> guard(mutex);
+            closed = true;
+            cv.notify_all();
+        });
+    }
+    {
+        jar::spsc_channel<uint64_t> ch(4096);
+        run("spsc_channel", [&] (uint64_t v) { ch.send(v); }, [&] (uint64_t & v) { return ch.recv(v); }, [&] { ch.close(); });
+    }
+    {
+        jar::mpmc_channel<uint64_t> ch(4096);
+        run("mpmc_channel", [&] (uint64_t v) { ch.send(v); }, [&] (uint64_t & v) { return ch.recv(v); }, [&] { ch.close(); });
+    }
+}
+
+void bench_future() {
+    const uint32_t ROUNDS = 1000000;
+
+    uint64_t a0 = allocs;
+    auto std_us = cost([&] {
+        for (uint32_t i = 0; i < ROUNDS; i++) {
+            std::promise<int> p;
+            auto f = p.get_future();
+            p.set_value((int) i);
+            f.get();
+        }
+    });
+    uint64_t a1 = allocs;
+    auto jar_us = cost([&] {
+        for (uint32_t i = 0; i < ROUNDS; i++) {
+            jar::promise<int> p;
+            auto f = p.get_future();
+            p.set_value((int) i);
+            f.get();
+        }
+    });
+    uint64_t a2 = allocs;
+    auto then_us = cost([&] {
+        for (uint32_t i = 0; i < ROUNDS; i++) {
+            jar::promise<int> p;
+            auto f = p.get_future().then([] (int v) { return v + 1; });
+            p.set_value((int) i);
+            f.get();
+        }
+    });
+    std::cout << jar::now2str() << " - " << "std::promise set/get: " << (double) std_us * 1000 / ROUNDS << "ns, "
+              << (double) (a1 - a0) / ROUNDS << " allocs" << std::endl;
+    std::cout << jar::now2str() << " - " << "jar::promise set/get: " << (double) jar_us * 1000 / ROUNDS << "ns, "
+              << (double) (a2 - a1) / ROUNDS << " allocs" << std::endl;
+    std::cout << jar::now2str() << " - " << "jar::promise then/set/get: " << (double) then_us * 1000 / ROUNDS << "ns" << std::endl;
+}
+
+int main() {
+    bench_clock();
+    bench_any();
+    bench_time();
+    bench_log();
+    bench_event();
+    bench_event_sync();
+    bench_event_parallel();
+    bench_event_sharded();
+    bench_event_affine();
+    bench_topic();
+    bench_shm();
+    bench_channel();
+    bench_future();
+    return 0;
+}
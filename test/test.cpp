@@ -1,9 +1,23 @@
 
 #include "jar/any.h"
+#include "jar/channel.h"
 #include "jar/exec.h"
+#include "jar/future.h"
 #include "jar/event.h"
+#include "jar/typed_event.h"
+#include "jar/topic.h"
+#include "jar/shm.h"
+#include "jar/log.h"
+#include "jar/pipeline.h"
+#include "jar/watchdog.h"
 
+#include <algorithm>
+#include <fstream>
 #include <iostream>
+#include <map>
+
+#include <poll.h>
+#include <sys/wait.h>
 
 void test_any() {
     jar::any a1 = 3;
@@ -12,9 +26,98 @@ void test_any() {
     std::cout << jar::now2str() << " - " << "any int: " << a1.cast<int>() << std::endl;
     std::cout << jar::now2str() << " - " << "any float: " << a2.cast<float>() << std::endl;
     std::cout << jar::now2str() << " - " << "any string: " << a3.cast<std::string>() << std::endl;
+
+    jar::any a4 = a3;
+    a3.cast<std::string>() += ".3";
+    jar::any a5 = std::move(a3);
+    std::cout << jar::now2str() << " - " << "any copy: " << a4.cast<std::string>() << ", move: " << a5.cast<std::string>() << ", moved-from empty: " << a3.empty() << std::endl;
+
+    struct big { char data[256]; int tag; };
+    big b;
+    b.tag = 7;
+    jar::any a6 = b;
+    a6 = a1;
+    a1 = b;
+    std::cout << jar::now2str() << " - " << "any reassign: " << a6.cast<int>() << ", " << a1.cast<big>().tag << std::endl;
+
+    bool thrown = false;
+    try { a6.cast<float>(); } catch (const std::bad_cast &) { thrown = true; }
+    std::cout << jar::now2str() << " - " << "any checked: is<int> " << a6.is<int>() << ", get<float> " << (a6.get<float>() == nullptr)
+              << ", cast<float> throws " << thrown << ", type " << (a6.type() == jar::type_of<const int &>()) << std::endl;
+}
+
+void test_time() {
+    jar::time_format f("YYYY-MM-DD hh:mm:ss.SSS|SSSSSS");
+    char buf[64];
+    auto us = jar::now();
+    f.format(buf, sizeof(buf), us);
+    std::cout << jar::now2str() << " - " << "time_format: " << buf << " (" << us % 1000000 << "us)" << std::endl;
+    f.format(buf, 12, us);
+    std::cout << jar::now2str() << " - " << "time_format truncated: " << buf << std::endl;
+    std::cout << jar::now2str() << " - " << "time_format custom: " << jar::now2str("hh:mm:ss") << std::endl;
+}
+
+void test_log() {
+    char path[] = "/tmp/jar_log_XXXXXX";
+    close(mkstemp(path));
+    {
+        jar::logger log(path);
+        log.set_level(jar::level::debug);
+        JAR_LOG_TRACE(log, "filtered {}", 0);
+        std::thread t([&log] {
+            for (int i = 0; i < 100; i++) JAR_LOG_DEBUG(log, "worker {} of {}", i, std::string("thread"));
+        });
+        for (int i = 0; i < 100; i++) JAR_LOG_INFO(log, "main {} px {} ok {} name {}", i, i * 0.5, i % 2 == 0, "jar");
+        t.join();
+        JAR_LOG_WARN(log, "pointer {} extra {}", (void *) &log);
+        log.flush();
+
+        std::ifstream in(path);
+        std::string first, l;
+        size_t lines = 0;
+        while (std::getline(in, l)) {
+            if (0 == lines++) first = l;
+        }
+        std::cout << jar::now2str() << " - " << "logger lines: " << lines << ", first: " << first << std::endl;
+    }
+    {
+        jar::logger log(path, 1024, std::chrono::seconds(10));
+        for (int i = 0; i < 1000; i++) JAR_LOG_INFO(log, "flood {}", i);
+        std::cout << jar::now2str() << " - " << "logger dropped: " << log.dropped() << std::endl;
+        log.set_policy(jar::logger::policy::block);
+    }
+    {
+        // 交替写两个logger，线程按logger各缓存一个缓冲
+        jar::logger a(path), b("/dev/null");
+        for (int i = 0; i < 100; i++) {
+            JAR_LOG_INFO(a, "alternate {} quarter {}", i, (long double) i / 4);
+            JAR_LOG_INFO(b, "alternate {}", i);
+        }
+        a.flush();
+
+        std::ifstream in(path);
+        std::string last, l;
+        size_t lines = 0;
+        while (std::getline(in, l)) {
+            if (std::string::npos == l.find("alternate")) continue;
+            lines++;
+            last = l;
+        }
+        std::cout << jar::now2str() << " - " << "logger alternate lines: " << lines << ", dropped " << a.dropped() + b.dropped() << ", last: " << last << std::endl;
+    }
+    unlink(path);
 }
 
 void test_exec() {
+    {
+        auto s0 = jar::steady_now_ns();
+        auto t0 = jar::tsc::now_ns();
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        auto s1 = jar::steady_now_ns();
+        auto t1 = jar::tsc::now_ns();
+        std::cout << jar::now2str() << " - " << "clock steady " << (s1 - s0) / 1000 << "us, tsc " << (t1 - t0) / 1000 << "us (usable " << jar::tsc::usable()
+                  << "), coarse " << (s1 - jar::coarse_now_ns()) / 1000 << "us behind" << std::endl;
+    }
     {
         jar::queuer e;
         e.start();
@@ -32,6 +135,132 @@ void test_exec() {
         float c = p.get_future().get();
         std::cout << jar::now2str() << " - " << "queuer func<float(float, float)> = " << c << std::endl;
     }
+    {
+        jar::virtual_clock vc;
+        auto beg = jar::steady_now_ns();
+
+        std::atomic<int> delayed(0);
+        jar::delayer d(std::chrono::hours(1));
+        d.set_clock(vc);
+        d.submit((jar::func_vv) [&delayed] { delayed++; });
+        d.start();
+
+        std::atomic<int> loops(0);
+        jar::looper l(std::chrono::minutes(1));
+        l.set_clock(vc);
+        l.submit((jar::func_vv) [&loops] { loops++; });
+        l.start();
+
+        for (int i = 1; i <= 24 * 60; i++) {
+            vc.settle(i <= 60 ? 2 : 1);
+            vc.advance(std::chrono::minutes(1));
+        }
+        vc.settle(1);
+        l.stop();
+        d.stop();
+
+        jar::sched.set_clock(vc);
+        std::atomic<int> timed(0);
+        std::promise<void> p;
+        for (int i = 1; i <= 24; i++)
+            jar::sched.submit_after(std::chrono::hours(i), (jar::func_vv) [&timed, &p, i] { if (24 == ++timed) p.set_value(); });
+        for (int i = 0; i < 24; i++) {
+            vc.settle(1);
+            vc.advance(std::chrono::hours(1));
+        }
+        p.get_future().wait();
+        jar::sched.set_clock(jar::clock::system());
+        while (vc.waiting() > 0) std::this_thread::yield();
+
+        std::cout << jar::now2str() << " - " << "virtual clock simulated " << vc.now_ns() / 3600000000000LL << "h in "
+                  << (jar::steady_now_ns() - beg) / 1000000 << "ms, delayed " << delayed << ", loops " << loops << ", timed " << timed << std::endl;
+    }
+    {
+        jar::virtual_clock vc;
+        jar::timer t;
+        t.set_clock(vc);
+        t.start();
+        jar::queuer q;
+        q.start();
+
+        std::atomic<int> count(0);
+        jar::throttle th(q, 10, 5, t);
+        for (int i = 0; i < 25; i++) th.submit([&count] { count++; });
+        auto s0 = th.stats();
+        // 每步等定时器重新进入等待后再前进，直到全部执行，最多前进100步
+        bool settled = true;
+        for (int i = 0; i < 100 && count < 25; i++) {
+            settled = vc.settle(1) && settled;
+            vc.advance(std::chrono::milliseconds(100));
+        }
+        auto beg = jar::steady_now_ns();
+        while (count < 25 && jar::steady_now_ns() - beg < 1000000000LL) std::this_thread::yield();
+        auto s1 = th.stats();
+        std::cout << jar::now2str() << " - " << "throttle passed " << s0.passed << ", pending " << s0.pending
+                  << " -> deferred " << s1.deferred << ", pending " << s1.pending << ", max delay " << s1.delay_max_ns / 1000000 << "ms"
+                  << ", count " << count << ", settled " << settled << std::endl;
+
+        std::promise<void> p;
+        beg = jar::steady_now_ns();
+        jar::throttle tp(jar::pool, 1000);
+        count = 0;
+        for (int i = 0; i < 50; i++) tp.submit([&count, &p] { if (50 == ++count) p.set_value(); });
+        p.get_future().wait();
+        std::cout << jar::now2str() << " - " << "throttle 50 tasks at 1000/s in " << (jar::steady_now_ns() - beg) / 1000000 << "ms" << std::endl;
+    }
+    {
+        jar::poller e;
+        std::thread t([&e] {
+            for (int i = 0; i < 3; i++) {
+                e.submit((jar::func_v<int>) [] (int i) {
+                    std::cout << jar::now2str() << " - " << "poller func_v<int> " << i << std::endl;
+                }, i);
+            }
+        });
+        t.join();
+        size_t n = e.poll();
+        std::cout << jar::now2str() << " - " << "poller poll: " << n << std::endl;
+        e.submit((jar::func_vv) [] {
+            std::cout << jar::now2str() << " - " << "poller run_one" << std::endl;
+        });
+        e.run_one();
+        n = e.run_for(std::chrono::milliseconds(100));
+        std::cout << jar::now2str() << " - " << "poller run_for: " << n << std::endl;
+
+        // 还有任务时fd保持可读；没有等待者时wakeup不影响之后的等待
+        auto readable = [&e] { struct pollfd p = { e.fd(), POLLIN, 0 }; return 1 == ::poll(&p, 1, 0); };
+        e.submit((jar::func_vv) [] { });
+        e.submit((jar::func_vv) [] { });
+        e.run_one();
+        bool r1 = readable();
+        e.run_one();
+        e.poll();
+        bool r2 = readable();
+        e.wakeup();
+        auto beg = jar::steady_now_ns();
+        e.run_for(std::chrono::milliseconds(50));
+        std::cout << jar::now2str() << " - " << "poller fd readable " << r1 << " -> " << r2 << ", run_for after wakeup "
+                  << (jar::steady_now_ns() - beg) / 1000000 << "ms" << std::endl;
+    }
+    {
+        // run_for按执行器的时钟计时，虚拟时钟下一小时的等待在前进后立即返回；工作线程在stop后及时退出
+        jar::virtual_clock vc;
+        jar::poller e;
+        e.set_clock(vc);
+        auto beg = jar::steady_now_ns();
+        size_t n = 0;
+        std::thread t([&e, &n] { n = e.run_for(std::chrono::hours(1)); });
+        vc.settle(1);
+        e.submit((jar::func_vv) [] { });
+        vc.settle(1);
+        vc.advance(std::chrono::hours(1));
+        t.join();
+        e.start();
+        vc.settle(1);
+        e.stop();
+        std::cout << jar::now2str() << " - " << "poller run_for on virtual clock: " << n << " in "
+                  << (jar::steady_now_ns() - beg) / 1000000 << "ms" << std::endl;
+    }
     {
         jar::delayer e(std::chrono::milliseconds(500));
         e.submit((jar::func_vv) [] {
@@ -86,6 +315,19 @@ void test_pool() {
             });
         }
         std::this_thread::sleep_for(std::chrono::milliseconds(1000));
+        auto s0 = pool.stats();
+
+        // 大量短任务不会让线程数暴涨
+        std::atomic<int> count(0);
+        for (int i = 0; i < 100000; i++) pool.submit((jar::func_vv) [&count] { count++; });
+        while (count < 100000) std::this_thread::yield();
+        auto s1 = pool.stats();
+
+        // 空闲一段时间后收缩到cached_size，线程被停放
+        std::this_thread::sleep_for(std::chrono::milliseconds(1500));
+        auto s2 = pool.stats();
+        std::cout << jar::now2str() << " - " << "cached_pool long tasks: size " << s0.size << ", grown " << s0.grown << ", migrated " << s0.migrated
+                  << "; short burst: size " << s1.size << "; idle: size " << s2.size << ", parked " << s2.parked << std::endl;
     }
 }
 
@@ -160,6 +402,22 @@ void test_main_pool() {
 }
 
 void test_event() {
+    {
+        // 外部计数满了以后，新的读者等到有快照归还
+        jar::rcu<int> v(1);
+        std::vector<jar::rcu<int>::reader> held;
+        held.reserve(65535);
+        for (int i = 0; i < 65535; i++) held.push_back(v.read());
+        std::atomic<bool> got(false);
+        std::thread t([&v, &got] { got = 1 == *v.read(); });
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        bool waited = !got;
+        held.pop_back();
+        t.join();
+        v.store(2);
+        held.clear();
+        std::cout << jar::now2str() << " - " << "rcu saturated: waited " << waited << ", got " << got << ", now " << *v.read() << std::endl;
+    }
     {
         jar::event_queue<uint32_t>      queue_int;
         jar::event_queue<std::string>   queue_str;
@@ -173,6 +431,7 @@ void test_event() {
 
         queue_int.pub(0x00000001, std::string("Hello World!"));
         queue_str.pub("0x00000001", std::string("Hello World!"));
+        queue_int.pub(0x00000001, 42); // 参数类型不匹配，订阅者被跳过
 
         std::this_thread::sleep_for(std::chrono::milliseconds(500));
     }
@@ -183,14 +442,532 @@ void test_event() {
         jar::pub(0x0000000000000001LL);
         std::this_thread::sleep_for(std::chrono::milliseconds(500));
     }
+    {
+        jar::event_queue<uint32_t> queue;
+        auto id = queue.sub(0x00000002, (jar::func_v<int>) [] (int i) {
+            std::cout << jar::now2str() << " - " << "event_queue sub: " << i << std::endl;
+        });
+        queue.pub(0x00000002, 1);
+        queue.pub(0x00000002, 2);
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        bool ok = queue.unsub(0x00000002, id);
+        std::cout << jar::now2str() << " - " << "event_queue unsub: " << ok << std::endl;
+        queue.pub(0x00000002, 3);
+        queue.pub(0x00000003, 4);
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    }
+    {
+        jar::fixed_pool pool(2);
+        jar::event_queue<uint32_t> queue(pool);
+        queue.sub(0x00000004, (jar::func_v<int>) [] (int i) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(50));
+            std::cout << jar::now2str() << " - " << "parallel event_queue slow: " << i << std::endl;
+        });
+        queue.sub(0x00000004, (jar::func_v<int>) [] (int i) {
+            std::cout << jar::now2str() << " - " << "parallel event_queue fast: " << i << std::endl;
+        });
+        for (int i = 0; i < 3; i++) queue.pub(0x00000004, i);
+        std::this_thread::sleep_for(std::chrono::milliseconds(300));
+    }
+    {
+        jar::queuer ui, session;
+        ui.start();
+        session.start();
+        std::thread::id ui_tid, session_tid;
+        ui.submit((jar::func_vv) [&ui_tid] { ui_tid = std::this_thread::get_id(); });
+        session.submit((jar::func_vv) [&session_tid] { session_tid = std::this_thread::get_id(); });
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+
+        jar::event_queue<uint32_t> queue;
+        std::atomic<int> on_ui(0), on_session(0);
+        queue.sub(0x0000000a, ui, (jar::func_v<int>) [&on_ui, &ui_tid] (int) { if (std::this_thread::get_id() == ui_tid) on_ui++; });
+        queue.sub(0x0000000a, ui, (jar::func_v<int>) [&on_ui, &ui_tid] (int) { if (std::this_thread::get_id() == ui_tid) on_ui++; });
+        auto id = queue.sub(0x0000000a, session, (jar::func_v<int>) [&on_session, &session_tid] (int) {
+            if (std::this_thread::get_id() == session_tid) on_session++;
+        });
+        for (int i = 0; i < 3; i++) queue.pub(0x0000000a, i);
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        queue.unsub(0x0000000a, id);
+        queue.pub(0x0000000a, 3);
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        std::cout << jar::now2str() << " - " << "event_queue affine on ui " << on_ui << ", on session " << on_session << std::endl;
+    }
+    {
+        jar::event_queue<uint32_t> queue;
+        queue.sub(0x00000005, (jar::func_v<int>) [] (int i) {
+            std::cout << jar::now2str() << " - " << "event_queue pub_sync: " << i << std::endl;
+        });
+        queue.pub_sync(0x00000005, 1);
+        queue.set_sync(true);
+        queue.pub(0x00000005, 2);
+        std::cout << jar::now2str() << " - " << "event_queue pub_sync returned" << std::endl;
+    }
+    {
+        jar::event_queue<uint32_t> queue;
+        queue.set_capacity(4, jar::overflow::drop_oldest);
+        queue.set_capacity(0x00000007, 2, jar::overflow::reject);
+        queue.sub(0x00000006, (jar::func_v<int>) [] (int i) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            std::cout << jar::now2str() << " - " << "bounded event_queue: " << i << std::endl;
+        });
+        queue.sub(0x00000007, (jar::func_v<int>) [] (int) { });
+        for (int i = 0; i < 10; i++) queue.pub(0x00000006, i);
+        int accepted = 0;
+        for (int i = 0; i < 10; i++) accepted += queue.pub(0x00000007, i);
+        std::this_thread::sleep_for(std::chrono::milliseconds(200));
+        auto s = queue.stats();
+        auto t = queue.stats(0x00000007);
+        std::cout << jar::now2str() << " - " << "bounded event_queue stats: dropped " << s.dropped
+                  << ", rejected " << t.rejected << ", accepted " << accepted << ", depth " << s.depth << std::endl;
+    }
+    {
+        // 并行分发模式下位置到订阅者执行完才释放；订阅者向本队列阻塞发布时按reject处理
+        jar::fixed_pool pool(2);
+        jar::event_queue<uint32_t> queue(pool);
+        queue.set_capacity(2);
+        std::atomic<bool> nested(true);
+        queue.sub(0x00000006, (jar::func_v<int>) [&queue, &nested] (int i) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(20));
+            if (0 == i) nested = queue.pub(0x00000006, 100);
+        });
+        size_t depth = 0;
+        for (int i = 0; i < 6; i++) {
+            queue.pub(0x00000006, i);
+            depth = std::max(depth, queue.stats().depth);
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(200));
+        auto s = queue.stats();
+        queue.set_capacity(0);
+        queue.pub(0x00000006, 7);
+        std::cout << jar::now2str() << " - " << "bounded parallel event_queue: max depth " << depth << ", blocked " << s.blocked
+                  << ", nested pub " << nested << ", depth after unbound " << queue.stats().depth << std::endl;
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    }
+    {
+        jar::event_queue<uint32_t> queue;
+        for (int i = 0; i < 3; i++) {
+            queue.sub(0x00000008, (jar::func_v<const jar::shared<std::vector<char>> &>) [i] (const jar::shared<std::vector<char>> & payload) {
+                std::cout << jar::now2str() << " - " << "shared payload " << i << ": " << payload->size() << " bytes at " << (const void *) payload->data() << std::endl;
+            });
+        }
+        queue.pub(0x00000008, jar::share(std::vector<char>(1 << 20)));
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    }
+    {
+        char dir[] = "/tmp/jar_journal_XXXXXX";
+        mkdtemp(dir);
+        {
+            jar::journal j(dir, 4096);
+            jar::event_queue<uint32_t> queue;
+            queue.set_journal(&j);
+            queue.sub(0x00000009, (jar::func_v<int, double>) [] (int, double) { });
+            for (int i = 0; i < 200; i++) {
+                queue.pub_sync(0x00000009, i, i * 0.5);
+                if (0 == i % 50) queue.pub_sync(0x0000000a, std::string("journal ") + std::to_string(i));
+            }
+            queue.pub_sync(0x0000000b, 1.5f); // 回放时没有对应的订阅，被跳过
+        }
+        {
+            jar::journal j(dir, 4096);
+            jar::event_queue<uint32_t> queue;
+            double sum = 0;
+            std::string order;
+            queue.sub(0x00000009, (jar::func_v<int, double>) [&sum] (int, double d) { sum += d; });
+            queue.sub(0x0000000a, (jar::func_v<std::string>) [&sum, &order] (std::string s) {
+                order += s + " after " + std::to_string(sum) + "; ";
+            });
+            size_t skipped;
+            auto n = queue.replay(j, skipped);
+            std::cout << jar::now2str() << " - " << "journal replay: " << n << " events, " << skipped << " skipped, sum " << sum << ", " << order << std::endl;
+        }
+        std::system((std::string("rm -rf ") + dir).c_str());
+    }
+    {
+        // 模拟崩溃：第4条记录的校验被破坏，之后的记录仍完整。重新打开后从那里追加，旧的记录不能接在新记录后面被回放
+        char dir[] = "/tmp/jar_journal_XXXXXX";
+        mkdtemp(dir);
+        {
+            jar::journal j(dir, 4096);
+            for (int i = 0; i < 10; i++) j.append(1, &i, sizeof(i));
+        }
+        auto fd = open((std::string(dir) + "/0000000000000000.jnl").c_str(), O_RDWR);
+        if (fd >= 0) {
+            uint32_t bad = 0;
+            auto n = pwrite(fd, &bad, sizeof(bad), 3 * 24 + 4);
+            (void) n;
+            close(fd);
+        }
+        {
+            jar::journal j(dir, 4096);
+            int v = 100;
+            j.append(2, &v, sizeof(v));
+        }
+        jar::journal j(dir, 4096);
+        std::string seen;
+        j.replay([&seen] (uint64_t, const char * data, size_t) { seen += std::to_string(*(const int *) data) + " "; });
+        std::cout << jar::now2str() << " - " << "journal after crash: " << seen << std::endl;
+        std::system((std::string("rm -rf ") + dir).c_str());
+    }
+    {
+        jar::event_queue<std::string> queue;
+        queue.set_conflation("quote", jar::conflation::last_value);
+        queue.set_conflation("trade", jar::conflation::window, std::chrono::milliseconds(100));
+        queue.sub("quote", (jar::func_v<int>) [] (int i) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            std::cout << jar::now2str() << " - " << "conflation last_value: " << i << std::endl;
+        });
+        queue.sub("trade", (jar::func_v<int>) [] (int i) {
+            std::cout << jar::now2str() << " - " << "conflation window: " << i << std::endl;
+        });
+        queue.sub_batch("order", (jar::func_v<std::vector<std::tuple<int>>>) [] (std::vector<std::tuple<int>> items) {
+            std::cout << jar::now2str() << " - " << "sub_batch: " << items.size() << " items, last " << std::get<0>(items.back()) << std::endl;
+        });
+        queue.sub_batch("order", (jar::func_v<std::vector<std::tuple<int>>>) [] (std::vector<std::tuple<int>> items) {
+            std::cout << jar::now2str() << " - " << "sub_batch capacity 16: " << items.size() << " items, last " << std::get<0>(items.back()) << std::endl;
+        }, 16);
+        for (int i = 0; i < 100; i++) {
+            queue.pub(std::string("quote"), i);
+            queue.pub(std::string("trade"), i);
+            queue.pub(std::string("order"), i);
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(300));
+    }
+    {
+        jar::topic_queue queue;
+        queue.sub("orders.us.*", (jar::func_v<int>) [] (int qty) {
+            std::cout << jar::now2str() << " - " << "topic_queue orders.us.*: " << qty << std::endl;
+        });
+        auto id = queue.sub("orders.#", (jar::func_v<int>) [] (int qty) {
+            std::cout << jar::now2str() << " - " << "topic_queue orders.#: " << qty << std::endl;
+        });
+        queue.pub("orders.us.nyse", 1);
+        queue.pub("orders.eu", 2);
+        queue.pub("orders", 3);
+        queue.pub("quotes.us.nyse", 4);
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        queue.unsub("orders.#", id);
+        queue.pub("orders.us.nyse", 5);
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    }
+    {
+        using login  = jar::typed_event<0x01, std::string>;
+        using logout = jar::typed_event<0x02, std::string, int>;
+
+        jar::typed_event_queue<login, logout> queue;
+        queue.sub<login>([] (std::string user) {
+            std::cout << jar::now2str() << " - " << "typed_event_queue login: " << user << std::endl;
+        });
+        auto id = queue.sub<logout>([] (std::string user, int code) {
+            std::cout << jar::now2str() << " - " << "typed_event_queue logout: " << user << " " << code << std::endl;
+        });
+        queue.pub<login>("fomjar");
+        queue.pub<logout>("fomjar", 0);
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        queue.unsub<logout>(id);
+        queue.pub<logout>("fomjar", 1);
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    }
+    {
+        jar::sharded_event_queue<uint32_t> queue(4);
+        std::mutex mutex;
+        std::map<uint32_t, std::vector<int>> seen;
+        for (uint32_t e = 0; e < 8; e++) {
+            queue.sub(e, (jar::func_v<int>) [&mutex, &seen, e] (int i) {
+                std::lock_guard<std::mutex> lock(mutex);
+                seen[e].push_back(i);
+            });
+        }
+        for (int i = 0; i < 100; i++) {
+            for (uint32_t e = 0; e < 8; e++) queue.pub(e, i);
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(200));
+        bool ordered = true;
+        for (auto & p : seen) ordered = ordered && p.second.size() == 100 && std::is_sorted(p.second.begin(), p.second.end());
+        std::cout << jar::now2str() << " - " << "sharded_event_queue " << queue.shard_count() << " shards, " << seen.size() << " events in order: " << ordered << std::endl;
+    }
+    {
+        auto name = "/jar_test_" + std::to_string(getpid());
+        jar::shm_bus bus(name, 64);
+        std::atomic<int> count(0);
+        bus.sub(0x01, (jar::func_v<int, double>) [&count] (int id, double px) {
+            if (count++ < 3)
+                std::cout << jar::now2str() << " - " << "shm_bus " << id << ": " << px << std::endl;
+        });
+        // 本进程已有多个线程，fork后的子进程立即exec自身作为发布者，不在子进程里创建线程
+        auto child = fork();
+        if (0 == child) {
+            execl("/proc/self/exe", "jar_test", "--shm-peer", name.c_str(), (char *) nullptr);
+            _exit(127);
+        }
+        waitpid(child, nullptr, 0);
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        std::cout << jar::now2str() << " - " << "shm_bus received " << count << " from pid " << child << ", lost " << bus.lost() << std::endl;
+        jar::shm_bus::unlink(name);
+    }
+    {
+        // 布局版本不一致的总线拒绝打开
+        auto name = "/jar_test_layout_" + std::to_string(getpid());
+        bool created;
+        {
+            jar::shm_bus bus(name, 16);
+            created = bus.is_open();
+        }
+        auto fd = shm_open(name.c_str(), O_RDWR, 0644);
+        if (fd >= 0) {
+            uint32_t version = 1;
+            auto n = pwrite(fd, &version, sizeof(version), sizeof(uint64_t));
+            (void) n;
+            close(fd);
+        }
+        jar::shm_bus bus(name, 16);
+        std::cout << jar::now2str() << " - " << "shm_bus created " << created << ", opened with old layout " << bus.is_open() << std::endl;
+        jar::shm_bus::unlink(name);
+    }
+}
+
+void test_channel() {
+    {
+        // 只能移动的元素，SPSC在两个queuer之间传递
+        const int ITEMS = 1000000;
+        jar::spsc_channel<std::unique_ptr<int>> ch(1024);
+        jar::queuer producer, consumer;
+        std::promise<long long> p;
+        producer.start();
+        consumer.start();
+        auto beg = jar::steady_now_ns();
+        consumer.submit((jar::func_vv) [&ch, &p] {
+            long long sum = 0;
+            std::unique_ptr<int> v;
+            while (ch.recv(v)) sum += *v;
+            p.set_value(sum);
+        });
+        producer.submit((jar::func_vv) [&ch, ITEMS] {
+            for (int i = 0; i < ITEMS; i++) ch.send(std::unique_ptr<int>(new int(i)));
+            ch.close();
+        });
+        auto sum = p.get_future().get();
+        std::cout << jar::now2str() << " - " << "spsc_channel sum " << sum << " in " << (jar::steady_now_ns() - beg) / 1000000 << "ms" << std::endl;
+    }
+    {
+        const int PRODUCERS = 3;
+        const int ITEMS     = 100000;
+        jar::mpmc_channel<int> ch(256);
+        std::atomic<long long> sum(0);
+        std::atomic<int> done(0);
+        std::vector<std::thread> threads;
+        for (int i = 0; i < 2; i++) {
+            threads.emplace_back([&ch, &sum] {
+                std::vector<int> batch;
+                while (ch.recv_batch(std::back_inserter(batch), 64) > 0) {
+                    for (auto v : batch) sum += v;
+                    batch.clear();
+                }
+            });
+        }
+        for (int i = 0; i < PRODUCERS; i++) {
+            threads.emplace_back([&ch, &done, ITEMS, PRODUCERS] {
+                std::vector<int> items(ITEMS);
+                for (int j = 0; j < ITEMS; j++) items[j] = j;
+                ch.send_batch(items.begin(), items.end());
+                if (PRODUCERS == ++done) ch.close();
+            });
+        }
+        for (auto & t : threads) t.join();
+        std::cout << jar::now2str() << " - " << "mpmc_channel sum " << sum << ", expect " << (long long) PRODUCERS * ITEMS * (ITEMS - 1) / 2 << std::endl;
+    }
+    {
+        jar::mpmc_channel<std::string> ch(2);
+        std::string a = "a", b = "b", c = "c", v;
+        bool full = ch.try_send(std::move(a)) && ch.try_send(std::move(b)) && !ch.try_send(std::move(c));
+        bool timeout = !ch.send_for(std::move(c), std::chrono::milliseconds(10));
+        ch.close();
+        bool closed = !ch.send("d");
+        std::string got;
+        while (ch.recv(v)) got += v;
+        bool empty = !ch.recv_for(v, std::chrono::milliseconds(10));
+        std::cout << jar::now2str() << " - " << "channel full " << full << ", kept '" << c << "', timeout " << timeout
+                  << ", closed " << closed << ", drained '" << got << "', empty " << empty << std::endl;
+    }
+    {
+        // 超长的超时不会溢出；与close竞争成功的发送一定能被取到
+        jar::mpmc_channel<int> ch(4);
+        int v = 0;
+        std::thread t([&ch] {
+            std::this_thread::sleep_for(std::chrono::milliseconds(20));
+            ch.send(1);
+        });
+        bool forever = ch.recv_for(v, std::chrono::hours::max());
+        t.join();
+        int stranded = 0;
+        for (int i = 0; i < 1000; i++) {
+            jar::spsc_channel<int> race(4);
+            bool sent = false;
+            std::thread s([&race, &sent] { sent = race.try_send(1); });
+            race.close();
+            int got = 0;
+            bool recv = race.recv(got);
+            s.join();
+            if (sent && !recv) stranded++;
+        }
+        std::cout << jar::now2str() << " - " << "channel recv_for hours::max " << forever << ", stranded after close " << stranded << std::endl;
+    }
+}
+
+void test_pipeline() {
+    const int ITEMS = 100000;
+    std::atomic<long long> sum(0);
+    jar::pipeline<int> p;
+    p.then<long long>("parse", [] (int & v) { return (long long) v * 2; }, {1, 64, 256})
+     .then<long long>("enrich", [] (long long & v) {
+            if (0 == v % 20000) std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            return v + 1;
+        }, {3, 16, 256})
+     .then_batch<long long>("aggregate", [] (std::vector<long long> & in, std::vector<long long> & out) {
+            long long s = 0;
+            for (auto v : in) s += v;
+            out.push_back(s);
+        }, {1, 128, 256})
+     .sink("write", [&sum] (long long & v) { sum += v; }, {1, 32, 64});
+    p.start();
+    auto beg = jar::steady_now_ns();
+    for (int i = 0; i < ITEMS; i++) p.push(i);
+    p.close();
+    p.wait();
+    auto elapsed = jar::steady_now_ns() - beg;
+    std::cout << jar::now2str() << " - " << "pipeline sum " << sum << ", expect " << (long long) ITEMS * (ITEMS - 1) + ITEMS
+              << " in " << elapsed / 1000000 << "ms" << std::endl;
+    for (auto & s : p.stats()) {
+        std::cout << jar::now2str() << " - " << "pipeline stage " << s.name << " x" << s.workers << ": processed " << s.processed
+                  << ", emitted " << s.emitted << ", " << (long long) (s.processed * 1e9 / elapsed) << "/s, busy "
+                  << (int) (s.busy_ns * 100 / (s.workers * elapsed)) << "%, depth " << s.depth << "/" << s.capacity << std::endl;
+    }
+    std::cout << jar::now2str() << " - " << "pipeline push after close " << p.push(0) << std::endl;
 }
 
-int main() {
+void test_future() {
+    {
+        // 扇出到pool，扇入后在pool上汇总，等待过程不占用pool线程
+        std::vector<jar::future<int>> parts;
+        for (int i = 0; i < 8; i++) {
+            jar::promise<int> p;
+            parts.push_back(p.get_future());
+            jar::async(p, (jar::func<int(int)>) [] (int v) { return v * v; }, i);
+        }
+        auto total = jar::when_all(parts).then(jar::pool, [] (std::vector<int> vs) {
+            int s = 0;
+            for (auto v : vs) s += v;
+            return s;
+        });
+        std::cout << jar::now2str() << " - " << "future when_all sum " << total.get() << std::endl;
+    }
+    {
+        jar::promise<std::string> slow, fast;
+        std::vector<jar::future<std::string>> fs;
+        fs.push_back(slow.get_future());
+        fs.push_back(fast.get_future());
+        auto any = jar::when_any(fs);
+        jar::async(fast, (jar::func<std::string()>) [] { return std::string("fast"); });
+        auto r = any.get();
+        slow.set_value("slow");
+        std::cout << jar::now2str() << " - " << "future when_any #" << r.first << " " << r.second << std::endl;
+    }
+    {
+        jar::queuer q;
+        q.start();
+        jar::promise<int> p;
+        std::atomic<bool> called(false);
+        auto f = p.get_future()
+            .then(q, [] (int) -> int { throw std::runtime_error("boom"); })
+            .then(q, [&called] (int v) { called = true; return v; });
+        q.submit(p, (jar::func<int()>) [] { return 1; });
+        std::string err;
+        try { f.get(); } catch (const std::exception & e) { err = e.what(); }
+
+        jar::future<void> broken;
+        {
+            jar::promise<void> lost;
+            broken = lost.get_future();
+        }
+        std::string err2;
+        try { broken.get(); } catch (const std::future_error & e) { err2 = e.code() == std::future_errc::broken_promise ? "broken_promise" : e.what(); }
+
+        jar::promise<void> never;
+        auto timeout = !never.get_future().wait_for(std::chrono::milliseconds(10));
+        std::cout << jar::now2str() << " - " << "future exception '" << err << "', skipped " << !called << ", " << err2 << ", timeout " << timeout << std::endl;
+    }
+    {
+        // 值的复制抛出异常后，promise仍可以设置异常
+        struct bomb {
+            bomb() { }
+            bomb(const bomb &) { throw std::runtime_error("copy"); }
+        };
+        jar::promise<bomb> p;
+        auto f = p.get_future();
+        bomb b;
+        std::string err;
+        try { p.set_value(b); } catch (...) { p.set_exception(std::current_exception()); }
+        try { f.get(); } catch (const std::exception & e) { err = e.what(); }
+        std::cout << jar::now2str() << " - " << "future throwing copy '" << err << "'" << std::endl;
+    }
+}
+
+void test_watchdog() {
+    jar::watchdog wd(std::chrono::milliseconds(50));
+    std::mutex mutex;
+    std::vector<jar::stall_report> reports;
+    wd.set_capture_stack(true);
+    wd.set_handler([&mutex, &reports] (const jar::stall_report & s) {
+        std::lock_guard<std::mutex> guard(mutex);
+        reports.push_back(s);
+    });
+
+    jar::queuer q;
+    q.set_name("stalled queuer");
+    q.start();
+    q.submit((jar::func_vv) [] { std::this_thread::sleep_for(std::chrono::milliseconds(300)); });
+    for (int i = 0; i < 3; i++) q.submit((jar::func_vv) [] { });
+    // looper在自己的锁内执行任务，同样要被报告，且watchdog不能阻塞在它的锁上
+    jar::looper l(std::chrono::milliseconds(10));
+    l.set_name("stalled looper");
+    std::atomic<bool> once(false);
+    l.submit((jar::func_vv) [&once] { if (!once.exchange(true)) std::this_thread::sleep_for(std::chrono::milliseconds(300)); });
+    l.start();
+    wd.start();
+    std::this_thread::sleep_for(std::chrono::milliseconds(400));
+    wd.stop();
+
+    std::lock_guard<std::mutex> guard(mutex);
+    std::cout << jar::now2str() << " - " << "watchdog reports " << reports.size() << std::endl;
+    for (auto & s : reports) {
+        std::cout << jar::now2str() << " - " << "watchdog " << s.name << " tid " << s.tid << " running "
+                  << s.running_ns / 1000000 << "ms backlog " << s.backlog << " frames " << s.stack.size() << std::endl;
+    }
+}
+
+// test_event中shm_bus的另一端，由fork出的子进程exec进入
+int shm_peer(const std::string & name) {
+    jar::shm_bus peer(name);
+    for (int i = 0; i < 10; i++) {
+        peer.pub(0x01, i, i * 1.5);
+        peer.pub(0x02, i);
+    }
+    return 0;
+}
+
+int main(int argc, char ** argv) {
+    if (3 == argc && std::string("--shm-peer") == argv[1]) return shm_peer(argv[2]);
+
     test_any();
+    test_time();
+    test_log();
     test_exec();
     test_pool();
     test_main_pool();
     test_event();
+    test_channel();
+    test_pipeline();
+    test_future();
+    test_watchdog();
 
     std::cout << "Hello World!" << std::endl;
 